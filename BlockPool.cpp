@@ -0,0 +1,76 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BlockPool.h"
+#include "Logger.h"
+
+#include <cstdlib>
+
+using namespace std;
+
+BlockPool::BlockPool(void)
+    : m_slab(nullptr)
+    , m_block_size(0)
+    , m_count(0)
+{
+}
+
+BlockPool::~BlockPool(void)
+{
+    free(m_slab);
+}
+
+bool BlockPool::Allocate(size_t block_size, size_t count, size_t alignment)
+{
+    if (m_slab)
+    {
+        ERRORLOG << "Block pool already allocated.";
+        return false;
+    }
+
+    // Round each slot up so every block starts on an aligned boundary.
+    size_t stride = (block_size + alignment - 1) / alignment * alignment;
+
+    void *slab = nullptr;
+    if (posix_memalign(&slab, alignment, stride * count) != 0)
+    {
+        CRITLOG << "Unable to allocate " << count << " blocks of "
+                << block_size << " bytes.";
+        return false;
+    }
+    m_slab = reinterpret_cast<uint8_t *>(slab);
+    m_block_size = block_size;
+
+    m_blocks.reset(new Block[count]);
+    m_count = count;
+    m_free.reset(new free_t(count));
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        m_blocks[idx].data     = m_slab + idx * stride;
+        m_blocks[idx].capacity = block_size;
+        m_blocks[idx].size     = 0;
+        m_blocks[idx].offset   = 0;
+        m_blocks[idx].refs     = 0;
+        m_free->push(&m_blocks[idx]);
+    }
+
+    DEBUGLOG << "Block pool: " << count << " x " << block_size << " bytes.";
+    return true;
+}
@@ -0,0 +1,91 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BlockPool_H_
+#define _BlockPool_H_
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+struct Block
+{
+    uint8_t *data;      // Start of the block's slot in the slab
+    size_t   capacity;  // Usable bytes in the slot
+    size_t   size;      // Bytes of valid data
+    size_t   offset;    // Bytes already consumed by the writer
+
+    // One for each holder: the writer and any fan-out sinks.  Whoever
+    // drops the last reference sees to the block's release.
+    std::atomic<int> refs;
+};
+
+/*
+ * A fixed set of equally sized blocks carved out of one aligned slab.
+ *
+ * Blocks are handed out by Acquire() on the producer side and given
+ * back by Release() on the consumer side.  The free list is a
+ * single-producer/single-consumer ring running in the opposite
+ * direction of the data queue, so neither side ever takes a lock.
+ */
+class BlockPool
+{
+  public:
+    enum constants { CACHE_LINE = 64 };
+
+    BlockPool(void);
+    ~BlockPool(void);
+
+    bool Allocate(size_t block_size, size_t count,
+                  size_t alignment = CACHE_LINE);
+
+    Block *Acquire(void)
+    {
+        Block *blk = nullptr;
+        if (!m_free || !m_free->pop(blk))
+            return nullptr;
+        blk->size = blk->offset = 0;
+        blk->refs = 1;
+        return blk;
+    }
+    void Release(Block *blk) { m_free->push(blk); }
+
+    size_t BlockSize(void) const { return m_block_size; }
+    size_t Count(void) const { return m_count; }
+    size_t Available(void) const
+    { return m_free ? m_free->read_available() : 0; }
+
+  private:
+    BlockPool(const BlockPool &) = delete;
+    BlockPool & operator=(const BlockPool &) = delete;
+
+    using free_t = boost::lockfree::spsc_queue<Block *>;
+
+    uint8_t                *m_slab;
+    size_t                  m_block_size;
+    std::unique_ptr<Block[]> m_blocks;
+    size_t                  m_count;
+    std::unique_ptr<free_t> m_free;
+};
+
+#endif
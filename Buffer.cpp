@@ -0,0 +1,914 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Buffer.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+Buffer::Buffer(uint32_t ts_bitrate, const atomic<bool> & run,
+               const atomic<bool> & streaming, const atomic<bool> & xon,
+               int fd, int seconds)
+    : m_thread()
+    , m_run(true)
+    , m_active(run)
+    , m_streaming(streaming)
+    , m_xon(xon)
+    , m_fd(fd)
+    , m_cb(std::bind(&Buffer::Fill, this, std::placeholders::_1,
+                     std::placeholders::_2))
+    , m_block_size(0)
+    , m_out_pos(0)
+    , m_write_errors(0)
+    , m_pipe_size(0)
+    , m_nonblock(false)
+    , m_stall_limit(0)
+    , m_out_blocked(false)
+    , m_was_xon(true)
+    , m_out_failed(false)
+    , m_undelivered(0)
+    , m_waiting(false)
+    , m_slept_with_data(0)
+    , m_dropped(0)
+    , m_queued(0)
+    , m_above_high(false)
+    , m_high_events(0)
+    , m_high_ms(0)
+    , m_spilled(0)
+    , m_spill_full(false)
+    , m_reframe_on(false)
+    , m_deliver(std::bind(&Buffer::Deliver, this, std::placeholders::_1,
+                          std::placeholders::_2))
+    , m_sync_losses(0)
+    , m_monitor_on(false)
+    , m_pid_filter_on(false)
+    , m_pid_filter(m_psi)
+    , m_null_bytes(0)
+    , m_pid_bytes(0)
+    , m_gop_drop(false)
+    , m_gop(m_psi)
+    , m_filter_unaligned(0)
+    , m_gops_dropped(0)
+    , m_gop_bytes(0)
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_event_fd < 0)
+        CRITLOG << "Buffer: unable to create eventfd: " << strerror(errno);
+
+    // The limit is in bytes: `seconds' of the stream.
+    if (seconds < 1)
+        seconds = BUFFER_SECONDS;
+    m_budget = static_cast<uint64_t>(ts_bitrate / 8) * seconds;
+    if (m_budget < MIN_BUDGET)
+        m_budget = MIN_BUDGET;
+    else if (m_budget > MAX_BUDGET)
+        m_budget = MAX_BUDGET;
+    m_high_water = m_budget * HIGH_WATER_PCT / 100;
+    m_low_water  = m_budget * LOW_WATER_PCT / 100;
+
+    INFOLOG << "Buffer: " << m_budget << " byte budget ("
+            << seconds << "s at " << ts_bitrate << " bps), "
+            << "high/low water " << m_high_water << "/" << m_low_water;
+    m_filtered.reserve(BLOCK_SIZE * 8);
+    m_writer.reset(OutputWriter::Create(m_fd, false, 1));
+
+    int pipe_size = fcntl(m_fd, F_GETPIPE_SZ);
+    m_pipe_size = (pipe_size < 0) ? 0 : pipe_size;
+
+    m_heartbeat = std::chrono::system_clock::now();
+}
+
+Buffer::~Buffer(void)
+{
+    m_run = false;
+    Wake();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_fanout.Stop();
+    if (m_event_fd >= 0)
+        close(m_event_fd);
+}
+
+bool Buffer::Start(void)
+{
+    /*
+     * Each chunk leaves its last block partly empty, so the pool gets
+     * some headroom on top of the budget; that way the budget, not the
+     * pool, is what runs out.  Fan-out sinks get their queue limits on
+     * top, so a slow one never takes blocks from the main output.
+     * Memory use is fixed per tuner and known up front.
+     */
+    uint64_t bytes = m_budget + m_fanout.MaxBytes();
+    size_t   count = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    count += count * TAIL_SLACK_PCT / 100 +
+             POOL_SLACK * (1 + m_fanout.Count());
+
+    // Page aligned, so no page the pipe refers to (see EnableSplice())
+    // is ever shared with another block.
+    if (!m_pool.Allocate(BLOCK_SIZE, count, sysconf(_SC_PAGESIZE)))
+    {
+        CRITLOG << "Buffer: cannot queue " << bytes << " bytes, lower "
+                << "buffer-seconds or the fan-out limits.";
+        return false;
+    }
+    INFOLOG << "Buffer: " << count << " blocks of " << BLOCK_SIZE
+            << " bytes" << (m_fanout.Count() ? ", shared with " +
+                            to_string(m_fanout.Count()) + " fan-out sinks."
+                            : ".");
+    m_data.reset(new stack_t(count));
+    m_pending.set_capacity(count);
+    m_held.set_capacity(count);
+
+    m_fanout.Start(count);
+    m_thread = std::thread(&Buffer::Run, this);
+    return true;
+}
+
+bool Buffer::EnableSplice(const string & tee_path)
+{
+    m_splicer.reset(new PipeSplicer(m_fd));
+    m_splicer->SetNonBlocking(m_nonblock);
+    if (m_splicer->Open(tee_path))
+        return true;
+    m_splicer.reset();
+    return false;
+}
+
+bool Buffer::SetPipeSize(int bytes)
+{
+    if (m_pipe_size == 0)
+        return false;
+
+    int size = fcntl(m_fd, F_SETPIPE_SZ, bytes);
+    if (size < 0)
+    {
+        WARNLOG << "Buffer: unable to resize output pipe to " << bytes
+                << " bytes: " << strerror(errno);
+        return false;
+    }
+    m_pipe_size = size;
+    INFOLOG << "Buffer: output pipe is " << size << " bytes.";
+    return true;
+}
+
+bool Buffer::SetNonBlocking(int stall_seconds)
+{
+    int flags = fcntl(m_fd, F_GETFL);
+    if (flags < 0 || fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        WARNLOG << "Buffer: unable to make output non-blocking: "
+                << strerror(errno);
+        return false;
+    }
+    m_nonblock = true;
+    m_stall_limit = stall_seconds;
+    if (m_splicer)
+        m_splicer->SetNonBlocking(true);
+    INFOLOG << "Buffer: non-blocking output, giving up after "
+            << stall_seconds << "s without progress.";
+    return true;
+}
+
+int Buffer::PipeFill(void) const
+{
+    int queued = 0;
+    if (m_pipe_size == 0 || ioctl(m_fd, FIONREAD, &queued) < 0)
+        return -1;
+    return static_cast<uint64_t>(queued) * 100 / m_pipe_size;
+}
+
+void Buffer::Fill(void * data, size_t len)
+{
+    if (len < 1)
+        return;
+
+    if (m_out_failed)
+    {
+        m_undelivered += len;
+        m_heartbeat = std::chrono::system_clock::now();
+        return;
+    }
+
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(data);
+
+    if (m_reframe_on)
+    {
+        // A partial packet from before a restart belongs to nothing.
+        if (!m_streaming)
+            m_reframe.Reset();
+        m_reframe.Process(src, len, m_deliver);
+        m_sync_losses = m_reframe.SyncLosses();
+    }
+    else
+        Deliver(src, len);
+
+    // Only Fill() raises the flag and only Run() clears it.
+    uint64_t queued = m_queued;
+    if (queued >= m_high_water && !m_above_high)
+    {
+        m_high_since = std::chrono::steady_clock::now();
+        m_above_high = true;
+        ++m_high_events;
+        WARNLOG << "Buffer: above high watermark, " << queued << " of "
+                << m_budget << " bytes queued ("
+                << queued * 100 / m_budget << "%).";
+    }
+
+    // Only pay for the syscall when Run() is actually asleep.
+    if (m_waiting.exchange(false))
+        Wake();
+
+    m_heartbeat = std::chrono::system_clock::now();
+}
+
+void Buffer::Deliver(const uint8_t * src, size_t len)
+{
+    // Look at the stream before anything here drops from it.
+    if (m_monitor_on)
+    {
+        if (!m_streaming)
+            m_monitor.Restart();
+        m_monitor.Process(src, len);
+    }
+
+    if (m_pid_filter_on || m_gop_drop)
+        Filter(src, len);
+    else
+        Queue(src, len);
+}
+
+/*
+ * Pass every packet through the PID and GOP filters.  While nothing is
+ * being dropped the chunk is queued as is; otherwise the packets that
+ * are kept are compacted first, so they do not each take up a block.
+ */
+void Buffer::Filter(const uint8_t * src, size_t len)
+{
+    if (len % TS_PACKET != 0 || src[0] != GopFilter::SYNC_BYTE)
+    {
+        // Can't see packet boundaries; whole chunks it is.
+        if (m_filter_unaligned++ % 1000 == 0)
+            WARNLOG << "Buffer: chunk not TS aligned, PID filter and GOP "
+                    << "aware dropping unavailable (" << m_filter_unaligned
+                    << " chunks).";
+        Queue(src, len);
+        return;
+    }
+
+    bool   overload = m_above_high;
+    size_t off;
+    GopFilter::verdict keep = GopFilter::KEEP;
+
+    for (off = 0; off < len; off += TS_PACKET)
+        if ((keep = Keep(src + off, overload)) != GopFilter::KEEP)
+            break;
+    if (off == len)
+    {
+        Queue(src, len);
+        return;
+    }
+
+    // Copy runs of kept packets.
+    m_filtered.assign(src, src + off);
+    if (keep == GopFilter::KEEP_PCR)
+        KeepPCR(src + off);
+    size_t run = off + TS_PACKET;
+    for (off = run; off < len; off += TS_PACKET)
+    {
+        keep = Keep(src + off, overload);
+        if (keep == GopFilter::KEEP)
+            continue;
+        m_filtered.insert(m_filtered.end(), src + run, src + off);
+        if (keep == GopFilter::KEEP_PCR)
+            KeepPCR(src + off);
+        run = off + TS_PACKET;
+    }
+    if (run < len)
+        m_filtered.insert(m_filtered.end(), src + run, src + len);
+
+    m_null_bytes    = m_pid_filter.NullBytes();
+    m_pid_bytes     = m_pid_filter.PIDBytes();
+    m_gops_dropped  = m_gop.GopsDropped();
+    m_gop_bytes     = m_gop.BytesDropped();
+    if (!m_filtered.empty())
+        Queue(m_filtered.data(), m_filtered.size());
+}
+
+// Video being dropped still has to carry the clock.
+void Buffer::KeepPCR(const uint8_t * pkt)
+{
+    m_filtered.insert(m_filtered.end(), pkt, pkt + TS_PACKET);
+    GopFilter::StripPayload(&m_filtered[m_filtered.size() - TS_PACKET]);
+}
+
+/*
+ * Copy into pool blocks and hand them to Run(), and to those fan-out
+ * sinks with room for them.  A chunk larger than a block is spread over
+ * several blocks.  Returns false if some of it had to be dropped from
+ * the main output.
+ */
+bool Buffer::Queue(const uint8_t * src, size_t len)
+{
+    static int dropped = 0;
+    bool keep = true;
+
+    while (len > 0)
+    {
+        size_t   want = (len < BLOCK_SIZE) ? len : BLOCK_SIZE;
+        uint32_t fan  = m_fanout.Accept(want);
+
+        keep = keep && (m_queued + want <= m_budget);
+        Block *blk = (keep || fan) ? m_pool.Acquire() : nullptr;
+        if (blk == nullptr)
+        {
+            m_fanout.Dropped(fan, want);
+            keep = false;
+            src += want;
+            len -= want;
+            continue;
+        }
+
+        blk->size = want;
+        memcpy(blk->data, src, blk->size);
+        src += blk->size;
+        len -= blk->size;
+
+        // Every holder is counted before any of them can let go.
+        blk->refs = (keep ? 1 : 0) + __builtin_popcount(fan);
+        m_fanout.Push(blk, fan);
+        if (keep)
+        {
+            // Never fails: the queue can hold every block in the pool.
+            m_queued += blk->size;
+            m_data->push(blk);
+        }
+    }
+
+    if (keep)
+    {
+        dropped = 0;
+        return true;
+    }
+
+    ++m_dropped;
+    if (++dropped % 25 == 0)
+        WARNLOG << "Packet queue overrun.  Dropped " << dropped
+                << "packets.";
+    return false;
+}
+
+void Buffer::Wake(void)
+{
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ERRORLOG << "Buffer: eventfd write failed: " << strerror(errno);
+}
+
+void Buffer::WaitForData(int timeout_ms)
+{
+    struct pollfd pfd[2];
+    int    cnt = 1;
+
+    pfd[0].fd      = m_event_fd;
+    pfd[0].events  = POLLIN;
+    pfd[0].revents = 0;
+
+    // Also wake when a full output has room again.  A write in flight
+    // wakes us through the eventfd instead.
+    if (m_out_blocked && m_writer->InFlight() == 0)
+    {
+        pfd[1].fd      = m_fd;
+        pfd[1].events  = POLLOUT;
+        pfd[1].revents = 0;
+        ++cnt;
+    }
+
+    if (poll(pfd, cnt, timeout_ms) > 0 && (pfd[0].revents & POLLIN))
+    {
+        uint64_t cnt;
+        if (read(m_event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+            ERRORLOG << "Buffer: eventfd read failed: " << strerror(errno);
+    }
+}
+
+string Buffer::Health(TSMonitor::Window & win) const
+{
+    ostringstream os;
+
+    if (m_monitor_on)
+        os << m_monitor.Report(win) << "; ";
+    os << "host dropped=" << m_dropped
+       << " gops_dropped=" << m_gops_dropped
+       << " gop_bytes=" << m_gop_bytes
+       << " sync_losses=" << m_sync_losses
+       << " null_stripped=" << m_null_bytes
+       << " pid_filtered=" << m_pid_bytes
+       << " queued=" << m_queued * 100 / m_budget << "%"
+       << " spilled=" << m_spill.Used();
+    if (m_pipe_size > 0)
+        os << " pipe=" << PipeFill() << "%";
+    if (m_splicer && !m_splicer->ByReference())
+        os << " tee_skipped=" << m_splicer->TeeSkipped();
+    if (m_out_failed)
+        os << " output_failed=\"" << m_out_error << "\""
+           << " undelivered=" << m_undelivered;
+    if (m_fanout.Count() > 0)
+        os << "; fanout " << m_fanout.Report();
+    return os.str();
+}
+
+/*
+ * Release blocks at the head of m_pending whose data has been
+ * written, and advance into the next partially written one.
+ */
+void Buffer::Consume(size_t bytes)
+{
+    m_out_pos += bytes;
+
+    size_t spilled = m_spill.Used();
+    if (spilled > 0)
+    {
+        if (bytes < spilled)
+            spilled = bytes;
+        m_spill.Consume(spilled);
+        bytes -= spilled;
+    }
+
+    while (bytes > 0 && !m_pending.empty())
+    {
+        Block  *blk = m_pending.front();
+        size_t  avail = blk->size - blk->offset;
+
+        if (bytes < avail)
+        {
+            blk->offset += bytes;
+            return;
+        }
+        bytes -= avail;
+        m_pending.pop_front();
+        Retire(blk);
+    }
+}
+
+void Buffer::Release(Block * blk)
+{
+    m_queued -= blk->size;
+    Unref(blk);
+}
+
+// Release a written block, or hold it while the pipe refers to it.
+void Buffer::Retire(Block * blk)
+{
+    if (m_splicer && m_splicer->ByReference())
+        m_held.push_back(Held{blk, m_splicer->Sent()});
+    else
+        Release(blk);
+}
+
+void Buffer::Reclaim(void)
+{
+    if (m_held.empty())
+        return;
+
+    m_splicer->Poll();
+    while (!m_held.empty() && m_splicer->Drained(m_held.front().end))
+    {
+        Release(m_held.front().blk);
+        m_held.pop_front();
+    }
+}
+
+void Buffer::CheckLowWater(void)
+{
+    if (!m_above_high || m_queued > m_low_water)
+        return;
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>
+              (std::chrono::steady_clock::now() - m_high_since).count();
+    m_high_ms += ms;
+    m_above_high = false;
+    INFOLOG << "Buffer: back under low watermark after " << ms << "ms, "
+            << m_queued << " bytes queued.";
+}
+
+void Buffer::Gather(void)
+{
+    Block *blk = nullptr;
+    while (!m_pending.full() && m_data->pop(blk))
+        m_pending.push_back(blk);
+}
+
+/*
+ * Keep memory use at the low watermark by moving the oldest queued
+ * data to disk, so the high watermark is only reached once the spill
+ * file is full.  Order is kept because everything in the spill file is
+ * written out before m_pending.
+ */
+void Buffer::Spill(void)
+{
+    // Blocks being written stay where they are.
+    if (!m_spill.IsOpen() || m_queued <= m_low_water ||
+        m_writer->InFlight() > 0)
+        return;
+
+    Gather();
+    while (m_queued > m_low_water && !m_pending.empty())
+    {
+        Block  *blk = m_pending.front();
+        size_t  len = blk->size - blk->offset;
+
+        if (!m_spill.Append(blk->data + blk->offset, len))
+        {
+            if (!m_spill_full)
+                WARNLOG << "Buffer: spill file full, " << m_spill.Used()
+                        << " bytes waiting on disk.";
+            m_spill_full = true;
+            return;
+        }
+        m_spilled += len;
+        m_pending.pop_front();
+        Release(blk);
+
+        if (m_pending.empty())
+            Gather();
+    }
+    m_spill_full = false;
+}
+
+/*
+ * Gather spilled data, then queued blocks, into a single writev of
+ * about m_block_size bytes -- the size MythTV asked for -- cut on a
+ * TS packet boundary.  A partial packet at the tail stays queued until
+ * the rest arrives.  Returns false if nothing could be written, or
+ * the previous write is still in flight.
+ */
+bool Buffer::WriteBatch(uint64_t & written, uint64_t & write_cnt)
+{
+    // io_uring does not give up on a full pipe; the write just stays
+    // in flight.
+    if (m_writer->InFlight() > 0 && !Reap(false, written, write_cnt))
+    {
+        if (m_writer->InFlight() > 0)
+            Stalled();
+        return false;
+    }
+
+    // Whatever the splicer could not pass on last time goes first.
+    if (m_splicer && m_splicer->Staged() > 0)
+    {
+        int err = m_splicer->Flush();
+        if (err < 0)
+            return Wrote(err, 0, written, write_cnt);
+    }
+
+    Reclaim();
+    Gather();
+
+    size_t target = m_block_size;
+    if (target == 0)
+        target = DEFAULT_BATCH;
+    else if (target < TS_PACKET)
+        target = TS_PACKET;
+
+    struct iovec iov[MAX_IOV];
+    int    cnt = m_spill.Peek(iov, target);
+    size_t total = 0;
+
+    for (int idx = 0; idx < cnt; ++idx)
+        total += iov[idx].iov_len;
+
+    // Spilled data is always copied, along with anything after it:
+    // only pool blocks can be left to the pipe by reference.
+    bool spilled = (cnt > 0);
+
+    for (auto Iblk = m_pending.begin();
+         Iblk != m_pending.end() && cnt < MAX_IOV && total < target; ++Iblk)
+    {
+        iov[cnt].iov_base = (*Iblk)->data + (*Iblk)->offset;
+        iov[cnt].iov_len  = (*Iblk)->size - (*Iblk)->offset;
+        total += iov[cnt].iov_len;
+        ++cnt;
+    }
+    if (total > target)
+    {
+        iov[cnt - 1].iov_len -= (total - target);
+        total = target;
+    }
+
+    // Keep the output position on a TS packet boundary.
+    size_t trim = (m_out_pos + total) % TS_PACKET;
+    if (trim >= total)
+        return false;
+    total -= trim;
+    while (trim > 0)
+    {
+        if (iov[cnt - 1].iov_len > trim)
+        {
+            iov[cnt - 1].iov_len -= trim;
+            break;
+        }
+        trim -= iov[cnt - 1].iov_len;
+        --cnt;
+    }
+
+    if (m_splicer)
+        return Wrote(m_splicer->Send(iov, cnt, spilled), total,
+                     written, write_cnt);
+
+    if (!m_writer->Submit(iov, cnt, -1, total))
+        return false;
+
+    // A plain write has already finished; io_uring signals m_event_fd
+    // when it has.
+    return Reap(false, written, write_cnt) || m_writer->InFlight() > 0;
+}
+
+/*
+ * Collect the result of the write in flight and release what it
+ * covered.  Returns false if it has not finished or wrote nothing.
+ */
+bool Buffer::Reap(bool wait, uint64_t & written, uint64_t & write_cnt)
+{
+    WriteCompletion done;
+    if (m_writer->Completed(&done, 1, wait) < 1)
+        return false;
+    return Wrote(done.result, done.tag, written, write_cnt);
+}
+
+/*
+ * Account for `len' bytes, or -errno, out of a write of `total', and
+ * release what was written.  Returns false if nothing was.
+ */
+bool Buffer::Wrote(ssize_t len, size_t total, uint64_t & written,
+                   uint64_t & write_cnt)
+{
+    if (len < 0)
+    {
+        if (len == -ECANCELED || m_out_failed)
+        {
+            // Abandoned on purpose; see Run().
+            m_undelivered += total;
+            Consume(total);
+            return false;
+        }
+        if (len == -EINTR)
+            return false;
+        if (len == -EAGAIN)
+        {
+            Stalled();
+            return false;
+        }
+        if (len == -EPIPE)
+        {
+            Fail("reader closed the pipe");
+            return false;
+        }
+
+        // Nothing sensible can be done with the data; don't spin on it.
+        if (m_write_errors++ % 100 == 0)
+            ERRORLOG << "Buffer: write failed: " << strerror(-len)
+                     << " (" << m_write_errors << " errors)";
+        len = total;
+    }
+    else
+    {
+        written += len;
+        ++write_cnt;
+        m_out_blocked = false;
+    }
+
+    Consume(len);
+    return len > 0;
+}
+
+/*
+ * The output would block.  Give up on it if that has gone on too long
+ * while we were allowed to send; time spent in XOFF does not count.
+ */
+void Buffer::Stalled(void)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    if (!m_xon)
+    {
+        m_out_blocked = false;
+        return;
+    }
+
+    if (!m_out_blocked)
+    {
+        m_out_blocked = true;
+        m_stall_since = now;
+    }
+    else if (m_stall_limit > 0 &&
+             now - m_stall_since > std::chrono::seconds(m_stall_limit))
+        Fail("reader took nothing for " + to_string(m_stall_limit) + "s");
+}
+
+void Buffer::Fail(const string & why)
+{
+    if (m_out_failed)
+        return;
+
+    // Unread data in the pipe will not be delivered either.
+    int queued = 0;
+    if (m_pipe_size > 0 && ioctl(m_fd, FIONREAD, &queued) == 0)
+        m_undelivered += queued;
+
+    m_out_error = why;
+    m_out_failed = true;
+    CRITLOG << "Buffer: giving up on output, " << why << ".";
+}
+
+/*
+ * Drop everything queued, returning how many bytes of it were never
+ * written.  Blocks the pipe may still read from are held until it is
+ * done with them, unless `abandon'.
+ */
+uint64_t Buffer::Clear(bool abandon)
+{
+    uint64_t bytes = m_spill.Used();
+
+    m_data->consume_all([this, &bytes](Block * blk)
+                        { bytes += blk->size; Release(blk); });
+    for (Block * blk : m_pending)
+    {
+        bytes += blk->size - blk->offset;
+        // Partly written blocks may still be read from the pipe.
+        if (blk->offset > 0 && !abandon)
+            Retire(blk);
+        else
+            Release(blk);
+    }
+    m_pending.clear();
+    m_spill.Clear();
+    m_spill_full = false;
+    m_out_pos = 0;
+
+    if (abandon)
+    {
+        for (Held & held : m_held)
+            Release(held.blk);
+        m_held.clear();
+    }
+    else
+        Reclaim();
+    return bytes;
+}
+
+void Buffer::Run(void)
+{
+    time_t     send_time = time (NULL) + (60 * 5);
+    uint64_t   write_total = 0;
+    uint64_t   written = 0;
+    uint64_t   write_cnt = 0;
+    uint64_t   empty_cnt = 0;
+
+    DEBUGLOG << "Buffer: Ready for data, writing with "
+             << m_writer->Name() << ".";
+
+    while (m_run && m_active)
+    {
+        m_fanout.Collect([this](Block * blk) { m_pool.Release(blk); });
+
+        if (send_time < static_cast<double>(time (NULL)))
+        {
+            // Every 5 minutes, write out some statistics.
+            send_time = time (NULL) + (60 * 5);
+            write_total += written;
+            if (m_streaming)
+            {
+                INFOLOG << "Count: " << write_cnt
+                        << ", Empty cnt: " << empty_cnt
+                        << ", Written: " << written
+                        << ", Total: " << write_total
+                        << ", Slept with data: " << m_slept_with_data
+                        << ", Dropped: " << m_dropped
+                        << ", High water: " << m_high_events
+                        << " (" << m_high_ms << "ms)"
+                        << ", Spilled: " << m_spilled
+                        << " (" << m_spill.Used() << " on disk)"
+                        << ", Sync losses: " << m_sync_losses
+                        << ", Null stripped: " << m_null_bytes
+                        << ", PID filtered: " << m_pid_bytes
+                        << ", GOPs dropped: " << m_gops_dropped
+                        << " (" << m_gop_bytes << " bytes)"
+                        << ", Pipe: " << PipeFill() << "%";
+                if (m_fanout.Count() > 0)
+                    INFOLOG << "Fan-out: " << m_fanout.Report();
+                if (m_monitor_on)
+                    INFOLOG << "TS health: "
+                            << m_monitor.Report(m_log_window);
+            }
+            else
+                INFOLOG << "Not streaming.";
+
+            write_cnt = empty_cnt = written = 0;
+        }
+
+        // Restart the stall clock whenever flow control changes.
+        bool xon = m_xon;
+        if (xon != m_was_xon)
+        {
+            m_out_blocked = false;
+            m_was_xon = xon;
+        }
+
+        if (m_out_failed)
+        {
+            // Nothing more can be delivered; just count what is lost.
+            m_writer->Cancel();
+            while (m_writer->InFlight() > 0)
+                Reap(true, written, write_cnt);
+            m_undelivered += Clear(true);
+        }
+        else if (m_streaming)
+        {
+            // Drain everything that is queued before going to sleep.
+            Spill();
+            while (m_xon && WriteBatch(written, write_cnt))
+                Spill();
+        }
+        else
+        {
+            // Clear packet queue.  Only the consumer may do this, and
+            // not while the kernel is still reading from it.  A write
+            // to a reader that has stopped may never finish on its own.
+            m_writer->Cancel();
+            while (m_writer->InFlight() > 0)
+                Reap(true, written, write_cnt);
+            Clear(false);
+        }
+        CheckLowWater();
+
+        /*
+         * Announce that we are about to sleep, then look at the queue
+         * once more.  Fill() checks m_waiting after queueing, so data
+         * arriving in between is never missed.  The completion of a
+         * write in flight, or room in a full output, wakes us the same
+         * way.
+         */
+        m_waiting = true;
+        bool writing = m_writer->InFlight() > 0 || m_out_blocked;
+        if (!writing && m_data->read_available() > 0)
+        {
+            if (m_streaming && m_xon)
+            {
+                m_waiting = false;
+                continue;
+            }
+            ++m_slept_with_data;
+        }
+        else if (!writing && m_streaming)
+            ++empty_cnt;
+
+        // Blocks held by the pipe are given back as the reader gets
+        // through them, not just when something else wakes us.
+        WaitForData(m_held.empty() ? 1000 : HELD_POLL_MS);
+        m_waiting = false;
+    }
+
+    m_writer->Cancel();
+    while (m_writer->InFlight() > 0)
+        Reap(true, written, write_cnt);
+    uint64_t left = Clear(true);
+    if (m_splicer)
+        left += m_splicer->Staged();
+    if (left > 0 && !m_out_failed)
+        INFOLOG << "Buffer: " << left << " bytes still queued at shutdown.";
+    // A registered fixed file holds a reference of its own; without the
+    // ring, closing m_fd gives the reader its EOF.
+    m_writer.reset(OutputWriter::Create(m_fd, false, 1));
+
+    if (m_out_failed)
+        ERRORLOG << "Buffer: output failed (" << m_out_error << "), "
+                 << m_undelivered << " bytes never delivered.";
+    DEBUGLOG << "Buffer: shutting down";
+}
@@ -0,0 +1,319 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _Buffer_H_
+#define _Buffer_H_
+
+#include "BlockPool.h"
+#include "GopFilter.h"
+#include "PIDFilter.h"
+#include "PSITracker.h"
+#include "TSReframer.h"
+#include "TSMonitor.h"
+#include "SpillFile.h"
+#include "OutputWriter.h"
+#include "PipeSplicer.h"
+#include "FanOut.h"
+
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/circular_buffer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Queues transport stream handed over by the encoder and writes it out
+ * from its own thread, in batches, on TS packet boundaries.
+ */
+class Buffer
+{
+  public:
+    enum constants {BLOCK_SIZE = 188 * 64, BUFFER_SECONDS = 10,
+                    MIN_BUDGET = 2 << 20, MAX_BUDGET = 512 << 20,
+                    TAIL_SLACK_PCT = 25, POOL_SLACK = 8,
+                    HIGH_WATER_PCT = 80, LOW_WATER_PCT = 50,
+                    TS_PACKET = 188, DEFAULT_BATCH = 188 * 1024,
+                    MAX_IOV = 256, HELD_POLL_MS = 100};
+
+    using callback_t = std::function<void(void *, size_t)>;
+
+    /*
+     * run, streaming and xon are owned by the caller and only read
+     * here.  Output goes to fd.  Up to `seconds' of the stream at
+     * ts_bitrate may be queued; all of it, and what fan-out sinks may
+     * hold, is allocated by Start().
+     */
+    Buffer(uint32_t ts_bitrate, const std::atomic<bool> & run,
+           const std::atomic<bool> & streaming,
+           const std::atomic<bool> & xon, int fd = 1,
+           int seconds = BUFFER_SECONDS);
+    ~Buffer(void);
+    // False if the memory could not be had; nothing is started then.
+    bool Start(void);
+    // Wait for Run(), then for the fan-out sinks to write what they have.
+    void Join(void) {
+        if (m_thread.joinable())
+            m_thread.join();
+        m_fanout.Stop();
+    }
+    void SetBlockSize(uint32_t sz) { m_block_size = sz; }
+    // Pass only whole, aligned TS packets on, whatever the chunking.
+    void SetReframe(bool on) { m_reframe_on = on; }
+    // Keep per-PID stream health; see Health().
+    void SetMonitor(bool on) { m_monitor_on = on; }
+    // Drop null packets, and PIDs not in `allow' if it is not empty.
+    void SetPIDFilter(bool strip_null, const std::vector<uint16_t> & allow)
+    {
+        m_pid_filter.SetStripNull(strip_null);
+        m_pid_filter.SetAllowed(allow);
+        m_pid_filter_on = m_pid_filter.Active();
+    }
+    // Under overload, drop whole GOPs of video rather than chunks.
+    void SetGopDrop(bool on) { m_gop_drop = on; }
+    /*
+     * Write through io_uring, falling back to writev() if it can't be
+     * set up.  Run() then never blocks in a write; a completion wakes
+     * it like new data does.  Call before Start().
+     */
+    void UseIOUring(void)
+    { m_writer.reset(OutputWriter::Create(m_fd, true, 1, m_event_fd)); }
+    /*
+     * Hand blocks to the output pipe with vmsplice() instead of copying
+     * them, and mirror the stream to the FIFO `tee_path' if not empty;
+     * see PipeSplicer.  Takes precedence over io_uring.  Call before
+     * Start().
+     */
+    bool EnableSplice(const std::string & tee_path);
+    // F_SETPIPE_SZ on the output, if it is a pipe.
+    bool SetPipeSize(int bytes);
+    /*
+     * Never block on the output.  If it takes nothing for
+     * `stall_seconds', or the reader goes away, give up on it: see
+     * OutputFailed().  Call before Start().
+     */
+    bool SetNonBlocking(int stall_seconds);
+    // Also send the stream to `spec'; see FanOut.  Call before Start().
+    bool AddSink(const FanOut::Spec & spec) { return m_fanout.Add(spec); }
+    // Optional overflow to disk; call before Start().
+    bool EnableSpill(const std::string & dir, uint64_t max_bytes)
+    { return m_spill.Open(dir, max_bytes); }
+    void Fill(void * data, size_t len);
+    void Wake(void);
+
+    // Times Run() went to sleep while blocks were still queued.
+    uint64_t SleptWithData(void) const { return m_slept_with_data; }
+    // Chunks (or parts of them) lost because the budget was used up.
+    uint64_t Dropped(void) const { return m_dropped; }
+    // Blocks in use, by the output or by fan-out sinks.
+    size_t QueueDepth(void) const
+    { return m_pool.Count() - m_pool.Available(); }
+    size_t QueueCapacity(void) const { return m_pool.Count(); }
+
+    // Byte budget and watermarks.  Crossing the high watermark, and
+    // dropping back under the low one, are logged and counted.
+    uint64_t QueuedBytes(void) const { return m_queued; }
+    uint64_t Budget(void) const { return m_budget; }
+    bool     AboveHighWater(void) const { return m_above_high; }
+    uint64_t HighWaterEvents(void) const { return m_high_events; }
+    uint64_t HighWaterMs(void) const { return m_high_ms; }
+
+    // Bytes currently on disk, and the total ever moved there.
+    uint64_t SpillUsed(void) const { return m_spill.Used(); }
+    uint64_t Spilled(void) const { return m_spilled; }
+
+    uint64_t SyncLosses(void) const { return m_sync_losses; }
+    uint64_t NullBytesStripped(void) const { return m_null_bytes; }
+    uint64_t PIDBytesFiltered(void) const { return m_pid_bytes; }
+    uint64_t GopsDropped(void) const { return m_gops_dropped; }
+    uint64_t GopBytesDropped(void) const { return m_gop_bytes; }
+
+    /*
+     * Set once the output is broken or stalled for good.  From then on
+     * nothing is written; whatever is queued or still arrives is only
+     * counted, as undelivered.  The owner is expected to shut down.
+     */
+    bool OutputFailed(void) const { return m_out_failed; }
+    std::string OutputError(void) const
+    { return m_out_failed ? m_out_error : std::string(); }
+    uint64_t Undelivered(void) const { return m_undelivered; }
+
+    // How full the output pipe is, in percent; -1 if it isn't a pipe.
+    int PipeFill(void) const;
+    // Bytes the FIFO given to EnableSplice() missed by falling behind.
+    uint64_t TeeSkipped(void) const
+    { return m_splicer ? m_splicer->TeeSkipped() : 0; }
+
+    // Bytes written and dropped per fan-out sink.
+    std::string FanOutReport(void) const { return m_fanout.Report(); }
+
+    /*
+     * One line on the stream as the encoder sent it (TSMonitor) and on
+     * what was lost here, covering the time since `win' was last used.
+     */
+    std::string Health(TSMonitor::Window & win) const;
+
+    callback_t & getWriteCallBack(void) { return m_cb; }
+    std::chrono::time_point<std::chrono::system_clock> HeartBeat(void) const
+    { return m_heartbeat; }
+
+  protected:
+    void Deliver(const uint8_t * src, size_t len);
+    void Filter(const uint8_t * src, size_t len);
+    GopFilter::verdict Keep(const uint8_t * pkt, bool overload)
+    {
+        m_psi.Update(pkt);
+        if (m_pid_filter_on && !m_pid_filter.Keep(pkt))
+            return GopFilter::DROP;
+        return m_gop_drop ? m_gop.Keep(pkt, overload) : GopFilter::KEEP;
+    }
+    void KeepPCR(const uint8_t * pkt);
+    bool Queue(const uint8_t * src, size_t len);
+    void Run(void);
+    void WaitForData(int timeout_ms);
+    void Gather(void);
+    bool WriteBatch(uint64_t & written, uint64_t & write_cnt);
+    bool Reap(bool wait, uint64_t & written, uint64_t & write_cnt);
+    bool Wrote(ssize_t len, size_t total, uint64_t & written,
+               uint64_t & write_cnt);
+    void Stalled(void);
+    void Fail(const std::string & why);
+    uint64_t Clear(bool abandon);
+    void Spill(void);
+    void Consume(size_t bytes);
+    void Release(Block * blk);
+    void Unref(Block * blk)
+    {
+        if (blk->refs.fetch_sub(1) == 1)
+            m_pool.Release(blk);
+    }
+    void Retire(Block * blk);
+    void Reclaim(void);
+    void CheckLowWater(void);
+
+  private:
+    std::thread m_thread;
+    std::atomic_bool m_run;
+
+    const std::atomic<bool> & m_active;
+    const std::atomic<bool> & m_streaming;
+    const std::atomic<bool> & m_xon;
+    int         m_fd;
+
+    callback_t  m_cb;
+
+    std::atomic<uint32_t> m_block_size;
+
+    // Fill() is the only producer and Run() the only consumer, so a
+    // lock-free single-producer/single-consumer ring is sufficient.
+    // Blocks come from m_pool and are handed over by pointer; Run()
+    // gives them back to the pool once written.
+    using stack_t = boost::lockfree::spsc_queue<Block *>;
+
+    BlockPool m_pool;
+    std::unique_ptr<stack_t> m_data;
+
+    // Blocks taken off m_data but not yet completely written.  Only
+    // touched by Run().
+    boost::circular_buffer<Block *> m_pending;
+    uint64_t m_out_pos;
+    uint64_t m_write_errors;
+
+    // At most one write in flight: a pipe has no offsets to keep two in
+    // order.  Declared after the pool so it is gone, and the kernel done
+    // with the blocks, before they are freed.
+    std::unique_ptr<OutputWriter> m_writer;
+
+    // With vmsplice, written blocks wait here until the reader is past
+    // `end', since the pipe still refers to their pages.  Run() only.
+    struct Held
+    {
+        Block   *blk;
+        uint64_t end;
+    };
+    std::unique_ptr<PipeSplicer>  m_splicer;
+    boost::circular_buffer<Held>  m_held;
+    std::atomic<int>              m_pipe_size;
+
+    // Non-blocking output.  m_out_error is written once, before
+    // m_out_failed is raised.
+    bool                  m_nonblock;
+    int                   m_stall_limit;    // seconds, 0 = never
+    bool                  m_out_blocked;    // Run() only
+    bool                  m_was_xon;        // Run() only
+    std::chrono::steady_clock::time_point m_stall_since;
+    std::string           m_out_error;
+    std::atomic_bool      m_out_failed;
+    std::atomic<uint64_t> m_undelivered;
+
+    int                   m_event_fd;
+    std::atomic_bool      m_waiting;
+    std::atomic<uint64_t> m_slept_with_data;
+    std::atomic<uint64_t> m_dropped;
+
+    uint64_t              m_budget;
+    uint64_t              m_high_water;
+    uint64_t              m_low_water;
+    std::atomic<uint64_t> m_queued;
+    std::atomic_bool      m_above_high;
+    std::atomic<uint64_t> m_high_events;
+    std::atomic<uint64_t> m_high_ms;
+    std::chrono::steady_clock::time_point m_high_since;
+
+    // Holds data older than anything in m_pending.  Only touched by
+    // Run().
+    SpillFile             m_spill;
+    std::atomic<uint64_t> m_spilled;
+    bool                  m_spill_full;
+
+    // Producer side only, apart from the counters.
+    std::atomic_bool      m_reframe_on;
+    TSReframer            m_reframe;
+    TSReframer::emit_t    m_deliver;
+    std::atomic<uint64_t> m_sync_losses;
+
+    std::atomic_bool      m_monitor_on;
+    TSMonitor             m_monitor;
+    TSMonitor::Window     m_log_window;     // Run() only
+
+    PSITracker            m_psi;
+    std::atomic_bool      m_pid_filter_on;
+    PIDFilter             m_pid_filter;
+    std::atomic<uint64_t> m_null_bytes;
+    std::atomic<uint64_t> m_pid_bytes;
+
+    std::atomic_bool      m_gop_drop;
+    GopFilter             m_gop;
+    std::vector<uint8_t>  m_filtered;
+    uint64_t              m_filter_unaligned;
+    std::atomic<uint64_t> m_gops_dropped;
+    std::atomic<uint64_t> m_gop_bytes;
+
+    // Shares blocks with m_pending, so it goes before m_pool does.
+    FanOut                m_fanout;
+
+    std::chrono::time_point<std::chrono::system_clock> m_heartbeat;
+};
+
+#endif
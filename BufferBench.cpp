@@ -0,0 +1,1146 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Synthetic load for the Buffer output path, no capture device needed.
+ *
+ * A producer thread feeds Buffer::Fill() with TS packets at a given
+ * bitrate and burst pattern, Buffer writes them into a pipe, and a
+ * drain thread empties the pipe at a given rate.  Every packet carries
+ * a sequence number and the time it was queued, so the drain side can
+ * count lost packets and measure enqueue-to-write latency.
+ *
+ * With --loopback a udp or rtp fan-out sink sends to a receiver in the
+ * bench, which checks what arrives and how it is spaced.
+ *
+ * With --scan it instead times the TS re-framer over a capture file,
+ * or a synthetic stream with damage injected.  With --handoff it times
+ * only the queue between Fill() and the writer thread, today's or the
+ * one it replaced.
+ */
+
+#include "Buffer.h"
+#include "Logger.h"
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+namespace po = boost::program_options;
+using namespace std;
+
+using bench_clock = chrono::steady_clock;
+
+enum constants { TS_PACKET = 188, BENCH_PID = 0x100, TICK_MS = 10,
+                 DRAIN_BUF = 1 << 20, PCR_MS = 40, PAYLOAD = 12,
+                 RTP_HEADER = 12, TS_PER_DATAGRAM = 7,
+                 LOOPBACK_RCVBUF = 8 << 20, HANDOFF_QUEUE = 500,
+                 OLD_RUN_SLEEP_MS = 25 };
+
+struct BenchParams
+{
+    size_t   chunk;         // Bytes per Fill()
+    uint64_t bitrate;       // Producer, bits/sec
+    int      burst;         // Chunks delivered back to back
+    uint64_t drain_rate;    // Consumer, bits/sec, 0 = unlimited
+    int      xoff_every;    // ms, 0 = never
+    int      xoff_for;      // ms
+    int      duration;      // seconds
+    uint32_t block_size;    // As set by MythTV's BlockSize command
+    int      pipe_size;
+    int      report;        // ms between progress lines
+    int      buffer_seconds;
+    bool     reframe;
+    bool     monitor;
+    bool     io_uring;
+    bool     splice;
+    bool     tee;
+    int      stall;         // seconds, 0 = blocking output
+    int      hang_after;    // ms, 0 = never
+    string   spill_dir;
+    int      spill_max;     // MB
+    vector<string> fanout;
+    string   loopback;      // Fan-out sink type and options
+};
+
+struct BenchStats
+{
+    atomic<uint64_t> produced;
+    atomic<uint64_t> drained;
+    atomic<uint64_t> lost;      // Packets missing from the sequence
+    atomic<uint64_t> sync_errors;
+    atomic<bool>     hung;      // Drain thread stopped reading
+    vector<uint32_t> latency;   // us, one per chunk; drain thread only
+
+    BenchStats(void)
+        : produced(0), drained(0), lost(0), sync_errors(0), hung(false) {}
+};
+
+struct LoopbackStats
+{
+    uint64_t datagrams;
+    uint64_t bad_size;      // Not whole TS packets, or too many
+    uint64_t rtp_missing;   // Datagrams skipped in the RTP sequence
+    uint64_t rtp_reordered;
+    uint64_t lost;          // Packets missing from the sequence
+    uint32_t kernel_drops;  // Receive queue overflows
+    vector<uint32_t> pcr_error;     // us, per PCR
+
+    LoopbackStats(void)
+        : datagrams(0), bad_size(0), rtp_missing(0), rtp_reordered(0)
+        , lost(0), kernel_drops(0) {}
+};
+
+static uint64_t now_ns(void)
+{
+    return chrono::duration_cast<chrono::nanoseconds>
+        (bench_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Packet layout: TS header on BENCH_PID and an adaptation field that
+ * carries a PCR every PCR_MS of stream at the nominal bitrate.  Then,
+ * at PAYLOAD, the 64 bit sequence number, the 64 bit enqueue time in
+ * ns and a flag marking the first packet of a chunk.
+ */
+static void produce(Buffer & buffer, const BenchParams & p,
+                    const atomic<bool> & run, BenchStats & st)
+{
+    setThreadName("producer");
+
+    size_t   packets = max<size_t>(p.chunk / TS_PACKET, 1);
+    size_t   bytes   = packets * TS_PACKET;
+    vector<uint8_t> chunk(bytes, 0xFF);
+    uint64_t seq = 0;
+    uint8_t  cc  = 0;
+    uint64_t pcr_every = max<uint64_t>(p.bitrate * PCR_MS / 1000 / 8 /
+                                       TS_PACKET, 1);
+
+    auto period = chrono::nanoseconds(static_cast<int64_t>
+                      (bytes * 8 * 1e9 * p.burst / p.bitrate));
+    auto next = bench_clock::now();
+
+    while (run)
+    {
+        for (int b = 0; b < p.burst; ++b)
+        {
+            uint64_t ts = now_ns();
+            for (size_t idx = 0; idx < packets; ++idx)
+            {
+                uint8_t *pkt = &chunk[idx * TS_PACKET];
+                pkt[0] = 0x47;
+                pkt[1] = BENCH_PID >> 8;
+                pkt[2] = BENCH_PID & 0xFF;
+                pkt[3] = 0x30 | (cc++ & 0x0F);
+                pkt[4] = PAYLOAD - 5;
+                pkt[5] = 0;
+                memset(pkt + 6, 0xFF, PAYLOAD - 6);
+                if (seq % pcr_every == 0)
+                {
+                    // 27MHz, as far into the stream as this packet is.
+                    uint64_t pcr = static_cast<uint64_t>
+                        (seq * TS_PACKET * 8 * 27e6 / p.bitrate);
+                    uint64_t base = (pcr / 300) & ((1ULL << 33) - 1);
+                    pkt[5]  = 0x10;
+                    pkt[6]  = base >> 25;
+                    pkt[7]  = base >> 17;
+                    pkt[8]  = base >> 9;
+                    pkt[9]  = base >> 1;
+                    pkt[10] = ((base & 1) << 7) | 0x7E | ((pcr % 300) >> 8);
+                    pkt[11] = pcr % 300;
+                }
+                memcpy(pkt + PAYLOAD, &seq, sizeof(seq));
+                memcpy(pkt + PAYLOAD + 8, &ts, sizeof(ts));
+                pkt[PAYLOAD + 16] = (idx == 0);
+                ++seq;
+            }
+            buffer.Fill(chunk.data(), bytes);
+            st.produced += bytes;
+        }
+
+        next += period;
+        this_thread::sleep_until(next);
+    }
+}
+
+// Reader for the --tee FIFO: take whatever it is given, as fast as it can.
+static void drain_tee(const string & path, const atomic<bool> & run,
+                      atomic<uint64_t> & bytes)
+{
+    setThreadName("drain tee");
+
+    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        cerr << "tee: " << path << ": " << strerror(errno) << endl;
+        return;
+    }
+
+    vector<uint8_t> buf(DRAIN_BUF);
+    while (run)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, TICK_MS) < 1)
+            continue;
+        ssize_t len = read(fd, buf.data(), buf.size());
+        if (len > 0)
+            bytes += len;
+    }
+    close(fd);
+}
+
+static void drain(int fd, const BenchParams & p, BenchStats & st)
+{
+    setThreadName("drain");
+
+    vector<uint8_t> buf(DRAIN_BUF);
+    size_t   have = 0;
+    uint64_t expected = 0;
+
+    // Read in TICK_MS worth of the drain rate at a time.
+    size_t slice = p.drain_rate ? max<size_t>(p.drain_rate / 8 * TICK_MS
+                                              / 1000, TS_PACKET)
+                                : DRAIN_BUF;
+    auto   next  = bench_clock::now();
+    auto   tick  = chrono::milliseconds(TICK_MS);
+    auto   hang  = next + chrono::milliseconds(p.hang_after);
+    bool   hung  = false;
+
+    for (;;)
+    {
+        // Play a reader that stops reading, until the run is over.
+        if (p.hang_after && !hung && bench_clock::now() >= hang)
+        {
+            hung = st.hung = true;
+            while (st.hung)
+                this_thread::sleep_for(tick);
+        }
+
+        ssize_t len = read(fd, &buf[have],
+                           min(slice, buf.size() - have));
+        if (len == 0)
+            break;
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "drain: " << strerror(errno) << endl;
+            break;
+        }
+
+        st.drained += len;
+        have += len;
+
+        uint64_t ts_now = now_ns();
+        size_t   pos = 0;
+        while (pos + TS_PACKET <= have)
+        {
+            uint8_t *pkt = &buf[pos];
+            if (pkt[0] != 0x47)
+            {
+                ++st.sync_errors;
+                ++pos;
+                continue;
+            }
+
+            uint64_t seq, ts;
+            memcpy(&seq, pkt + PAYLOAD, sizeof(seq));
+            memcpy(&ts, pkt + PAYLOAD + 8, sizeof(ts));
+            if (seq > expected)
+                st.lost += seq - expected;
+            expected = seq + 1;
+            if (pkt[PAYLOAD + 16])
+                st.latency.push_back((ts_now - ts) / 1000);
+
+            pos += TS_PACKET;
+        }
+        memmove(&buf[0], &buf[pos], have - pos);
+        have -= pos;
+
+        if (p.drain_rate)
+        {
+            next += tick;
+            this_thread::sleep_until(next);
+        }
+    }
+}
+
+// Bind the --loopback receiver to an unused port on 127.0.0.1.
+static int loopback_open(uint16_t & port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        cerr << "loopback: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    int on = 1;
+    int rcvbuf = LOOPBACK_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+        cerr << "loopback: " << strerror(errno) << endl;
+
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0)
+    {
+        cerr << "loopback: " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/*
+ * Receiver for --loopback.  Every datagram must hold whole TS packets,
+ * no more than TS_PER_DATAGRAM, behind an RTP header for rtp.  RTP
+ * sequence numbers and the bench's own packet numbers are followed
+ * for gaps.  Datagrams that carry a PCR are timed with the kernel's
+ * receive timestamp: the time between two of them should match the
+ * time between their PCRs, and pcr_error collects how far it is off.
+ */
+static void loopback_recv(int fd, bool rtp, const atomic<bool> & run,
+                          LoopbackStats & st)
+{
+    setThreadName("loopback");
+
+    const size_t header = rtp ? RTP_HEADER : 0;
+    uint8_t  buf[RTP_HEADER + TS_PACKET * (TS_PER_DATAGRAM + 1)];
+    char     control[CMSG_SPACE(sizeof(struct timespec)) +
+                     CMSG_SPACE(sizeof(uint32_t))];
+    uint64_t expected = 0;
+    uint16_t rtp_next = 0;
+    uint64_t last_pcr = 0;
+    int64_t  last_pcr_ns = -1;
+
+    while (run)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, TICK_MS) < 1)
+            continue;
+
+        struct iovec  iov = { buf, sizeof(buf) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t len = recvmsg(fd, &msg, 0);
+        if (len < 0)
+            continue;
+
+        int64_t arrived = -1;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level != SOL_SOCKET)
+                continue;
+            if (cm->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                arrived = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            }
+            else if (cm->cmsg_type == SO_RXQ_OVFL)
+                memcpy(&st.kernel_drops, CMSG_DATA(cm),
+                       sizeof(st.kernel_drops));
+        }
+
+        ++st.datagrams;
+        size_t payload = (static_cast<size_t>(len) >= header)
+                         ? len - header : 0;
+        if ((msg.msg_flags & MSG_TRUNC) || payload == 0 ||
+            payload % TS_PACKET != 0 ||
+            payload > TS_PACKET * TS_PER_DATAGRAM ||
+            (rtp && (buf[0] >> 6) != 2))
+        {
+            ++st.bad_size;
+            continue;
+        }
+
+        if (rtp)
+        {
+            uint16_t seq = (buf[2] << 8) | buf[3];
+            if (st.datagrams > 1 && seq != rtp_next)
+            {
+                int16_t gap = seq - rtp_next;
+                if (gap > 0)
+                    st.rtp_missing += gap;
+                else
+                    ++st.rtp_reordered;
+            }
+            rtp_next = seq + 1;
+        }
+
+        for (size_t pos = header; pos < static_cast<size_t>(len);
+             pos += TS_PACKET)
+        {
+            const uint8_t *pkt = buf + pos;
+            uint64_t seq;
+            memcpy(&seq, pkt + PAYLOAD, sizeof(seq));
+            if (seq > expected)
+                st.lost += seq - expected;
+            expected = seq + 1;
+
+            if (arrived < 0 || !(pkt[3] & 0x20) || pkt[4] < 7 ||
+                !(pkt[5] & 0x10))
+                continue;
+            uint64_t base = (static_cast<uint64_t>(pkt[6]) << 25) |
+                            (pkt[7] << 17) | (pkt[8] << 9) |
+                            (pkt[9] << 1) | (pkt[10] >> 7);
+            uint64_t pcr  = base * 300 + (((pkt[10] & 1) << 8) | pkt[11]);
+            if (last_pcr_ns >= 0 && pcr > last_pcr)
+            {
+                int64_t want = (pcr - last_pcr) * 1000 / 27;
+                int64_t got  = arrived - last_pcr_ns;
+                st.pcr_error.push_back(llabs(got - want) / 1000);
+            }
+            last_pcr = pcr;
+            last_pcr_ns = arrived;
+        }
+    }
+}
+
+static double gbps(size_t bytes, bench_clock::duration d)
+{
+    return bytes / chrono::duration<double>(d).count() / 1e9;
+}
+
+/*
+ * Time TSReframer::FindSync() and TSReframer::Process() over `file', or
+ * over `mb' MB of made up stream with a few junk bytes every 1000
+ * packets.  Input is handed over in `chunk' sized pieces, as the USB
+ * layer would.
+ */
+static int scan_bench(const string & file, size_t mb, size_t chunk)
+{
+    vector<uint8_t> data;
+
+    if (!file.empty())
+    {
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            cerr << file << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        data.resize(st.st_size);
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            ssize_t len = read(fd, &data[pos], data.size() - pos);
+            if (len <= 0)
+                break;
+            pos += len;
+        }
+        data.resize(pos);
+        close(fd);
+    }
+    else
+    {
+        uint32_t rnd = 1;
+        data.reserve(mb << 20);
+        while (data.size() + TS_PACKET <= (mb << 20))
+        {
+            size_t start = data.size();
+            data.resize(start + TS_PACKET);
+            for (size_t idx = start; idx < data.size(); ++idx)
+                data[idx] = (rnd = rnd * 1103515245 + 12345) >> 16;
+            data[start] = 0x47;
+            if ((start / TS_PACKET) % 1000 == 999)
+                data.insert(data.end(), 17, 0x00);
+        }
+    }
+    if (data.size() < TS_PACKET * 2 || chunk < 1)
+    {
+        cerr << "Not enough data to scan." << endl;
+        return 1;
+    }
+
+    // Worst case for the scanner: no sync anywhere.
+    vector<uint8_t> junk(min<size_t>(data.size(), 64 << 20));
+    for (size_t idx = 0; idx < junk.size(); ++idx)
+        junk[idx] = (data[idx] == 0x47) ? 0x46 : data[idx];
+
+    auto start = bench_clock::now();
+    size_t r1 = TSReframer::FindSyncScalar(junk.data(), junk.size());
+    auto scalar = bench_clock::now() - start;
+    start = bench_clock::now();
+    size_t r2 = TSReframer::FindSync(junk.data(), junk.size());
+    auto simd = bench_clock::now() - start;
+
+    // The whole stage, chunked.
+    TSReframer reframer;
+    uint64_t   out = 0;
+    uint64_t   runs = 0;
+    TSReframer::emit_t emit = [&](const uint8_t *p, size_t len)
+                              { out += len; ++runs; (void)p; };
+    start = bench_clock::now();
+    for (size_t pos = 0; pos < data.size(); pos += chunk)
+        reframer.Process(data.data() + pos, min(chunk, data.size() - pos),
+                         emit);
+    auto process = bench_clock::now() - start;
+
+    // The health monitor, over the re-framed stream.
+    vector<uint8_t> clean;
+    clean.reserve(data.size());
+    TSReframer().Process(data.data(), data.size(),
+                         [&](const uint8_t *p, size_t len)
+                         { clean.insert(clean.end(), p, p + len); });
+    TSMonitor monitor;
+    const size_t step = TS_PACKET * 348;
+    start = bench_clock::now();
+    for (size_t pos = 0; pos < clean.size(); pos += step)
+        monitor.Process(clean.data() + pos,
+                        min(step, clean.size() - pos));
+    auto monitoring = bench_clock::now() - start;
+
+    cout << fixed << setprecision(2)
+         << "Input          : " << data.size() << " bytes in "
+         << chunk << " byte chunks\n"
+         << "Sync scan      : scalar " << gbps(junk.size(), scalar)
+         << " GB/s, " << TSReframer::FindSyncImpl() << " "
+         << gbps(junk.size(), simd) << " GB/s over "
+         << junk.size() << " bytes without sync"
+         << (r1 == r2 ? "" : " (MISMATCH)") << "\n"
+         << "Re-frame       : " << gbps(data.size(), process) << " GB/s, "
+         << out / TS_PACKET << " packets in " << runs << " runs\n"
+         << "Sync losses    : " << reframer.SyncLosses() << ", "
+         << reframer.BytesSkipped() << " bytes skipped\n"
+         << "Monitor        : " << gbps(clean.size(), monitoring)
+         << " GB/s, " << monitor.CCErrors() << " CC errors"
+         << endl;
+
+    return r1 == r2 ? 0 : 1;
+}
+
+static uint32_t percentile(const vector<uint32_t> & sorted, double pct)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = static_cast<size_t>(pct / 100 * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Time the hand-over from Fill() to the writer thread and nothing
+ * else.  `mode' picks the queue:
+ *
+ *  old    What Buffer had before it went lock-free, as it was: Fill()
+ *         copies the chunk into a vector and pushes it on a std::queue
+ *         under a timed mutex; Run() copies the front block out under
+ *         the same mutex, one block per pass, sleeping 25 ms after
+ *         each and on a condition variable when the queue ran empty.
+ *  mutex  The same queue, without Run()'s 25 ms sleep.
+ *  spsc   Today's: BlockPool blocks passed by pointer through an
+ *         spsc_queue, with an eventfd wakeup only when Run() sleeps.
+ *
+ * Each queue holds HANDOFF_QUEUE blocks.  Chunks are offered at
+ * `bitrate' (0 = back to back) and carry their enqueue time, so both
+ * the time spent in Fill() and the time to reach the writer are seen.
+ */
+static int handoff_bench(const string & mode, size_t chunk,
+                         uint64_t bitrate, int duration)
+{
+    if (mode != "old" && mode != "mutex" && mode != "spsc")
+    {
+        cerr << "handoff: mode must be old, mutex or spsc." << endl;
+        return 1;
+    }
+    chunk = max<size_t>(chunk / TS_PACKET, 1) * TS_PACKET;
+
+    vector<uint8_t>  src(chunk, 0xFF);
+    vector<uint32_t> fill_ns;
+    vector<uint32_t> handoff_us;
+    atomic<bool>     producing(true);
+    uint64_t         offered = 0;
+    uint64_t         dropped = 0;
+
+    // old and mutex
+    using block_t = vector<uint8_t>;
+    timed_mutex             flow_mutex;
+    condition_variable      flow_cond;
+    queue<block_t>          blocks;
+    bool                    old_sleep = (mode == "old");
+
+    // spsc
+    BlockPool               pool;
+    unique_ptr<boost::lockfree::spsc_queue<Block *> > ring;
+    atomic<bool>            waiting(false);
+    int                     event_fd = -1;
+
+    if (mode == "spsc")
+    {
+        if (!pool.Allocate(chunk, HANDOFF_QUEUE))
+            return 1;
+        ring.reset(new boost::lockfree::spsc_queue<Block *>(HANDOFF_QUEUE));
+        event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+
+    auto arrived = [&](const uint8_t *data)
+    {
+        uint64_t ts;
+        memcpy(&ts, data, sizeof(ts));
+        handoff_us.push_back((now_ns() - ts) / 1000);
+    };
+
+    auto consume = [&]()
+    {
+        setThreadName("handoff");
+
+        if (mode == "spsc")
+        {
+            for (;;)
+            {
+                Block *blk;
+                while (ring->pop(blk))
+                {
+                    arrived(blk->data);
+                    pool.Release(blk);
+                }
+                if (!producing && ring->read_available() == 0)
+                    break;
+
+                waiting = true;
+                if (ring->read_available() == 0)
+                {
+                    struct pollfd pfd = { event_fd, POLLIN, 0 };
+                    uint64_t cnt;
+                    if (poll(&pfd, 1, 1000) > 0 &&
+                        read(event_fd, &cnt, sizeof(cnt)) < 0)
+                        break;
+                }
+                waiting = false;
+            }
+            return;
+        }
+
+        bool  wait = false;
+        mutex tmp;
+        for (;;)
+        {
+            if (wait)
+            {
+                unique_lock<mutex> lk(tmp);
+                flow_cond.wait_for(lk, chrono::seconds(1));
+                wait = false;
+            }
+
+            block_t pkt;
+            bool    is_empty = false;
+            if (flow_mutex.try_lock_for(chrono::seconds(1)))
+            {
+                if (!blocks.empty())
+                {
+                    pkt = blocks.front();
+                    blocks.pop();
+                    is_empty = blocks.empty();
+                }
+                flow_mutex.unlock();
+            }
+
+            if (!pkt.empty())
+                arrived(pkt.data());
+            else if (!producing)
+                break;
+
+            // Without the sleep an empty queue would be a busy loop.
+            if (is_empty || (!old_sleep && pkt.empty()))
+                wait = true;
+            if (old_sleep)
+                this_thread::sleep_for
+                    (chrono::milliseconds(OLD_RUN_SLEEP_MS));
+        }
+    };
+
+    thread consumer(consume);
+
+    auto period = chrono::nanoseconds(bitrate ? static_cast<int64_t>
+                                      (chunk * 8 * 1e9 / bitrate) : 0);
+    auto start  = bench_clock::now();
+    auto end    = start + chrono::seconds(duration);
+    auto next   = start;
+    double cpu_start = cpu_seconds();
+
+    while (bench_clock::now() < end)
+    {
+        uint64_t t0 = now_ns();
+        memcpy(src.data(), &t0, sizeof(t0));
+        ++offered;
+
+        if (mode == "spsc")
+        {
+            Block *blk = pool.Acquire();
+            if (blk == nullptr)
+                ++dropped;
+            else
+            {
+                memcpy(blk->data, src.data(), chunk);
+                blk->size = chunk;
+                ring->push(blk);
+                if (waiting.exchange(false))
+                {
+                    uint64_t one = 1;
+                    if (write(event_fd, &one, sizeof(one)) < 0)
+                        break;
+                }
+            }
+        }
+        else
+        {
+            block_t blk(src.begin(), src.end());
+            if (flow_mutex.try_lock_for(chrono::seconds(2)))
+            {
+                if (blocks.size() < HANDOFF_QUEUE)
+                    blocks.push(blk);
+                else
+                    ++dropped;
+                flow_mutex.unlock();
+                flow_cond.notify_all();
+            }
+            else
+                ++dropped;
+        }
+        fill_ns.push_back(now_ns() - t0);
+
+        if (bitrate)
+        {
+            next += period;
+            this_thread::sleep_until(next);
+        }
+    }
+
+    producing = false;
+    if (mode == "spsc")
+    {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0)
+            cerr << "handoff: " << strerror(errno) << endl;
+    }
+    else
+        flow_cond.notify_all();
+    consumer.join();
+    double elapsed = chrono::duration<double>(bench_clock::now() -
+                                              start).count();
+    double cpu = cpu_seconds() - cpu_start;
+    if (event_fd >= 0)
+        close(event_fd);
+
+    sort(fill_ns.begin(), fill_ns.end());
+    sort(handoff_us.begin(), handoff_us.end());
+
+    cout << fixed << setprecision(2)
+         << "Handoff        : " << mode << ", " << chunk << " byte chunks, "
+         << (bitrate ? to_string(bitrate / 1000000) + " Mb/s offered"
+                     : string("offered back to back")) << "\n"
+         << "Delivered      : " << handoff_us.size() << " of " << offered
+         << " chunks, " << handoff_us.size() * chunk * 8 / elapsed / 1e6
+         << " Mb/s, " << dropped << " dropped\n"
+         << "CPU            : " << cpu * 1e6 / max<uint64_t>(offered, 1)
+         << " us per chunk\n"
+         << "Fill() (ns)    : p50 " << percentile(fill_ns, 50)
+         << ", p99 " << percentile(fill_ns, 99)
+         << ", p99.9 " << percentile(fill_ns, 99.9)
+         << ", max " << (fill_ns.empty() ? 0 : fill_ns.back()) << "\n"
+         << "To writer (us) : p50 " << percentile(handoff_us, 50)
+         << ", p99 " << percentile(handoff_us, 99)
+         << ", p99.9 " << percentile(handoff_us, 99.9)
+         << ", max " << (handoff_us.empty() ? 0 : handoff_us.back())
+         << endl;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchParams p;
+
+    po::options_description opts{"Buffer benchmark options"};
+    opts.add_options()
+        ("help,h", "Print this help text.")
+        ("chunk", po::value<size_t>(&p.chunk)->default_value(188 * 348),
+         "Bytes handed to Buffer::Fill() per call (rounded down to whole "
+         "TS packets).")
+        ("bitrate", po::value<uint64_t>(&p.bitrate)
+         ->default_value(20000000), "Producer rate, bits/sec.")
+        ("burst", po::value<int>(&p.burst)->default_value(1),
+         "Chunks delivered back to back per burst.")
+        ("drain-rate", po::value<uint64_t>(&p.drain_rate)
+         ->default_value(0), "Pipe reader rate, bits/sec. 0 = unlimited.")
+        ("xoff-every", po::value<int>(&p.xoff_every)->default_value(0),
+         "Send XOFF every this many ms. 0 = never.")
+        ("xoff-for", po::value<int>(&p.xoff_for)->default_value(200),
+         "Stay in XOFF for this many ms.")
+        ("duration", po::value<int>(&p.duration)->default_value(10),
+         "Seconds to run.")
+        ("block-size", po::value<uint32_t>(&p.block_size)
+         ->default_value(0), "Output batch size, as MythTV's BlockSize.")
+        ("pipe-size", po::value<int>(&p.pipe_size)->default_value(0),
+         "Pipe capacity in bytes. 0 = system default.")
+        ("buffer-seconds", po::value<int>(&p.buffer_seconds)
+         ->default_value(10), "Seconds of stream the Buffer may queue.")
+        ("spill-dir", po::value<string>(&p.spill_dir),
+         "Let the Buffer spill to a file in this directory.")
+        ("spill-max", po::value<int>(&p.spill_max)->default_value(256),
+         "Spill file size in MB.")
+        ("reframe", po::bool_switch(&p.reframe),
+         "Run the load through the TS re-framer.")
+        ("monitor", po::bool_switch(&p.monitor),
+         "Run the load through the TS health monitor.")
+        ("io-uring", po::bool_switch(&p.io_uring),
+         "Have the Buffer write through io_uring.")
+        ("splice", po::bool_switch(&p.splice),
+         "Have the Buffer vmsplice into the pipe.")
+        ("tee", po::bool_switch(&p.tee),
+         "With --splice, also mirror to a FIFO (drained and counted).")
+        ("fanout", po::value<vector<string> >(&p.fanout),
+         "Also send the stream to this sink, as for hauppauge2 --fanout.")
+        ("loopback", po::value<string>(&p.loopback),
+         "Add a udp or rtp fan-out sink, e.g. \"rtp,smooth=100\", "
+         "sending to a receiver here that checks datagram sizes, "
+         "sequence numbers and spacing against PCR.")
+        ("stall", po::value<int>(&p.stall)->default_value(0),
+         "Make the output non-blocking and give up on it after this many "
+         "seconds without progress.")
+        ("hang-after", po::value<int>(&p.hang_after)->default_value(0),
+         "Stop reading the output after this many ms.")
+        ("scan", po::value<string>()->implicit_value(""),
+         "Time the TS re-framer over this capture file, or without a file "
+         "over --scan-mb of synthetic stream, and exit.")
+        ("scan-mb", po::value<size_t>()->default_value(256),
+         "Size of the synthetic stream for --scan.")
+        ("handoff", po::value<string>(),
+         "Time only the queue between Fill() and the writer: spsc "
+         "(today's), mutex (the one it replaced) or old (that one "
+         "with its writer loop's 25 ms sleep), and exit. Uses --chunk, "
+         "--bitrate (0 = back to back) and --duration.")
+        ("report", po::value<int>(&p.report)->default_value(1000),
+         "ms between progress lines. 0 = summary only.")
+        ("loglevel", po::value<string>(),
+         "debug, info, notice, warning, err, crit");
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, opts), vm);
+        po::notify(vm);
+    }
+    catch (std::exception &e)
+    {
+        cerr << e.what() << endl << opts << endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        cout << opts << endl;
+        return 0;
+    }
+    if (vm.count("loglevel"))
+        setLogLevelFilter(vm["loglevel"].as<string>());
+    if (vm.count("scan"))
+        return scan_bench(vm["scan"].as<string>(),
+                          vm["scan-mb"].as<size_t>(), p.chunk);
+    if (vm.count("handoff"))
+        return handoff_bench(vm["handoff"].as<string>(), p.chunk,
+                             p.bitrate, p.duration);
+    if (p.bitrate == 0 || p.burst < 1)
+    {
+        cerr << "bitrate and burst must be positive." << endl;
+        return 1;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        cerr << "pipe: " << strerror(errno) << endl;
+        return 1;
+    }
+    if (p.pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, p.pipe_size) < 0)
+        cerr << "F_SETPIPE_SZ: " << strerror(errno) << endl;
+
+    atomic<bool> run(true);
+    atomic<bool> streaming(true);
+    atomic<bool> xon(true);
+    atomic<bool> producing(true);
+    BenchStats   st;
+
+    Buffer buffer(p.bitrate, run, streaming, xon, fds[1],
+                  p.buffer_seconds);
+    buffer.SetBlockSize(p.block_size);
+    buffer.SetReframe(p.reframe);
+    buffer.SetMonitor(p.monitor);
+    if (p.io_uring)
+        buffer.UseIOUring();
+    if (p.stall > 0)
+        buffer.SetNonBlocking(p.stall);
+
+    string           tee_path;
+    atomic<uint64_t> tee_bytes(0);
+    thread           tee_drainer;
+    if (p.tee)
+    {
+        tee_path = "/tmp/hauppauge2-bench-" + to_string(getpid()) + ".fifo";
+        if (mkfifo(tee_path.c_str(), 0600) < 0)
+        {
+            cerr << "mkfifo: " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    if ((p.splice || p.tee) && !buffer.EnableSplice(tee_path))
+        return 1;
+    if (p.tee)
+        tee_drainer = thread(drain_tee, tee_path, cref(run), ref(tee_bytes));
+
+    int           lb_fd = -1;
+    bool          lb_rtp = false;
+    atomic<bool>  lb_run(true);
+    LoopbackStats lb;
+    thread        lb_receiver;
+    if (!p.loopback.empty())
+    {
+        uint16_t port;
+        if ((lb_fd = loopback_open(port)) < 0)
+            return 1;
+        size_t comma = p.loopback.find(',');
+        string type  = p.loopback.substr(0, comma);
+        if (type != "udp" && type != "rtp")
+        {
+            cerr << "loopback: sink type must be udp or rtp." << endl;
+            return 1;
+        }
+        lb_rtp = (type == "rtp");
+        p.fanout.push_back(type + ":127.0.0.1:" + to_string(port) +
+                           (comma == string::npos ? ""
+                                                  : p.loopback.substr(comma)));
+        lb_receiver = thread(loopback_recv, lb_fd, lb_rtp, cref(lb_run),
+                             ref(lb));
+    }
+    for (const string & sink : p.fanout)
+    {
+        string       errmsg;
+        FanOut::Spec spec;
+        if (!FanOut::Parse(sink, spec, errmsg))
+        {
+            cerr << errmsg << endl;
+            return 1;
+        }
+        if (!buffer.AddSink(spec))
+            return 1;
+    }
+    if (!p.spill_dir.empty() &&
+        !buffer.EnableSpill(p.spill_dir,
+                            static_cast<uint64_t>(p.spill_max) << 20))
+        return 1;
+    if (!buffer.Start())
+        return 1;
+
+    thread drainer(drain, fds[0], cref(p), ref(st));
+    thread producer(produce, ref(buffer), cref(p), cref(producing),
+                    ref(st));
+
+    auto     start = bench_clock::now();
+    auto     end   = start + chrono::seconds(p.duration);
+    auto     next  = start;
+    auto     report = start + chrono::milliseconds(p.report);
+    auto     xoff_at = start + chrono::milliseconds(p.xoff_every);
+    auto     xon_at = start;
+    uint64_t depth_sum = 0;
+    uint64_t depth_cnt = 0;
+    uint64_t depth_max = 0;
+    uint64_t last_in = 0;
+    uint64_t last_out = 0;
+
+    if (p.report > 0)
+        cout << "    time    in Mb/s   out Mb/s  queued   dropped      lost"
+             << endl;
+
+    while ((next += chrono::milliseconds(TICK_MS)) < end)
+    {
+        this_thread::sleep_until(next);
+
+        if (p.xoff_every > 0)
+        {
+            if (xon && next >= xoff_at)
+            {
+                xon = false;
+                xon_at  = next + chrono::milliseconds(p.xoff_for);
+                xoff_at = next + chrono::milliseconds(p.xoff_every);
+            }
+            else if (!xon && next >= xon_at)
+            {
+                xon = true;
+                buffer.Wake();
+            }
+        }
+
+        uint64_t depth = buffer.QueuedBytes();
+        depth_sum += depth;
+        ++depth_cnt;
+        depth_max = max(depth_max, depth);
+
+        if (p.report > 0 && next >= report)
+        {
+            double secs = p.report / 1000.0;
+            uint64_t in = st.produced, out = st.drained;
+            cout << fixed << setprecision(2) << setw(8)
+                 << chrono::duration<double>(next - start).count()
+                 << setw(11) << (in - last_in) * 8 / secs / 1e6
+                 << setw(11) << (out - last_out) * 8 / secs / 1e6
+                 << setw(7) << depth * 100 / buffer.Budget() << "%"
+                 << setw(10) << buffer.Dropped()
+                 << setw(10) << st.lost << endl;
+            last_in = in;
+            last_out = out;
+            report += chrono::milliseconds(p.report);
+        }
+    }
+
+    // Stop the producer and give the output a moment to catch up.
+    producing = false;
+    producer.join();
+    double produced_secs = chrono::duration<double>
+                           (bench_clock::now() - start).count();
+    xon = true;
+    buffer.Wake();
+    auto flush_end = bench_clock::now() + chrono::seconds(2);
+    while ((buffer.QueuedBytes() > 0 || buffer.SpillUsed() > 0) &&
+           bench_clock::now() < flush_end)
+        this_thread::sleep_for(chrono::milliseconds(TICK_MS));
+    double elapsed = chrono::duration<double>
+                     (bench_clock::now() - start).count();
+
+    run = false;
+    buffer.Wake();
+    buffer.Join();
+    st.hung = false;
+    close(fds[1]);
+    drainer.join();
+    close(fds[0]);
+    if (p.tee)
+    {
+        tee_drainer.join();
+        unlink(tee_path.c_str());
+    }
+    if (lb_fd >= 0)
+    {
+        // The sink has sent its last datagram; let it arrive.
+        this_thread::sleep_for(chrono::milliseconds(TICK_MS * 10));
+        lb_run = false;
+        lb_receiver.join();
+        close(lb_fd);
+        sort(lb.pcr_error.begin(), lb.pcr_error.end());
+    }
+
+    sort(st.latency.begin(), st.latency.end());
+
+    if (p.monitor)
+    {
+        TSMonitor::Window win;
+        win.when = start;
+        cout << "\nTS health      : " << buffer.Health(win) << "\n";
+    }
+
+    cout << fixed << setprecision(2)
+         << "\nElapsed        : " << elapsed << " s\n"
+         << "Produced       : " << st.produced << " bytes, "
+         << st.produced * 8 / produced_secs / 1e6 << " Mb/s\n"
+         << "Written        : " << st.drained << " bytes, "
+         << st.drained * 8 / elapsed / 1e6 << " Mb/s\n"
+         << "Dropped chunks : " << buffer.Dropped() << "\n"
+         << "Lost packets   : " << st.lost << "\n"
+         << "Sync errors    : " << st.sync_errors << "\n"
+         << "Sync losses    : " << buffer.SyncLosses() << "\n"
+         << "Slept with data: " << buffer.SleptWithData() << "\n"
+         << "Queued bytes   : avg "
+         << (depth_cnt ? static_cast<double>(depth_sum) / depth_cnt : 0)
+         << ", max " << depth_max << " of " << buffer.Budget() << "\n"
+         << "High watermark : " << buffer.HighWaterEvents() << " times, "
+         << buffer.HighWaterMs() << " ms\n"
+         << "Spilled        : " << buffer.Spilled() << " bytes\n";
+    if (buffer.OutputFailed())
+        cout << "Output failed  : " << buffer.OutputError() << ", "
+             << buffer.Undelivered() << " bytes undelivered\n";
+    if (p.tee)
+        cout << "Mirrored       : " << tee_bytes << " bytes, "
+             << buffer.TeeSkipped() << " skipped\n";
+    if (!p.fanout.empty())
+        cout << "Fan-out        : " << buffer.FanOutReport() << "\n";
+    if (lb_fd >= 0)
+        cout << "Loopback       : " << lb.datagrams << " datagrams, "
+             << lb.bad_size << " malformed, "
+             << (lb_rtp ? to_string(lb.rtp_missing) + " missing and " +
+                          to_string(lb.rtp_reordered) +
+                          " out of order by RTP sequence, "
+                        : string())
+             << lb.lost << " packets lost, " << lb.kernel_drops
+             << " dropped by the kernel\n"
+             << "PCR spacing    : p50 " << percentile(lb.pcr_error, 50)
+             << ", p90 " << percentile(lb.pcr_error, 90)
+             << ", p99 " << percentile(lb.pcr_error, 99)
+             << ", max " << (lb.pcr_error.empty() ? 0
+                                                  : lb.pcr_error.back())
+             << " us off over " << lb.pcr_error.size() << " PCRs\n";
+    cout << "Latency (us)   : p50 " << percentile(st.latency, 50)
+         << ", p90 " << percentile(st.latency, 90)
+         << ", p99 " << percentile(st.latency, 99)
+         << ", p99.9 " << percentile(st.latency, 99.9)
+         << ", max " << (st.latency.empty() ? 0 : st.latency.back())
+         << " over " << st.latency.size() << " chunks" << endl;
+
+    return 0;
+}
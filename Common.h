@@ -26,6 +26,7 @@
 #include "HapiCommon.h"
 
 #include <string>
+#include <vector>
 
 struct Parameters
 {
@@ -42,6 +43,28 @@ struct Parameters
     std::string output;
     bool   mythtv;
     bool   flipFields;
+    int    usbEventPriority;
+    int    usbEventCPU;
+    int    usbReadAhead;
+    int    usbRecoverAttempts;
+    int    bufferSeconds;
+    std::string spillDir;
+    int    spillMax;
+    bool   reframe;
+    bool   tsMonitor;
+    bool   stripNull;
+    std::vector<uint16_t> pidAllow;
+    int    outputWriteSize;
+    int    outputPrealloc;
+    int    outputSync;
+    bool   outputDirect;
+    bool   ioUring;
+    int    pipeSize;
+    bool   splice;
+    std::string pipeTee;
+    int    outputStall;
+    std::vector<std::string> fanout;
+    bool   gopDrop;
 
     _HAPI_VIDEO_CAPTURE_SOURCE videoInput;
     _HAPI_AUDIO_CAPTURE_SOURCE audioInput;
@@ -0,0 +1,320 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FanOut.h"
+#include "Logger.h"
+
+#include <boost/algorithm/string.hpp>
+
+#include <chrono>
+#include <sstream>
+
+using namespace std;
+
+bool FanOut::Parse(const string & str, Spec & spec, string & errmsg)
+{
+    vector<string> tokens;
+    boost::split(tokens, str, boost::is_any_of(","));
+
+    size_t colon = tokens[0].find(':');
+    if (colon == string::npos || colon + 1 == tokens[0].size())
+    {
+        errmsg = "Fan-out sink '" + str + "' is not type:target";
+        return false;
+    }
+    spec.type      = tokens[0].substr(0, colon);
+    spec.target    = tokens[0].substr(colon + 1);
+    spec.policy    = POLICY_DROP;
+    spec.max_bytes = static_cast<uint64_t>(DEFAULT_QUEUE_MB) << 20;
+    spec.options.clear();
+
+    for (size_t idx = 1; idx < tokens.size(); ++idx)
+    {
+        const string & tok = tokens[idx];
+        if (tok == "drop")
+            spec.policy = POLICY_DROP;
+        else if (tok == "close")
+            spec.policy = POLICY_CLOSE;
+        else if (boost::starts_with(tok, "queue="))
+        {
+            size_t        pos = 0;
+            unsigned long mb = 0;
+            try
+            {
+                mb = stoul(tok.substr(6), &pos);
+            }
+            catch (std::exception &)
+            {
+                pos = 0;
+            }
+            if (pos == 0 || pos != tok.size() - 6 || mb < 1)
+            {
+                errmsg = "Invalid queue size in '" + str + "'";
+                return false;
+            }
+            spec.max_bytes = static_cast<uint64_t>(mb) << 20;
+        }
+        else
+            spec.options.push_back(tok);
+    }
+
+    // Let the sink itself check the rest.
+    unique_ptr<Sink> sink(Sink::Create(spec.type, spec.target,
+                                       spec.options, errmsg));
+    if (!sink)
+    {
+        errmsg += " in '" + str + "'";
+        return false;
+    }
+    return true;
+}
+
+FanOut::FanOut(void)
+    : m_run(false)
+{
+}
+
+FanOut::~FanOut(void)
+{
+    Stop();
+}
+
+bool FanOut::Add(const Spec & spec)
+{
+    if (m_outputs.size() >= MAX_SINKS)
+    {
+        ERRORLOG << "Fan-out: at most " << MAX_SINKS << " sinks.";
+        return false;
+    }
+
+    string           errmsg;
+    unique_ptr<Sink> sink(Sink::Create(spec.type, spec.target,
+                                       spec.options, errmsg));
+    if (!sink)
+        ERRORLOG << "Fan-out: " << errmsg << ".";
+    if (!sink || !sink->Open())
+    {
+        ERRORLOG << "Fan-out: unable to add '" << spec.type << ":"
+                 << spec.target << "'.";
+        return false;
+    }
+
+    unique_ptr<Output> out(new Output);
+    out->sink      = std::move(sink);
+    out->policy    = spec.policy;
+    out->max_bytes = spec.max_bytes;
+    out->waiting   = false;
+    out->closed    = false;
+    out->queued    = 0;
+    out->written   = 0;
+    out->dropped   = 0;
+    out->behind    = false;
+    out->behind_from = 0;
+
+    INFOLOG << "Fan-out to " << out->sink->Name() << ", up to "
+            << (out->max_bytes >> 20) << "MB queued, "
+            << (out->policy == POLICY_DROP ? "dropping" : "closing")
+            << " when behind.";
+    m_outputs.push_back(std::move(out));
+    return true;
+}
+
+uint64_t FanOut::MaxBytes(void) const
+{
+    uint64_t bytes = 0;
+    for (auto & out : m_outputs)
+        bytes += out->max_bytes;
+    return bytes;
+}
+
+void FanOut::Start(size_t blocks)
+{
+    m_run = true;
+    for (auto & out : m_outputs)
+    {
+        // Either queue can hold every block in the pool.
+        out->data.reset(new queue_t(blocks));
+        out->done.reset(new queue_t(blocks));
+        out->thread = thread(&FanOut::Run, this, std::ref(*out));
+    }
+}
+
+void FanOut::Stop(void)
+{
+    if (!m_run)
+        return;
+    m_run = false;
+
+    for (auto & out : m_outputs)
+    {
+        out->sink->Stop();
+        {
+            lock_guard<mutex> lock(out->mutex);
+        }
+        out->cond.notify_one();
+    }
+    for (auto & out : m_outputs)
+    {
+        if (out->thread.joinable())
+            out->thread.join();
+        out->sink->Close();
+        INFOLOG << "Fan-out " << out->sink->Name() << ": "
+                << out->written << " bytes written, " << out->dropped
+                << " dropped" << (out->closed ? ", closed" : "")
+                << (out->sink->Stats().empty() ? "." :
+                    " (" + out->sink->Stats() + ").");
+    }
+}
+
+uint32_t FanOut::Accept(size_t len)
+{
+    uint32_t mask = 0;
+
+    for (size_t idx = 0; idx < m_outputs.size(); ++idx)
+    {
+        Output & out = *m_outputs[idx];
+        if (out.closed)
+            continue;
+
+        if (out.queued + len <= out.max_bytes)
+        {
+            if (out.behind)
+            {
+                INFOLOG << "Fan-out " << out.sink->Name()
+                        << " caught up, " << out.dropped - out.behind_from
+                        << " bytes dropped.";
+                out.behind = false;
+            }
+            mask |= 1U << idx;
+            continue;
+        }
+
+        if (out.policy == POLICY_CLOSE)
+        {
+            WARNLOG << "Fan-out " << out.sink->Name()
+                    << " fell behind, closing it.";
+            out.closed = true;
+        }
+        else if (!out.behind)
+        {
+            WARNLOG << "Fan-out " << out.sink->Name()
+                    << " fell behind, dropping data.";
+            out.behind = true;
+            out.behind_from = out.dropped;
+        }
+        out.dropped += len;
+    }
+    return mask;
+}
+
+void FanOut::Push(Block * blk, uint32_t mask)
+{
+    for (size_t idx = 0; mask != 0; ++idx, mask >>= 1)
+    {
+        if (!(mask & 1))
+            continue;
+
+        Output & out = *m_outputs[idx];
+        out.queued += blk->size;
+        out.data->push(blk);
+        if (out.waiting.exchange(false))
+        {
+            // Taking the lock orders this after the sink's last look at
+            // its queue.
+            {
+                lock_guard<mutex> lock(out.mutex);
+            }
+            out.cond.notify_one();
+        }
+    }
+}
+
+void FanOut::Dropped(uint32_t mask, size_t len)
+{
+    for (size_t idx = 0; mask != 0; ++idx, mask >>= 1)
+        if (mask & 1)
+            m_outputs[idx]->dropped += len;
+}
+
+string FanOut::Report(void) const
+{
+    ostringstream os;
+
+    for (auto & out : m_outputs)
+    {
+        if (os.tellp() > 0)
+            os << " ";
+        os << out->sink->Name()
+           << " written=" << out->written
+           << " dropped=" << out->dropped
+           << " queued=" << out->queued * 100 / out->max_bytes << "%";
+        string stats = out->sink->Stats();
+        if (!stats.empty())
+            os << " " << stats;
+        if (out->closed)
+            os << " closed";
+    }
+    return os.str();
+}
+
+void FanOut::Run(Output & out)
+{
+    setThreadName("fan-out");
+    bool open = true;
+
+    for (;;)
+    {
+        Block *blk = nullptr;
+        while (out.data->pop(blk))
+        {
+            size_t len = blk->size;
+
+            if (out.closed)
+                out.dropped += len;
+            else if (out.sink->Write(blk->data, len))
+                out.written += len;
+            else
+            {
+                ERRORLOG << "Fan-out " << out.sink->Name()
+                         << " failed, closing it.";
+                out.closed = true;
+                out.dropped += len;
+            }
+            out.queued -= len;
+
+            if (blk->refs.fetch_sub(1) == 1)
+                out.done->push(blk);
+        }
+        if (out.closed && open)
+        {
+            out.sink->Close();
+            open = false;
+        }
+
+        unique_lock<mutex> lock(out.mutex);
+        if (!m_run && out.data->read_available() == 0)
+            break;
+        out.waiting = true;
+        out.cond.wait_for(lock, chrono::milliseconds(IDLE_MS),
+                          [this, &out] { return !m_run ||
+                                  out.data->read_available() > 0; });
+        out.waiting = false;
+    }
+}
@@ -0,0 +1,144 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FanOut_H_
+#define _FanOut_H_
+
+#include "BlockPool.h"
+#include "Sink.h"
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Feeds the blocks Buffer queues for its own output to further sinks
+ * as well, without copying them again.  Each sink has a queue and a
+ * thread of its own, and a limit on the bytes it may have queued.  A
+ * sink at its limit loses data, or is closed, depending on its policy;
+ * it never holds up the main output or the other sinks.
+ *
+ * A block is shared by reference: Buffer sets Block::refs to the
+ * number of holders before handing it out.  A sink dropping the last
+ * reference passes the block back through Collect(), so only Buffer's
+ * thread ever returns blocks to the pool.
+ */
+class FanOut
+{
+  public:
+    enum policy_t { POLICY_DROP, POLICY_CLOSE };
+    enum constants { MAX_SINKS = 32, DEFAULT_QUEUE_MB = 16, IDLE_MS = 100 };
+
+    struct Spec
+    {
+        std::string type;
+        std::string target;
+        policy_t    policy;
+        uint64_t    max_bytes;
+        std::vector<std::string> options;   // For the sink
+    };
+
+    /*
+     * Parse "type:target[,drop|,close][,queue=MB][,key=value...]",
+     * e.g. "rtp:239.0.0.1:5000,drop,queue=4,smooth=200".  See
+     * Sink::Create() for the types and their options.  On error
+     * returns false with a message in errmsg.
+     */
+    static bool Parse(const std::string & str, Spec & spec,
+                      std::string & errmsg);
+
+    FanOut(void);
+    ~FanOut(void);
+
+    // Open the sink; call before Start().
+    bool Add(const Spec & spec);
+    size_t Count(void) const { return m_outputs.size(); }
+    // What all sinks together may hold, for sizing the pool.
+    uint64_t MaxBytes(void) const;
+
+    // `blocks' is the size of the pool the blocks come from.
+    void Start(size_t blocks);
+    // Let the sinks write out what they have, then stop them.
+    void Stop(void);
+
+    /*
+     * Producer side.  Accept() returns a mask of the sinks with room
+     * for another `len' bytes, applying the policy of those without.
+     * The block, with its references already counted, then goes to
+     * Push(); if none could be had, Dropped() counts the loss.
+     */
+    uint32_t Accept(size_t len);
+    void Push(Block * blk, uint32_t mask);
+    void Dropped(uint32_t mask, size_t len);
+
+    // Consumer side: hand blocks the sinks are done with to `release'.
+    template <typename F>
+    void Collect(F release)
+    {
+        for (auto & out : m_outputs)
+            if (out->done)
+                out->done->consume_all(release);
+    }
+
+    // Per sink: bytes written and dropped, queue use, state.
+    std::string Report(void) const;
+
+  private:
+    using queue_t = boost::lockfree::spsc_queue<Block *>;
+
+    struct Output
+    {
+        std::unique_ptr<Sink>    sink;
+        policy_t                 policy;
+        uint64_t                 max_bytes;
+
+        // Buffer::Fill() to the sink's thread, and back to Buffer::Run()
+        // for blocks the sink held the last reference to.
+        std::unique_ptr<queue_t> data;
+        std::unique_ptr<queue_t> done;
+
+        std::thread              thread;
+        std::mutex               mutex;
+        std::condition_variable  cond;
+        std::atomic_bool         waiting;
+
+        std::atomic_bool         closed;
+        std::atomic<uint64_t>    queued;
+        std::atomic<uint64_t>    written;
+        std::atomic<uint64_t>    dropped;
+
+        bool                     behind;        // producer only
+        uint64_t                 behind_from;   // dropped when it started
+    };
+
+    void Run(Output & out);
+
+    std::vector<std::unique_ptr<Output>> m_outputs;
+    std::atomic_bool                     m_run;
+};
+
+#endif
@@ -0,0 +1,346 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FileWriter.h"
+#include "Logger.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+FileWriter::FileWriter(const string & file, size_t write_size,
+                       uint64_t extent, uint64_t sync_bytes, bool direct,
+                       bool uring)
+    : m_file(file)
+    , m_write_size((write_size + ALIGN - 1) / ALIGN * ALIGN)
+    , m_extent(extent)
+    , m_sync_bytes(sync_bytes)
+    , m_direct(direct)
+    , m_uring(uring)
+    , m_fd(-1)
+    , m_cb(std::bind(&FileWriter::Write, this, std::placeholders::_1,
+                     std::placeholders::_2))
+    , m_slab(nullptr)
+    , m_cur(nullptr)
+    , m_stalled(0)
+    , m_run(false)
+    , m_offset(0)
+    , m_allocated(0)
+    , m_synced(0)
+    , m_prev_synced(0)
+    , m_written(0)
+    , m_dropped(0)
+{
+    if (m_write_size == 0)
+        m_write_size = ALIGN;
+}
+
+FileWriter::~FileWriter(void)
+{
+    Close();
+    free(m_slab);
+}
+
+bool FileWriter::Open(void)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    if (m_direct)
+    {
+        m_fd = open(m_file.c_str(), flags | O_DIRECT, 0666);
+        if (m_fd < 0 && errno == EINVAL)
+        {
+            WARNLOG << "'" << m_file << "': O_DIRECT not supported here, "
+                    << "using buffered writes.";
+            m_direct = false;
+        }
+    }
+    if (m_fd < 0)
+        m_fd = open(m_file.c_str(), flags, 0666);
+    if (m_fd < 0)
+    {
+        m_errmsg = "Failed to open '" + m_file + "' :" + strerror(errno);
+        ERRORLOG << m_errmsg;
+        return false;
+    }
+
+    // Enough buffers to ride out QUEUE_BYTES worth of disk stall.
+    size_t count = QUEUE_BYTES / m_write_size;
+    if (count < MIN_BUFFERS)
+        count = MIN_BUFFERS;
+    void *slab = nullptr;
+    if (posix_memalign(&slab, ALIGN, m_write_size * count) != 0)
+    {
+        m_errmsg = "Unable to allocate " + to_string(count) +
+                   " output buffers of " + to_string(m_write_size) +
+                   " bytes.";
+        ERRORLOG << m_errmsg;
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_slab = reinterpret_cast<uint8_t *>(slab);
+    m_bufs.resize(count);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        m_bufs[idx].data = m_slab + idx * m_write_size;
+        m_bufs[idx].len  = 0;
+        m_free.push_back(&m_bufs[idx]);
+    }
+    m_writer.reset(OutputWriter::Create(m_fd, m_uring, QUEUE_DEPTH, -1,
+                                        m_slab, m_write_size * count));
+
+    Grow(m_write_size);
+
+    m_run = true;
+    m_thread = thread(&FileWriter::Run, this);
+
+    INFOLOG << "Output to '" << m_file << "' in " << m_write_size
+            << " byte writes" << (m_direct ? " (O_DIRECT)" : "")
+            << " via " << m_writer->Name()
+            << ", preallocating " << (m_extent >> 20) << "MB at a time.";
+    return true;
+}
+
+void FileWriter::Close(void)
+{
+    if (m_fd < 0)
+        return;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_cur && m_cur->len > 0)
+            m_full.push_back(m_cur);
+        m_cur = nullptr;
+        m_run = false;
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    m_writer.reset();
+
+    // Give back whatever was preallocated past the end, and any O_DIRECT
+    // padding.
+    if (ftruncate(m_fd, m_offset) < 0)
+        ERRORLOG << "'" << m_file << "': truncate failed: "
+                 << strerror(errno);
+    close(m_fd);
+    m_fd = -1;
+
+    INFOLOG << "'" << m_file << "': " << m_written << " bytes written"
+            << (m_dropped ? ", " + to_string(m_dropped) +
+                " dropped while the disk was stalled." : ".");
+}
+
+void FileWriter::Write(const void *data, size_t len)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(data);
+
+    while (len > 0)
+    {
+        if (m_cur == nullptr)
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_free.empty())
+            {
+                // Never block the USB side; the disk has to catch up.
+                m_dropped += len;
+                if (m_stalled++ % 100 == 0)
+                    WARNLOG << "'" << m_file << "': output stalled, "
+                            << m_dropped << " bytes dropped.";
+                return;
+            }
+            m_cur = m_free.front();
+            m_free.pop_front();
+            m_cur->len = 0;
+            m_stalled = 0;
+        }
+
+        size_t room = m_write_size - m_cur->len;
+        size_t cnt  = (len < room) ? len : room;
+        memcpy(m_cur->data + m_cur->len, src, cnt);
+        m_cur->len += cnt;
+        src += cnt;
+        len -= cnt;
+
+        if (m_cur->len == m_write_size)
+        {
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_full.push_back(m_cur);
+            }
+            m_cur = nullptr;
+            m_cond.notify_one();
+        }
+    }
+}
+
+/*
+ * Reserve another extent once writing gets within one write of the
+ * end of what is allocated.  KEEP_SIZE leaves the file size alone, so
+ * anything reading the recording as it grows sees only real data.
+ */
+void FileWriter::Grow(uint64_t need)
+{
+    if (m_extent == 0 || need <= m_allocated)
+        return;
+
+    uint64_t len = (need - m_allocated + m_extent - 1) / m_extent * m_extent;
+    if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_allocated, len) < 0)
+    {
+        WARNLOG << "'" << m_file << "': unable to preallocate, "
+                << strerror(errno) << ".  Continuing without.";
+        m_extent = 0;
+        return;
+    }
+    m_allocated += len;
+}
+
+/*
+ * Queue the rest of `buf' at its place in the file.  False if it could
+ * not be, in which case it is done with.
+ */
+bool FileWriter::Submit(Buf & buf)
+{
+    struct iovec iov;
+    iov.iov_base = buf.data + buf.pos;
+    iov.iov_len  = buf.out - buf.pos;
+
+    if (m_writer->Submit(&iov, 1, buf.offset + buf.pos, &buf - m_bufs.data()))
+        return true;
+    ERRORLOG << "'" << m_file << "': unable to queue write.";
+    return false;
+}
+
+// True once `buf' is finished with, written or not.
+bool FileWriter::Complete(Buf & buf, ssize_t result)
+{
+    if (result < 0 && result != -EINTR && result != -EAGAIN)
+    {
+        ERRORLOG << "'" << m_file << "': write failed: "
+                 << strerror(-result);
+        return true;
+    }
+    if (result > 0)
+        buf.pos += result;
+    if (buf.pos < buf.out)
+        return !Submit(buf);
+
+    m_written += buf.len;
+    return true;
+}
+
+/*
+ * Start writeback of what was written since the last call, then wait
+ * for the range before that -- which has had a whole interval to
+ * finish -- and drop it from the page cache.  Dirty pages are bounded
+ * to about two intervals' worth.
+ */
+void FileWriter::Sync(void)
+{
+    uint64_t written = m_written;
+    if (m_sync_bytes == 0 || m_direct || written - m_synced < m_sync_bytes)
+        return;
+
+    sync_file_range(m_fd, m_synced, written - m_synced,
+                    SYNC_FILE_RANGE_WRITE);
+    if (m_synced > m_prev_synced)
+    {
+        sync_file_range(m_fd, m_prev_synced, m_synced - m_prev_synced,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(m_fd, m_prev_synced, m_synced - m_prev_synced,
+                      POSIX_FADV_DONTNEED);
+    }
+    m_prev_synced = m_synced;
+    m_synced = written;
+}
+
+void FileWriter::Run(void)
+{
+    setThreadName("file writer");
+
+    WriteCompletion done[QUEUE_DEPTH];
+    Buf            *ready[QUEUE_DEPTH];
+    Buf            *finished[QUEUE_DEPTH];
+
+    unique_lock<mutex> lock(m_mutex);
+    for (;;)
+    {
+        // While writes are in flight, wait for those below instead.
+        if (m_writer->InFlight() == 0)
+        {
+            m_cond.wait(lock, [this] { return !m_run || !m_full.empty(); });
+            if (m_full.empty())
+                break;
+        }
+
+        int cnt = 0;
+        while (!m_full.empty() &&
+               m_writer->InFlight() + cnt < m_writer->Depth())
+        {
+            ready[cnt++] = m_full.front();
+            m_full.pop_front();
+        }
+        lock.unlock();
+
+        int done_cnt = 0;
+        for (int idx = 0; idx < cnt; ++idx)
+        {
+            Buf & buf = *ready[idx];
+
+            // O_DIRECT needs whole blocks; the tail is padded, then
+            // truncated away in Close().
+            buf.out = buf.len;
+            if (m_direct && buf.out % ALIGN)
+            {
+                buf.out = (buf.len + ALIGN - 1) / ALIGN * ALIGN;
+                memset(buf.data + buf.len, 0, buf.out - buf.len);
+            }
+            buf.offset = m_offset;
+            buf.pos    = 0;
+            m_offset  += buf.len;
+
+            Grow(m_offset + m_write_size);
+            if (!Submit(buf))
+                finished[done_cnt++] = &buf;
+        }
+
+        int reaped = m_writer->Completed(done, QUEUE_DEPTH, true);
+        for (int idx = 0; idx < reaped; ++idx)
+        {
+            Buf & buf = m_bufs[done[idx].tag];
+            if (Complete(buf, done[idx].result))
+                finished[done_cnt++] = &buf;
+        }
+        Sync();
+
+        lock.lock();
+        for (int idx = 0; idx < done_cnt; ++idx)
+            m_free.push_back(finished[idx]);
+    }
+}
@@ -0,0 +1,127 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _FileWriter_H_
+#define _FileWriter_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "OutputWriter.h"
+
+/*
+ * Recording to a file, without the encoder's callback ever waiting on
+ * the disk.  Data is collected into large aligned buffers which a
+ * background thread writes out.  That thread also preallocates the
+ * file in big extents and pushes dirty pages to disk as it goes with
+ * sync_file_range(), so writeback never piles up into a long stall.
+ * With io_uring several buffers are in flight at once, written from
+ * the registered slab.
+ */
+class FileWriter
+{
+  public:
+    enum constants { ALIGN = 4096, QUEUE_BYTES = 64 << 20, MIN_BUFFERS = 4,
+                     QUEUE_DEPTH = 8 };
+
+    using callback_t = std::function<void(void *, size_t)>;
+
+    /*
+     * write_size: bytes per write(), rounded up to ALIGN.
+     * extent:     bytes to fallocate() at a time, 0 = don't.
+     * sync_bytes: start writeback every this many bytes, 0 = don't.
+     * direct:     use O_DIRECT, if the filesystem allows it.
+     * uring:      write through io_uring, if the kernel allows it.
+     */
+    FileWriter(const std::string & file, size_t write_size,
+               uint64_t extent, uint64_t sync_bytes, bool direct,
+               bool uring = false);
+    ~FileWriter(void);
+
+    bool Open(void);
+    void Close(void);
+
+    void Write(const void *data, size_t len);
+    callback_t & getWriteCallBack(void) { return m_cb; }
+
+    std::string ErrorString(void) const { return m_errmsg; }
+    uint64_t Written(void) const { return m_written; }
+    uint64_t Dropped(void) const { return m_dropped; }
+
+  private:
+    struct Buf
+    {
+        uint8_t *data;
+        size_t   len;
+        // Writer thread only.
+        uint64_t offset;        // In the file
+        size_t   out;           // len, padded for O_DIRECT
+        size_t   pos;           // Written so far
+    };
+
+    void Run(void);
+    void Grow(uint64_t need);
+    bool Submit(Buf & buf);
+    bool Complete(Buf & buf, ssize_t result);
+    void Sync(void);
+
+    std::string  m_file;
+    size_t       m_write_size;
+    uint64_t     m_extent;
+    uint64_t     m_sync_bytes;
+    bool         m_direct;
+    bool         m_uring;
+    int          m_fd;
+    std::string  m_errmsg;
+
+    callback_t   m_cb;
+    uint8_t     *m_slab;
+    std::vector<Buf> m_bufs;
+    Buf         *m_cur;             // Being filled by Write()
+    int          m_stalled;         // Write() calls dropped in a row
+
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::deque<Buf *>       m_full;
+    std::deque<Buf *>       m_free;
+    bool                    m_run;
+    std::thread             m_thread;
+
+    // Writer thread only.
+    std::unique_ptr<OutputWriter> m_writer;
+    uint64_t     m_offset;              // Where the next buffer goes
+    uint64_t     m_allocated;
+    uint64_t     m_synced;
+    uint64_t     m_prev_synced;
+
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_dropped;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "GopFilter.h"
+#include "Logger.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+    enum h264_nal { NAL_IDR = 5, NAL_SPS = 7 };
+}
+
+GopFilter::GopFilter(const PSITracker & psi)
+    : m_psi(psi)
+    , m_video_pid(PSITracker::PID_NONE)
+    , m_dropping(false)
+    , m_gops_dropped(0)
+    , m_bytes_dropped(0)
+{
+}
+
+GopFilter::verdict GopFilter::Keep(const uint8_t *pkt, bool overload)
+{
+    if (m_psi.VideoPID() != m_video_pid)
+    {
+        // New stream layout; whatever was being skipped is gone.
+        m_video_pid = m_psi.VideoPID();
+        m_dropping  = false;
+    }
+    if (PSITracker::PID(pkt) != m_video_pid)
+        return KEEP;
+
+    if (!m_dropping)
+    {
+        if (!overload)
+            return KEEP;
+        // The rest of the current GOP goes too.
+        m_dropping = true;
+        ++m_gops_dropped;
+        DEBUGLOG << "GopFilter: overloaded, dropping video to next IDR.";
+    }
+    else if (PSITracker::PUSI(pkt) && RandomAccess(pkt))
+    {
+        if (!overload)
+        {
+            m_dropping = false;
+            INFOLOG << "GopFilter: resuming video after " << m_gops_dropped
+                    << " GOPs (" << m_bytes_dropped << " bytes) dropped.";
+            return KEEP;
+        }
+        ++m_gops_dropped;
+    }
+
+    if (HasPCR(pkt))
+    {
+        m_bytes_dropped += TS_PACKET - (5 + pkt[4]);
+        return KEEP_PCR;
+    }
+    m_bytes_dropped += TS_PACKET;
+    return DROP;
+}
+
+void GopFilter::StripPayload(uint8_t *pkt)
+{
+    size_t end = 5 + pkt[4];
+
+    memset(pkt + end, 0xFF, TS_PACKET - end);
+    pkt[4]  = TS_PACKET - 5;
+    pkt[3]  = (pkt[3] & 0xCF) | 0x20;   // adaptation field only
+    pkt[1] &= ~0x40;                    // no PES starts here
+}
+
+/*
+ * True if a PES starting in this packet can be decoded on its own.
+ * The adaptation field flag is enough when the encoder sets it;
+ * otherwise look for an H.264 IDR slice or SPS in the first packet.
+ */
+bool GopFilter::RandomAccess(const uint8_t *pkt) const
+{
+    if ((pkt[3] & 0x20) && pkt[4] > 0 && (pkt[5] & 0x40))
+        return true;
+    if (m_psi.VideoType() != PSITracker::H264_VIDEO)
+        return false;
+
+    size_t off = PSITracker::PayloadOffset(pkt);
+    if (off + 9 > TS_PACKET ||
+        pkt[off] != 0 || pkt[off + 1] != 0 || pkt[off + 2] != 1)
+        return false;
+    off += 9 + pkt[off + 8];            // PES header
+
+    for (size_t idx = off; idx + 3 < TS_PACKET; ++idx)
+    {
+        if (pkt[idx] == 0 && pkt[idx + 1] == 0 && pkt[idx + 2] == 1)
+        {
+            uint8_t nal = pkt[idx + 3] & 0x1F;
+            if (nal == NAL_IDR || nal == NAL_SPS)
+                return true;
+            idx += 2;
+        }
+    }
+    return false;
+}
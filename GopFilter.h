@@ -0,0 +1,74 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _GopFilter_H_
+#define _GopFilter_H_
+
+#include "PSITracker.h"
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Decides, packet by packet, what to throw away when the output can
+ * not keep up.  Under overload it drops video up to the next random
+ * access point (an IDR, or a PES flagged random access).  PSI, audio
+ * and anything else always pass, so the stream stays decodable and
+ * audio stays continuous.  Dropped video packets that carry a PCR are
+ * kept with their payload removed, so the clock keeps running.
+ *
+ * Expects whole, aligned TS packets, already seen by `psi'.  Not
+ * thread safe; it lives on the producer side of Buffer.
+ */
+class GopFilter
+{
+  public:
+    enum constants { TS_PACKET = 188, SYNC_BYTE = 0x47 };
+    enum verdict { DROP, KEEP, KEEP_PCR };
+
+    explicit GopFilter(const PSITracker & psi);
+
+    // KEEP_PCR: keep only the adaptation field; see StripPayload().
+    verdict Keep(const uint8_t *pkt, bool overload);
+
+    static bool HasPCR(const uint8_t *pkt)
+    { return (pkt[3] & 0x20) && pkt[4] >= 7 && pkt[4] < TS_PACKET - 4 &&
+             (pkt[5] & 0x10); }
+    // Turn a packet into an adaptation field only one, PCR intact.
+    static void StripPayload(uint8_t *pkt);
+
+    bool     Dropping(void) const { return m_dropping; }
+
+    uint64_t GopsDropped(void) const { return m_gops_dropped; }
+    uint64_t BytesDropped(void) const { return m_bytes_dropped; }
+
+  private:
+    bool RandomAccess(const uint8_t *pkt) const;
+
+    const PSITracker & m_psi;
+    uint16_t m_video_pid;
+    bool     m_dropping;
+
+    uint64_t m_gops_dropped;
+    uint64_t m_bytes_dropped;
+};
+
+#endif
@@ -37,6 +37,7 @@ using namespace std;
 
 HauppaugeDev::HauppaugeDev(const Parameters & params)
     : m_fd(-1)
+    , m_usbio(nullptr)
     , m_rxDev(nullptr)
     , m_encDev(nullptr)
     , m_fx2(nullptr)
@@ -519,6 +520,22 @@ bool HauppaugeDev::open_file(const string & file_name)
 {
     if (file_name == "stdout")
         m_fd = 1;
+    else if (m_params.outputWriteSize > 0)
+    {
+        m_writer.reset(new FileWriter(file_name,
+                                      m_params.outputWriteSize << 10,
+                        static_cast<uint64_t>(m_params.outputPrealloc) << 20,
+                        static_cast<uint64_t>(m_params.outputSync) << 20,
+                                      m_params.outputDirect,
+                                      m_params.ioUring));
+        if (!m_writer->Open())
+        {
+            m_errmsg = m_writer->ErrorString();
+            m_writer.reset();
+            return false;
+        }
+        return true;
+    }
     else
         m_fd = open(file_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
 
@@ -562,6 +579,7 @@ bool HauppaugeDev::Open(USBWrapper_t & usbio, bool ac3,
         DEBUGLOG << desc;
     }
 
+    m_usbio = &usbio;
     m_fx2 = new FX2Device_t(usbio);
 
     int idx =0;
@@ -632,7 +650,10 @@ bool HauppaugeDev::Open(USBWrapper_t & usbio, bool ac3,
     {
         if (!open_file(m_params.output))
             return false;
-        m_encDev->setOutputFD(m_fd);
+        if (m_writer)
+            m_encDev->setWriteCallback(m_writer->getWriteCallBack());
+        else
+            m_encDev->setOutputFD(m_fd);
     }
     if (cb)
         m_encDev->setWriteCallback(*cb);
@@ -661,6 +682,11 @@ void HauppaugeDev::Close(void)
         delete m_fx2;
         m_fx2 = nullptr;
     }
+    if (m_writer)
+    {
+        m_writer->Close();
+        m_writer.reset();
+    }
 }
 
 bool HauppaugeDev::StartEncoding(void)
@@ -686,10 +712,15 @@ bool HauppaugeDev::StartEncoding(void)
           break;
     }
 
+    // The first transport stream read starts it.
+    if (m_params.usbReadAhead > 0)
+        m_usbio->readAhead(m_params.usbReadAhead);
+
     if(!m_encDev->startCapture())
     {
         m_errmsg = "Encoder start capture failed.";
         ERRORLOG << m_errmsg;
+        m_usbio->stopStreaming();
         return false;
     }
     log_ports();
@@ -698,7 +729,9 @@ bool HauppaugeDev::StartEncoding(void)
 
 bool HauppaugeDev::StopEncoding(void)
 {
-    if(!m_encDev->stopCapture())
+    bool stopped = m_encDev->stopCapture();
+    m_usbio->stopStreaming();
+    if (!stopped)
     {
         m_errmsg = "Encoder stop capture failed.";
         WARNLOG << m_errmsg;
@@ -25,7 +25,9 @@
 #include "FX2Device.h"
 #include "receiver_ADV7842.h"
 #include "Common.h"
+#include "FileWriter.h"
 
+#include <memory>
 #include <string>
 
 class HauppaugeDev
@@ -67,7 +69,9 @@ class HauppaugeDev
 
   private:
     int                 m_fd;
+    std::unique_ptr<FileWriter> m_writer;
 
+    USBWrapper_t       *m_usbio;
     receiver_ADV7842_t *m_rxDev;
     encoderDev_DXT_t   *m_encDev;
     FX2Device_t        *m_fx2;
@@ -32,7 +32,8 @@ MythTV::MythTV(const Parameters & params, const string & desc)
     : m_desc(desc)
     , m_buffer_max(188 * 100000)
     , m_block_size(m_buffer_max / 4)
-    , m_buffer(this)
+    , m_buffer(params.tsBitrate, m_run, m_streaming, m_xon, 1,
+               params.bufferSeconds)
     , m_commands(this)
     , m_params(params)
     , m_dev(nullptr)
@@ -41,9 +42,42 @@ MythTV::MythTV(const Parameters & params, const string & desc)
     , m_streaming(false)
     , m_xon(false)
     , m_ready(false)
+    , m_recover_pending(false)
+    , m_recovering(false)
+    , m_want_streaming(false)
+    , m_recoveries(0)
     , m_error_cb(std::bind(&MythTV::USBError, this))
 {
-    m_buffer.Start();
+    m_buffer.SetReframe(params.reframe);
+    m_buffer.SetMonitor(params.tsMonitor);
+    m_buffer.SetPIDFilter(params.stripNull, params.pidAllow);
+    m_buffer.SetGopDrop(params.gopDrop);
+    if (params.pipeSize > 0)
+        m_buffer.SetPipeSize(params.pipeSize << 10);
+    if (params.outputStall > 0)
+        m_buffer.SetNonBlocking(params.outputStall);
+    if (params.splice || !params.pipeTee.empty())
+    {
+        if (!m_buffer.EnableSplice(params.pipeTee))
+            WARNLOG << "splice unavailable, writing the stream instead.";
+    }
+    else if (params.ioUring)
+        m_buffer.UseIOUring();
+    for (const string & sink : params.fanout)
+    {
+        string       errmsg;
+        FanOut::Spec spec;
+        if (!FanOut::Parse(sink, spec, errmsg) || !m_buffer.AddSink(spec))
+            WARNLOG << "Not sending the stream to '" << sink << "'.";
+    }
+    if (!params.spillDir.empty() && params.spillMax > 0)
+        m_buffer.EnableSpill(params.spillDir,
+                             static_cast<uint64_t>(params.spillMax) << 20);
+    if (!m_buffer.Start())
+    {
+        Fatal("Unable to allocate the stream buffer.");
+        return;
+    }
     m_commands.Start();
 }
 
@@ -68,7 +102,7 @@ void MythTV::Terminate(void)
     string msg;
     StopEncoding(msg, true);
 
-    m_flow_cond.notify_all();
+    m_buffer.Wake();
     m_run_cond.notify_all();
 }
 
@@ -84,60 +118,192 @@ void MythTV::Wait(void)
                 break;
         }
 
+        if (m_recover_pending)
+        {
+            if (m_params.usbRecoverAttempts > 0)
+                Recover();
+            else
+                Fatal("Detected Error with USB.");
+            continue;
+        }
+
+        // Nobody left to deliver to; don't keep the device running.
+        if (m_buffer.OutputFailed())
+        {
+            Fatal("Output failed: " + m_buffer.OutputError() + ", " +
+                  std::to_string(m_buffer.Undelivered()) +
+                  " bytes undelivered.");
+            continue;
+        }
+
         if (m_streaming)
         {
-            // Check for wedged state.
+            // Check for wedged state, giving a recovered device the
+            // same grace period as a fresh one.
             auto tm = std::chrono::system_clock::now() -
                       std::chrono::seconds(60);
-            if (m_buffer.HeartBeat() < tm)
+            if (m_buffer.HeartBeat() < tm && m_recovered_at < tm)
                 Fatal("We seem to be wedged!");
         }
     }
 }
 
-void MythTV::OpenDev(void)
+bool MythTV::create_dev(string & errmsg)
 {
-    std::lock_guard<std::timed_mutex> lock(m_flow_mutex);
-
-    if (m_dev != nullptr)
-        return;
-
     m_dev = new HauppaugeDev(m_params);
-    if (!m_dev)
-    {
-        Fatal("Unable to create Hauppauge dev.");
-        return;
-    }
     if (!(*m_dev))
     {
+        errmsg = m_dev->ErrorString();
         delete m_dev;
         m_dev = nullptr;
-        Fatal(m_dev->ErrorString());
-        return;
+        return false;
     }
 
-    if (!m_usbio.Open(m_params.serial, &getErrorCallBack()))
+    if (!m_dev->Open(m_usbio, (m_params.audioCodec == HAPI_AUDIO_CODEC_AC3),
+                     &getWriteCallBack()))
     {
+        errmsg = m_dev->ErrorString();
         delete m_dev;
         m_dev = nullptr;
-        Fatal(m_usbio.ErrorString());
+        return false;
+    }
+
+    return true;
+}
+
+void MythTV::OpenDev(void)
+{
+    string errmsg;
+
+    {
+        std::lock_guard<std::timed_mutex> lock(m_flow_mutex);
+
+        if (m_dev != nullptr)
+            return;
+
+        if (!m_usbio.Open(m_params.serial, &getErrorCallBack()))
+            errmsg = m_usbio.ErrorString();
+        else
+        {
+            m_usbio.startEventThread(m_params.usbEventPriority,
+                                     m_params.usbEventCPU);
+
+            if (!create_dev(errmsg))
+                m_usbio.Close();
+            else
+            {
+                m_ready = true;
+                m_buffer.Wake();
+                return;
+            }
+        }
+    }
+
+    // Fatal() stops the encoder, which takes m_flow_mutex.
+    Fatal(errmsg);
+}
+
+/*
+ * Called by USBWrapper_t from whatever thread saw the failure, which
+ * may be the libusb event thread, so just flag it for Wait().  Even
+ * giving up has to wait: Fatal() stops the encoder, which needs that
+ * thread.
+ */
+void MythTV::USBError(void)
+{
+    // Errors while tearing down or recovering are expected.
+    if (!m_run || m_fatal || m_recovering)
         return;
+
+    if (!m_recover_pending.exchange(true))
+    {
+        if (m_params.usbRecoverAttempts > 0)
+            WARNLOG << "Detected Error with USB, scheduling recovery.";
+        m_run_cond.notify_all();
     }
+}
 
-    if (!m_dev->Open(m_usbio, (m_params.audioCodec == HAPI_AUDIO_CODEC_AC3),
-                     &getWriteCallBack()))
+/*
+ * One recovery attempt: stop the encoder, reset (and if need be
+ * re-open) the USB device and bring the Hauppauge device back up with
+ * the same Parameters.  HauppaugeDev::Open only reloads the FX2
+ * firmware if the device is not already running at high speed.
+ */
+bool MythTV::recover_dev(string & errmsg)
+{
+    std::lock_guard<std::timed_mutex> lock(m_flow_mutex);
+
+    m_ready = false;
+    m_streaming = false;
+    m_buffer.Wake();
+
+    if (m_dev)
     {
-        Fatal(m_dev->ErrorString());
+        m_dev->StopEncoding();
         delete m_dev;
         m_dev = nullptr;
+    }
 
-        m_usbio.Close();
+    if (!m_usbio.Reset())
+    {
+        errmsg = m_usbio.ErrorString();
+        return false;
+    }
+
+    if (!create_dev(errmsg))
+        return false;
+
+    m_ready = true;
+    return true;
+}
+
+void MythTV::Recover(void)
+{
+    auto start = std::chrono::steady_clock::now();
+    string errmsg;
+    int    attempt;
+
+    m_recovering = true;
+
+    for (attempt = 1; attempt <= m_params.usbRecoverAttempts; ++attempt)
+    {
+        m_recover_pending = false;
+        if (!m_run)
+            break;
+
+        WARNLOG << "USB recovery attempt " << attempt << " of "
+                << m_params.usbRecoverAttempts;
+
+        if (recover_dev(errmsg) &&
+            (!m_want_streaming || start_encoding(errmsg)))
+            break;
+
+        ERRORLOG << "USB recovery attempt " << attempt << " failed: "
+                 << errmsg;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500 * attempt));
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+                   (std::chrono::steady_clock::now() - start);
+    m_recovered_at = std::chrono::system_clock::now();
+    m_recover_pending = false;
+    m_recovering = false;
+
+    if (!m_run)
+        return;
 
+    if (attempt > m_params.usbRecoverAttempts)
+    {
+        Fatal("Unable to recover from USB error after " +
+              std::to_string(elapsed.count()) + "ms.");
         return;
     }
 
-    m_ready = true;
-    m_flow_cond.notify_all();
+    ++m_recoveries;
+    WARNLOG << "Recovered from USB error in " << elapsed.count()
+            << "ms (" << attempt << (attempt == 1 ? " attempt" : " attempts")
+            << ", " << m_recoveries << " this session)"
+            << (m_want_streaming ? ", encoding resumed." : ".");
 }
 
 void MythTV::Fatal(const string & msg)
@@ -156,13 +322,33 @@ void MythTV::Fatal(const string & msg)
 
 bool MythTV::StartEncoding(string & resultmsg)
 {
+    m_want_streaming = true;
+    if (m_recovering)
+    {
+        // Recover() will start it once the device is back.
+        resultmsg.clear();
+        INFOLOG << "USB recovery in progress, encoding will resume after.";
+        return true;
+    }
+
+    return start_encoding(resultmsg);
+}
+
+/*
+ * m_flow_mutex is held across the device calls so recover_dev() can't
+ * delete m_dev out from under us.
+ */
+bool MythTV::start_encoding(string & resultmsg)
+{
+    std::lock_guard<std::timed_mutex> lock(m_flow_mutex);
+
     if (m_streaming)
     {
         resultmsg = "Already streaming!";
         WARNLOG << resultmsg;
         return true;
     }
-    if (!m_ready)
+    if (!m_ready || !m_dev)
     {
         resultmsg = "Hauppauge device not ready.";
         CRITLOG << resultmsg;
@@ -177,12 +363,16 @@ bool MythTV::StartEncoding(string & resultmsg)
 
     resultmsg.clear();
     m_streaming = true;
-    m_flow_cond.notify_all();
+    m_buffer.Wake();
     return true;
 }
 
 bool MythTV::StopEncoding(string & resultmsg, bool soft)
 {
+    m_want_streaming = false;
+
+    std::lock_guard<std::timed_mutex> lock(m_flow_mutex);
+
     if (!m_streaming)
     {
         if (!soft)
@@ -199,18 +389,15 @@ bool MythTV::StopEncoding(string & resultmsg, bool soft)
         return false;
     }
 
-    m_flow_mutex.lock();
     if (!m_dev)
     {
         resultmsg = "Invalid Hauppauge device.";
         CRITLOG << resultmsg;
-        m_flow_mutex.unlock();
         return false;
     }
-    m_flow_mutex.unlock();
 
     m_streaming = false;
-    m_flow_cond.notify_all();
+    m_buffer.Wake();
 
     INFOLOG << "Stopping encoder.";
     if (!m_dev->StopEncoding())
@@ -330,6 +517,14 @@ bool Commands::process_command(const string & cmd)
         send_status(cmd, serial, "OK:No");
         return true;
     }
+    if (starts_with(tokens[0], "TSHealth?"))
+    {
+        send_status(cmd, serial, "OK:" +
+                    m_parent->m_buffer.Health(m_health) +
+                    " usb_recoveries=" +
+                    std::to_string(m_parent->m_recoveries));
+        return true;
+    }
     if (starts_with(tokens[0], "HasPictureAttributes?"))
     {
         send_status(cmd, serial, "OK:No");
@@ -346,7 +541,7 @@ bool Commands::process_command(const string & cmd)
         // Used when FlowControl is XON/XOFF
         send_status(cmd, serial, "OK");
         m_parent->m_xon = true;
-        m_parent->m_flow_cond.notify_all();
+        m_parent->m_buffer.Wake();
         return true;
     }
     if (starts_with(tokens[0], "XOFF"))
@@ -354,7 +549,7 @@ bool Commands::process_command(const string & cmd)
         send_status(cmd, serial, "OK");
         // Used when FlowControl is XON/XOFF
         m_parent->m_xon = false;
-        m_parent->m_flow_cond.notify_all();
+        m_parent->m_buffer.Wake();
         return true;
     }
     if (starts_with(tokens[0], "IsOpen?"))
@@ -496,138 +691,3 @@ void Commands::Run(void)
 
     DEBUGLOG << "Command parser: shutting down";
 }
-
-Buffer::Buffer(MythTV * parent)
-    : m_thread()
-    , m_parent(parent)
-    , m_run(true)
-    , m_cb(std::bind(&Buffer::Fill, this, std::placeholders::_1,
-                     std::placeholders::_2))
-{
-    m_heartbeat = std::chrono::system_clock::now();
-}
-
-void Buffer::Fill(void * data, size_t len)
-{
-    if (len < 1)
-        return;
-
-    static int dropped = 0;
-
-    if (m_parent->m_flow_mutex.try_lock_for(std::chrono::seconds(2)))
-    {
-        if (m_data.size() < MAX_QUEUE)
-        {
-            block_t blk(reinterpret_cast<uint8_t *>(data),
-                        reinterpret_cast<uint8_t *>(data) + len);
-
-            m_data.push(blk);
-            dropped = 0;
-        }
-        else if (++dropped % 25 == 0)
-        {
-            WARNLOG << "Packet queue overrun.  Dropped " << dropped
-                    << "packets.";
-        }
-
-        m_parent->m_flow_mutex.unlock();
-        m_parent->m_flow_cond.notify_all();
-    }
-    else
-        WARNLOG << "Fill: Timed out on flow lock.";
-
-    m_heartbeat = std::chrono::system_clock::now();
-}
-
-void Buffer::Run(void)
-{
-    bool       is_empty = false;
-    bool       wait = false;
-    time_t     send_time = time (NULL) + (60 * 5);
-    uint64_t   write_total = 0;
-    uint64_t   written = 0;
-    uint64_t   write_cnt = 0;
-    uint64_t   empty_cnt = 0;
-    std::mutex tmp; // This is the only consumer, so can use local
-
-    DEBUGLOG << "Buffer: Ready for data.";
-
-    while (m_parent->m_run)
-    {
-        if (wait)
-        {
-            std::unique_lock<std::mutex> lk(tmp);
-            m_parent->m_flow_cond.wait_for(lk, std::chrono::seconds(1));
-            wait = false;
-        }
-
-        if (send_time < static_cast<double>(time (NULL)))
-        {
-            // Every 5 minutes, write out some statistics.
-            send_time = time (NULL) + (60 * 5);
-            write_total += written;
-            if (m_parent->m_streaming)
-                INFOLOG << "Count: " << write_cnt
-                        << ", Empty cnt: " << empty_cnt
-                        << ", Written: " << written
-                        << ", Total: " << write_total;
-            else
-                INFOLOG << "Not streaming.";
-
-            write_cnt = empty_cnt = written = 0;
-        }
-
-        if (m_parent->m_streaming)
-        {
-            if (m_parent->m_xon)
-            {
-                block_t pkt;
-
-                if (m_parent->m_flow_mutex.try_lock_for(std::chrono::seconds(1)))
-                {
-                    if (!m_data.empty())
-                    {
-                        pkt = m_data.front();
-                        m_data.pop();
-                        is_empty = m_data.empty();
-                    }
-                    m_parent->m_flow_mutex.unlock();
-                }
-
-                if (!pkt.empty())
-                {
-                    write(1, pkt.data(), pkt.size());
-                    written += pkt.size();
-                    ++write_cnt;
-                }
-
-                if (is_empty)
-                {
-                    wait = true;
-                    ++empty_cnt;
-                }
-            }
-            else
-                wait = true;
-        }
-        else
-        {
-            // Clear packet queue
-            if (m_parent->m_flow_mutex.try_lock_for(std::chrono::seconds(1)))
-            {
-                if (!m_data.empty())
-                {
-                    stack_t dummy;
-                    std::swap(m_data, dummy);
-                }
-                m_parent->m_flow_mutex.unlock();
-            }
-
-            wait = true;
-        }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(25));
-    }
-
-    DEBUGLOG << "Buffer: shutting down";
-}
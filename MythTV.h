@@ -23,62 +23,18 @@
 
 #include "Common.h"
 #include "HauppaugeDev.h"
+#include "Buffer.h"
 #include "USBif.h"
 
 #include <atomic>
 #include <string>
 #include <vector>
-#include <queue>
 #include <condition_variable>
 #include <thread>
 #include <mutex>
 
 class MythTV;
 
-class Buffer
-{
-  public:
-    enum constants {MAX_QUEUE = 500};
-
-    Buffer(MythTV * parent);
-    ~Buffer(void) {
-        m_run = false;
-        if(m_thread.joinable()) m_thread.join();
-    }
-    void Start(void) {
-        m_thread = std::thread(&Buffer::Run, this);
-    }
-    void Join(void) {
-        if (m_thread.joinable())
-            m_thread.join();
-    }
-    void SetBlockSize(uint32_t sz) { m_block_size = sz; }
-    void Fill(void * data, size_t len);
-
-    DataTransfer::callback_t & getWriteCallBack(void) { return m_cb; }
-    std::chrono::time_point<std::chrono::system_clock> HeartBeat(void) const
-    { return m_heartbeat; }
-
-  protected:
-    void Run(void);
-
-  private:
-    std::thread m_thread;
-    MythTV     *m_parent;
-    std::atomic_bool m_run;
-
-    DataTransfer::callback_t m_cb;
-
-    uint32_t m_block_size;
-
-    using block_t = std::vector<uint8_t>;
-    using stack_t = std::queue<block_t>;
-
-    stack_t  m_data;
-
-    std::chrono::time_point<std::chrono::system_clock> m_heartbeat;
-};
-
 class Commands
 {
   public:
@@ -110,11 +66,12 @@ class Commands
 
     MythTV* m_parent;
     int     m_api_version;
+
+    TSMonitor::Window m_health;
 };
 
 class MythTV
 {
-    friend class Buffer;
     friend class Commands;
 
   public:
@@ -136,9 +93,14 @@ class MythTV
     bool StartEncoding(std::string & resultmsg);
     bool StopEncoding(std::string & resultmsg, bool soft = false);
 
-    void USBError(void) { Fatal("Detected Error with USB."); }
+    void USBError(void);
 
   protected:
+    bool create_dev(std::string & errmsg);
+    bool start_encoding(std::string & resultmsg);
+    bool recover_dev(std::string & errmsg);
+    void Recover(void);
+
     std::string  m_desc;
 
     uint32_t     m_buffer_max;
@@ -158,11 +120,17 @@ class MythTV
     bool         m_fatal;
 
     std::timed_mutex        m_flow_mutex;
-    std::condition_variable m_flow_cond;
     std::atomic<bool> m_streaming;
     std::atomic<bool> m_xon;
     std::atomic<bool> m_ready;
 
+    // USB error recovery.  USBError() only flags it, Wait() runs it.
+    std::atomic<bool> m_recover_pending;
+    std::atomic<bool> m_recovering;
+    std::atomic<bool> m_want_streaming;
+    std::atomic<uint32_t> m_recoveries;
+    std::chrono::time_point<std::chrono::system_clock> m_recovered_at;
+
     USBWrapper_t::callback_t m_error_cb;
 };
 
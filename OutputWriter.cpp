@@ -0,0 +1,66 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "OutputWriter.h"
+#include "URingWriter.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <sys/uio.h>
+
+using namespace std;
+
+OutputWriter *OutputWriter::Create(int fd, bool uring, int depth,
+                                   int event_fd, void *buf, size_t buf_len)
+{
+    if (uring)
+    {
+        URingWriter *writer = new URingWriter;
+        if (writer->Open(fd, depth, event_fd, buf, buf_len))
+            return writer;
+        delete writer;
+        WARNLOG << "io_uring unavailable, using blocking writes.";
+    }
+    return new SyncWriter(fd);
+}
+
+bool SyncWriter::Submit(const struct iovec *iov, int cnt, int64_t offset,
+                        uint64_t tag)
+{
+    if (!m_done.empty())
+        return false;
+
+    ssize_t len = (offset < 0) ? writev(m_fd, iov, cnt)
+                               : pwritev(m_fd, iov, cnt, offset);
+    m_done.push_back(WriteCompletion{tag, len < 0 ? -errno : len});
+    return true;
+}
+
+int SyncWriter::Completed(WriteCompletion *done, int max, bool wait)
+{
+    int cnt = 0;
+    while (cnt < max && !m_done.empty())
+    {
+        done[cnt++] = m_done.front();
+        m_done.pop_front();
+    }
+    return cnt;
+}
@@ -0,0 +1,103 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _OutputWriter_H_
+#define _OutputWriter_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <sys/types.h>
+
+struct iovec;
+
+struct WriteCompletion
+{
+    uint64_t tag;       // As given to Submit()
+    ssize_t  result;    // Bytes written, or -errno
+};
+
+/*
+ * Queue writes and collect their results later, so the caller can be
+ * written against asynchronous I/O and still run on plain write().
+ *
+ * Writes to the same fd are only ordered by their offsets; for a pipe
+ * keep at most one in flight.
+ */
+class OutputWriter
+{
+  public:
+    virtual ~OutputWriter(void) {}
+
+    /*
+     * Queue a write of `iov' at `offset', or at the current position
+     * if offset is negative.  The iovec array is copied; the data it
+     * points at must stay put until the completion is reaped.  False
+     * if Depth() writes are already in flight.
+     */
+    virtual bool Submit(const struct iovec *iov, int cnt, int64_t offset,
+                        uint64_t tag) = 0;
+    // Up to `max' finished writes; with `wait', at least one if any
+    // are in flight.
+    virtual int  Completed(WriteCompletion *done, int max, bool wait) = 0;
+
+    // Ask for writes in flight to be abandoned; they still complete,
+    // with -ECANCELED, and must still be reaped.
+    virtual void Cancel(void) {}
+
+    virtual int  InFlight(void) const = 0;
+    virtual int  Depth(void) const = 0;
+    virtual const char *Name(void) const = 0;
+
+    /*
+     * io_uring if `uring' is set and the kernel allows it, otherwise
+     * blocking writes.  With io_uring, fd is registered as a fixed
+     * file, `event_fd' (if >= 0) is signalled on each completion and
+     * [buf, buf + buf_len) is registered for fixed buffer writes.
+     */
+    static OutputWriter *Create(int fd, bool uring, int depth,
+                                int event_fd = -1, void *buf = nullptr,
+                                size_t buf_len = 0);
+};
+
+/*
+ * The write happens, blocking, inside Submit(); Completed() just hands
+ * back the result.
+ */
+class SyncWriter : public OutputWriter
+{
+  public:
+    explicit SyncWriter(int fd) : m_fd(fd) {}
+
+    bool Submit(const struct iovec *iov, int cnt, int64_t offset,
+                uint64_t tag) override;
+    int  Completed(WriteCompletion *done, int max, bool wait) override;
+
+    int  InFlight(void) const override { return m_done.size(); }
+    int  Depth(void) const override { return 1; }
+    const char *Name(void) const override { return "write"; }
+
+  private:
+    int m_fd;
+    std::deque<WriteCompletion> m_done;
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PIDFilter.h"
+
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+
+PIDFilter::PIDFilter(const PSITracker & psi)
+    : m_psi(psi)
+    , m_strip_null(false)
+    , m_use_allow(false)
+    , m_null_bytes(0)
+    , m_pid_bytes(0)
+{
+}
+
+void PIDFilter::SetAllowed(const vector<uint16_t> & pids)
+{
+    m_allow.reset();
+    for (uint16_t pid : pids)
+        m_allow.set(pid);
+    m_use_allow = !pids.empty();
+}
+
+bool PIDFilter::Parse(const string & list, vector<uint16_t> & pids,
+                      string & errmsg)
+{
+    vector<string> tokens;
+    boost::split(tokens, list, boost::is_any_of(", "),
+                 boost::token_compress_on);
+
+    pids.clear();
+    for (const string & tok : tokens)
+    {
+        if (tok.empty())
+            continue;
+        size_t        pos = 0;
+        unsigned long pid = 0;
+        try
+        {
+            // Base 0 would read "0100" as octal.
+            pid = stoul(tok, &pos, boost::istarts_with(tok, "0x") ? 16 : 10);
+        }
+        catch (std::exception &)
+        {
+            pos = 0;
+        }
+        if (pos != tok.size() || pid >= PID_COUNT)
+        {
+            errmsg = "Invalid PID '" + tok + "' in '" + list + "'";
+            return false;
+        }
+        pids.push_back(static_cast<uint16_t>(pid));
+    }
+    return true;
+}
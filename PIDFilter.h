@@ -0,0 +1,90 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PIDFilter_H_
+#define _PIDFilter_H_
+
+#include "PSITracker.h"
+
+#include <bitset>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Drops null packets and, when an allow-list is given, every PID not
+ * on it.  The PAT, the PMT and the PCR PID are always kept, and
+ * packets are never modified, so PCR and PTS values stay as they were.
+ *
+ * Expects whole, aligned TS packets, already seen by `psi'.  Not
+ * thread safe; it lives on the producer side of Buffer.
+ */
+class PIDFilter
+{
+  public:
+    enum constants { TS_PACKET = 188, NULL_PID = 0x1FFF, PID_COUNT = 0x2000 };
+
+    explicit PIDFilter(const PSITracker & psi);
+
+    void SetStripNull(bool on) { m_strip_null = on; }
+    void SetAllowed(const std::vector<uint16_t> & pids);
+    bool Active(void) const { return m_strip_null || m_use_allow; }
+
+    // True if the packet should be kept.
+    bool Keep(const uint8_t *pkt)
+    {
+        uint16_t pid = PSITracker::PID(pkt);
+        if (pid == NULL_PID)
+        {
+            if (!m_strip_null)
+                return true;
+            m_null_bytes += TS_PACKET;
+            return false;
+        }
+        if (!m_use_allow || m_allow[pid] || pid == 0 ||
+            pid == m_psi.PMTPID() || pid == m_psi.PCRPID())
+            return true;
+        m_pid_bytes += TS_PACKET;
+        return false;
+    }
+
+    uint64_t NullBytes(void) const { return m_null_bytes; }
+    uint64_t PIDBytes(void) const { return m_pid_bytes; }
+
+    /*
+     * Parse a comma separated list of PIDs, decimal or 0x hex.  On
+     * error returns false with a message in errmsg.
+     */
+    static bool Parse(const std::string & list, std::vector<uint16_t> & pids,
+                      std::string & errmsg);
+
+  private:
+    const PSITracker & m_psi;
+    bool     m_strip_null;
+    bool     m_use_allow;
+    std::bitset<PID_COUNT> m_allow;
+
+    uint64_t m_null_bytes;
+    uint64_t m_pid_bytes;
+};
+
+#endif
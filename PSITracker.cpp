@@ -0,0 +1,110 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PSITracker.h"
+#include "Logger.h"
+
+void PSITracker::Reset(void)
+{
+    m_pmt_pid    = PID_NONE;
+    m_pcr_pid    = PID_NONE;
+    m_video_pid  = PID_NONE;
+    m_video_type = 0;
+}
+
+const uint8_t *PSITracker::Section(const uint8_t *pkt, size_t & len)
+{
+    if (!PUSI(pkt))
+        return nullptr;
+    size_t off = PayloadOffset(pkt);
+    if (off >= TS_PACKET)
+        return nullptr;
+    off += 1 + pkt[off];                // pointer_field
+    if (off + 3 > TS_PACKET)
+        return nullptr;
+
+    const uint8_t *sec = pkt + off;
+    len = ((sec[1] & 0x0F) << 8) | sec[2];
+    if (off + 3 + len > TS_PACKET || len < 9)
+        return nullptr;
+    return sec;
+}
+
+void PSITracker::ParsePAT(const uint8_t *pkt)
+{
+    size_t len;
+    const uint8_t *sec = Section(pkt, len);
+    if (sec == nullptr || sec[0] != 0x00)
+        return;
+
+    // Program loop runs from byte 8 to the CRC.
+    const uint8_t *end = sec + 3 + len - 4;
+    for (const uint8_t *p = sec + 8; p + 4 <= end; p += 4)
+    {
+        uint16_t program = (p[0] << 8) | p[1];
+        if (program == 0)
+            continue;                   // Network PID
+        uint16_t pid = ((p[2] & 0x1F) << 8) | p[3];
+        if (pid != m_pmt_pid)
+        {
+            DEBUGLOG << "PSI: PMT on PID " << pid;
+            m_pmt_pid   = pid;
+            m_pcr_pid   = PID_NONE;
+            m_video_pid = PID_NONE;
+        }
+        return;
+    }
+}
+
+void PSITracker::ParsePMT(const uint8_t *pkt)
+{
+    size_t len;
+    const uint8_t *sec = Section(pkt, len);
+    if (sec == nullptr || sec[0] != 0x02 || len < 13)
+        return;
+
+    uint16_t pcr_pid = ((sec[8] & 0x1F) << 8) | sec[9];
+    if (pcr_pid != m_pcr_pid)
+    {
+        DEBUGLOG << "PSI: PCR on PID " << pcr_pid;
+        m_pcr_pid = pcr_pid;
+    }
+
+    const uint8_t *end = sec + 3 + len - 4;
+    size_t info_len = ((sec[10] & 0x0F) << 8) | sec[11];
+    for (const uint8_t *p = sec + 12 + info_len; p + 5 <= end; )
+    {
+        uint8_t  type = p[0];
+        uint16_t pid  = ((p[1] & 0x1F) << 8) | p[2];
+        if (type == MPEG2_VIDEO || type == H264_VIDEO || type == HEVC_VIDEO)
+        {
+            if (pid != m_video_pid)
+            {
+                DEBUGLOG << "PSI: video (type " << int(type)
+                         << ") on PID " << pid;
+                m_video_pid  = pid;
+                m_video_type = type;
+            }
+            return;
+        }
+        p += 5 + (((p[3] & 0x0F) << 8) | p[4]);
+    }
+}
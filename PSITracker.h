@@ -0,0 +1,88 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PSITracker_H_
+#define _PSITracker_H_
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Follows the PAT and the PMT of the first program, just far enough to
+ * know which PIDs carry the PMT, the PCR and the video.  Sections are
+ * assumed to start, and fit, in one packet, which holds for the
+ * single-program streams the encoder produces.
+ */
+class PSITracker
+{
+  public:
+    enum constants { TS_PACKET = 188, PID_NONE = 0x2000 };
+    enum stream_types { MPEG2_VIDEO = 0x02, H264_VIDEO = 0x1B,
+                        HEVC_VIDEO = 0x24 };
+
+    PSITracker(void) { Reset(); }
+
+    // Call for every packet; true if it was the PAT or PMT.
+    bool Update(const uint8_t *pkt)
+    {
+        uint16_t pid = PID(pkt);
+        if (pid == 0)
+            ParsePAT(pkt);
+        else if (pid == m_pmt_pid)
+            ParsePMT(pkt);
+        else
+            return false;
+        return true;
+    }
+    void Reset(void);
+
+    uint16_t PMTPID(void) const { return m_pmt_pid; }
+    uint16_t PCRPID(void) const { return m_pcr_pid; }
+    uint16_t VideoPID(void) const { return m_video_pid; }
+    uint8_t  VideoType(void) const { return m_video_type; }
+
+    static uint16_t PID(const uint8_t *pkt)
+    { return ((pkt[1] & 0x1F) << 8) | pkt[2]; }
+    static bool PUSI(const uint8_t *pkt) { return pkt[1] & 0x40; }
+    // Offset of the payload, or TS_PACKET if there is none.
+    static size_t PayloadOffset(const uint8_t *pkt)
+    {
+        uint8_t afc = (pkt[3] >> 4) & 0x3;
+        if (!(afc & 0x1))
+            return TS_PACKET;
+        if (afc == 0x3)
+            return 5 + pkt[4];
+        return 4;
+    }
+
+  private:
+    void ParsePAT(const uint8_t *pkt);
+    void ParsePMT(const uint8_t *pkt);
+    // Start of the section in a PSI packet, or nullptr.
+    static const uint8_t *Section(const uint8_t *pkt, size_t & len);
+
+    uint16_t m_pmt_pid;
+    uint16_t m_pcr_pid;
+    uint16_t m_video_pid;
+    uint8_t  m_video_type;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PipeSplicer.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+PipeSplicer::PipeSplicer(int fd)
+    : m_fd(fd)
+    , m_tee_fd(-1)
+    , m_flags(0)
+    , m_sent(0)
+    , m_read(0)
+    , m_staged(0)
+    , m_tee_bytes(0)
+    , m_tee_skipped(0)
+{
+    m_stage[0] = m_stage[1] = -1;
+}
+
+PipeSplicer::~PipeSplicer(void)
+{
+    if (m_tee_fd >= 0)
+        close(m_tee_fd);
+    if (m_stage[0] >= 0)
+        close(m_stage[0]);
+    if (m_stage[1] >= 0)
+        close(m_stage[1]);
+}
+
+bool PipeSplicer::Open(const string & tee_path)
+{
+    int size = fcntl(m_fd, F_GETPIPE_SZ);
+    if (size < 0)
+    {
+        ERRORLOG << "splice: output is not a pipe.";
+        return false;
+    }
+    if (tee_path.empty())
+    {
+        INFOLOG << "Output by vmsplice into a " << size << " byte pipe.";
+        return true;
+    }
+
+    /*
+     * O_RDWR: opening a FIFO for writing alone fails, or blocks, until
+     * it has a reader.  Whoever opens it later picks up from there.
+     */
+    m_tee_path = tee_path;
+    m_tee_fd = open(tee_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_tee_fd < 0)
+    {
+        ERRORLOG << "splice: unable to open '" << tee_path << "': "
+                 << strerror(errno);
+        return false;
+    }
+    if (fcntl(m_tee_fd, F_GETPIPE_SZ) < 0)
+    {
+        ERRORLOG << "splice: '" << tee_path << "' is not a FIFO.";
+        close(m_tee_fd);
+        m_tee_fd = -1;
+        return false;
+    }
+    // Non-blocking: a batch larger than the pipe must not wait for a
+    // reader that is this same thread.
+    if (pipe2(m_stage, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        ERRORLOG << "splice: unable to create pipe: " << strerror(errno);
+        close(m_tee_fd);
+        m_tee_fd = -1;
+        return false;
+    }
+    fcntl(m_stage[1], F_SETPIPE_SZ, size);
+    fcntl(m_tee_fd, F_SETPIPE_SZ, size);
+
+    INFOLOG << "Output by splice into a " << size << " byte pipe, "
+            << "mirrored to '" << tee_path << "'.";
+    return true;
+}
+
+ssize_t PipeSplicer::Send(const struct iovec *iov, int cnt, bool copy)
+{
+    ssize_t len;
+
+    if (m_tee_fd < 0)
+    {
+        len = copy ? writev(m_fd, iov, cnt) : vmsplice(m_fd, iov, cnt, m_flags);
+        if (len < 0)
+            return -errno;
+        m_sent += len;
+        return len;
+    }
+
+    // The staging pipe has to be empty, so tee() sees only new data.
+    int err = Flush();
+    if (err < 0)
+        return err;
+
+    len = writev(m_stage[1], iov, cnt);
+    if (len <= 0)
+        return (len < 0) ? -errno : 0;
+
+    // Never let the mirror hold up the real reader.
+    ssize_t teed = tee(m_stage[0], m_tee_fd, len, SPLICE_F_NONBLOCK);
+    if (teed < 0)
+    {
+        if (errno != EAGAIN)
+            WARNLOG << "splice: tee to '" << m_tee_path << "' failed: "
+                    << strerror(errno);
+        teed = 0;
+    }
+    m_tee_bytes   += teed;
+    m_tee_skipped += len - teed;
+
+    // Taken, even if the output can't have all of it just yet.
+    m_staged = len;
+    err = Flush();
+    if (err < 0 && err != -EAGAIN)
+        return err;
+    return len;
+}
+
+int PipeSplicer::Flush(void)
+{
+    while (m_staged > 0)
+    {
+        ssize_t moved = splice(m_stage[0], nullptr, m_fd, nullptr, m_staged,
+                               SPLICE_F_MOVE | m_flags);
+        if (moved < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            if (err != EAGAIN)
+            {
+                Discard(m_staged);
+                m_staged = 0;
+            }
+            return -err;
+        }
+        m_sent   += moved;
+        m_staged -= moved;
+    }
+    return 0;
+}
+
+void PipeSplicer::Poll(void)
+{
+    int queued = 0;
+    if (ioctl(m_fd, FIONREAD, &queued) == 0)
+        m_read = m_sent - queued;
+}
+
+// Empty the staging pipe after the output failed.
+void PipeSplicer::Discard(size_t len)
+{
+    char buf[4096];
+
+    while (len > 0)
+    {
+        ssize_t got = read(m_stage[0], buf,
+                           len < sizeof(buf) ? len : sizeof(buf));
+        if (got <= 0)
+            break;
+        len -= got;
+    }
+}
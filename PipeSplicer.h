@@ -0,0 +1,102 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PipeSplicer_H_
+#define _PipeSplicer_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <sys/types.h>
+
+struct iovec;
+
+/*
+ * Puts data into the output pipe without write() copying it.
+ *
+ * On its own, vmsplice() hands the pipe references to the caller's
+ * pages.  The reader copies straight out of them, so they must not
+ * change until it has read past them; see Sent() and Drained().
+ *
+ * With a mirror FIFO, data is copied once into a private staging pipe.
+ * tee() then duplicates it into the FIFO and splice() moves it on to
+ * the output, so the second reader costs no further copy.  The mirror
+ * gets data only as far as it keeps up.  Pages there belong to the
+ * kernel, so nothing is held back on the mirror reader's behalf.
+ */
+class PipeSplicer
+{
+  public:
+    explicit PipeSplicer(int fd);
+    ~PipeSplicer(void);
+
+    // False if fd is not a pipe, or `tee_path' can't be opened.
+    bool Open(const std::string & tee_path);
+
+    /*
+     * Send iov down the pipe, copying it if `copy' or if there is a
+     * mirror.  Returns the bytes sent, or -errno.
+     */
+    ssize_t Send(const struct iovec *iov, int cnt, bool copy);
+
+    /*
+     * With a mirror, data Send() took but a non-blocking output did
+     * not, and passing it on.  Flush() returns 0 once nothing is left,
+     * else -errno; on a hard error what was left is dropped.
+     */
+    size_t Staged(void) const { return m_staged; }
+    int    Flush(void);
+
+    // Match an output that was made non-blocking.
+    void SetNonBlocking(bool on) { m_flags = on ? SPLICE_F_NONBLOCK : 0; }
+
+    // Whether Send() leaves pages referenced from the pipe.
+    bool ByReference(void) const { return m_tee_fd < 0; }
+
+    // Bytes sent so far; once Drained() is true for that position,
+    // everything before it has been read.
+    uint64_t Sent(void) const { return m_sent; }
+    // Look at how far the reader has got; call before Drained().
+    void Poll(void);
+    bool Drained(uint64_t pos) const { return pos <= m_read; }
+
+    uint64_t TeeBytes(void) const { return m_tee_bytes; }
+    uint64_t TeeSkipped(void) const { return m_tee_skipped; }
+
+  private:
+    void Discard(size_t len);
+
+    int         m_fd;
+    int         m_stage[2];
+    int         m_tee_fd;
+    unsigned    m_flags;
+    std::string m_tee_path;
+
+    uint64_t    m_sent;
+    uint64_t    m_read;
+    size_t      m_staged;
+
+    std::atomic<uint64_t> m_tee_bytes;
+    std::atomic<uint64_t> m_tee_skipped;
+};
+
+#endif
@@ -0,0 +1,743 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Sink.h"
+#include "Logger.h"
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <fcntl.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+Sink *Sink::Create(const string & type, const string & target,
+                   const vector<string> & options, string & errmsg)
+{
+    if (type == "udp" || type == "rtp")
+    {
+        unique_ptr<UDPSink> sink(new UDPSink(target, type == "rtp"));
+        for (const string & opt : options)
+        {
+            size_t eq = opt.find('=');
+            if (eq == string::npos ||
+                !sink->SetOption(opt.substr(0, eq), opt.substr(eq + 1),
+                                 errmsg))
+            {
+                if (errmsg.empty())
+                    errmsg = "Invalid option '" + opt + "' for " + type;
+                return nullptr;
+            }
+        }
+        return sink.release();
+    }
+
+    if (type != "file" && type != "fifo")
+    {
+        errmsg = "Unknown sink type '" + type + "'";
+        return nullptr;
+    }
+    if (!options.empty())
+    {
+        errmsg = "Invalid option '" + options[0] + "' for " + type;
+        return nullptr;
+    }
+    if (type == "file")
+        return new FileSink(target);
+    return new FifoSink(target);
+}
+
+FileSink::FileSink(const string & path)
+    : Sink("file:" + path)
+    , m_path(path)
+    , m_fd(-1)
+{
+}
+
+FileSink::~FileSink(void)
+{
+    Close();
+}
+
+bool FileSink::Open(void)
+{
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+    if (m_fd < 0)
+    {
+        ERRORLOG << "Unable to create '" << m_path << "': "
+                 << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void FileSink::Close(void)
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+bool FileSink::Write(const uint8_t * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t r = write(m_fd, data, len);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERRORLOG << "Write to '" << m_path << "' failed: "
+                     << strerror(errno);
+            return false;
+        }
+        data += r;
+        len  -= r;
+    }
+    return true;
+}
+
+FifoSink::FifoSink(const string & path)
+    : Sink("fifo:" + path)
+    , m_path(path)
+    , m_fd(-1)
+{
+}
+
+FifoSink::~FifoSink(void)
+{
+    Close();
+}
+
+bool FifoSink::Open(void)
+{
+    struct stat st;
+    if (stat(m_path.c_str(), &st) < 0 || !S_ISFIFO(st.st_mode))
+    {
+        ERRORLOG << "'" << m_path << "' is not a FIFO.";
+        return false;
+    }
+
+    // O_RDWR: see PipeSplicer::Open().
+    m_fd = open(m_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_fd < 0)
+    {
+        ERRORLOG << "Unable to open '" << m_path << "': " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void FifoSink::Close(void)
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+bool FifoSink::Write(const uint8_t * data, size_t len)
+{
+    auto idle = chrono::steady_clock::now();
+
+    while (len > 0)
+    {
+        ssize_t r = write(m_fd, data, len);
+        if (r > 0)
+        {
+            data += r;
+            len  -= r;
+            idle = chrono::steady_clock::now();
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno != EAGAIN)
+        {
+            ERRORLOG << "Write to '" << m_path << "' failed: "
+                     << strerror(errno);
+            return false;
+        }
+
+        if (m_stopping && chrono::steady_clock::now() - idle >
+            chrono::milliseconds(STOP_GRACE_MS))
+        {
+            WARNLOG << "'" << m_path << "': reader stalled at shutdown, "
+                    << len << " bytes not written.";
+            return false;
+        }
+
+        struct pollfd pfd = { m_fd, POLLOUT, 0 };
+        poll(&pfd, 1, POLL_MS);
+    }
+    return true;
+}
+
+
+UDPSink::UDPSink(const string & target, bool rtp)
+    : Sink(string(rtp ? "rtp:" : "udp:") + target)
+    , m_target(target)
+    , m_rtp(rtp)
+    , m_smooth_ms(DEFAULT_SMOOTH_MS)
+    , m_ttl(DEFAULT_TTL)
+    , m_fd(-1)
+    , m_head(0)
+    , m_published(0)
+    , m_closing(false)
+    , m_tail(0)
+    , m_fill(nullptr)
+    , m_packets(0)
+    , m_pcr_pid(-1)
+    , m_pcr_raw(0)
+    , m_pcr(0)
+    , m_pcr_packet(0)
+    , m_ticks_per_packet(0)
+    , m_anchor_pcr(0)
+    , m_no_pcr_logged(false)
+    , m_rtp_seq(0)
+    , m_ssrc(0)
+    , m_broken(false)
+    , m_sent(0)
+    , m_send_errors(0)
+    , m_reanchors(0)
+{
+}
+
+UDPSink::~UDPSink(void)
+{
+    Close();
+}
+
+bool UDPSink::SetOption(const string & key, const string & value,
+                        string & errmsg)
+{
+    if (key == "iface")
+    {
+        m_iface = value;
+        return true;
+    }
+
+    int lo, hi;
+    if (key == "smooth")
+    {
+        lo = 0;
+        hi = MAX_SMOOTH_MS;
+    }
+    else if (key == "ttl")
+    {
+        lo = 1;
+        hi = 255;
+    }
+    else
+    {
+        errmsg = "Unknown option '" + key + "' for " + m_name;
+        return false;
+    }
+
+    size_t pos = 0;
+    long   val = 0;
+    try
+    {
+        val = stol(value, &pos);
+    }
+    catch (std::exception &)
+    {
+        pos = 0;
+    }
+    if (pos == 0 || pos != value.size() || val < lo || val > hi)
+    {
+        errmsg = key + " for " + m_name + " must be " + to_string(lo) +
+                 " to " + to_string(hi);
+        return false;
+    }
+
+    if (key == "smooth")
+        m_smooth_ms = val;
+    else
+        m_ttl = val;
+    return true;
+}
+
+bool UDPSink::Open(void)
+{
+    string host;
+    string port;
+    size_t colon = m_target.rfind(':');
+
+    if (colon == string::npos || colon + 1 == m_target.size())
+    {
+        ERRORLOG << m_name << " is not host:port.";
+        return false;
+    }
+    host = m_target.substr(0, colon);
+    port = m_target.substr(colon + 1);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    struct addrinfo hints = {};
+    struct addrinfo *res = nullptr;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0)
+    {
+        ERRORLOG << m_name << ": unable to resolve: " << gai_strerror(err);
+        return false;
+    }
+
+    // Multicast goes out by the routing table unless told otherwise.
+    int ifindex = 0;
+    if (!m_iface.empty() &&
+        (ifindex = if_nametoindex(m_iface.c_str())) == 0)
+    {
+        ERRORLOG << m_name << ": no interface '" << m_iface << "'.";
+        freeaddrinfo(res);
+        return false;
+    }
+
+    bool multicast = false;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next)
+    {
+        m_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                      ai->ai_protocol);
+        if (m_fd < 0)
+            continue;
+
+        // A ttl or interface that was asked for is not optional.
+        const char *failed = nullptr;
+        if (ai->ai_family == AF_INET)
+        {
+            auto *sin = reinterpret_cast<struct sockaddr_in *>(ai->ai_addr);
+            multicast = IN_MULTICAST(ntohl(sin->sin_addr.s_addr));
+            if (multicast)
+            {
+                struct ip_mreqn mreq = {};
+                mreq.imr_ifindex = ifindex;
+                if (setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                               &m_ttl, sizeof(m_ttl)) < 0)
+                    failed = "ttl";
+                else if (ifindex > 0 &&
+                         setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF,
+                                    &mreq, sizeof(mreq)) < 0)
+                    failed = "iface";
+            }
+        }
+        else if (ai->ai_family == AF_INET6)
+        {
+            auto *sin6 = reinterpret_cast<struct sockaddr_in6 *>
+                         (ai->ai_addr);
+            multicast = IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr);
+            if (multicast)
+            {
+                if (setsockopt(m_fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+                               &m_ttl, sizeof(m_ttl)) < 0)
+                    failed = "ttl";
+                else if (ifindex > 0 &&
+                         setsockopt(m_fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                    &ifindex, sizeof(ifindex)) < 0)
+                    failed = "iface";
+            }
+        }
+        if (failed)
+        {
+            ERRORLOG << m_name << ": unable to set multicast " << failed
+                     << ": " << strerror(errno);
+            close(m_fd);
+            m_fd = -1;
+            freeaddrinfo(res);
+            return false;
+        }
+
+        if (connect(m_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(m_fd);
+        m_fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (m_fd < 0)
+    {
+        ERRORLOG << m_name << ": unable to connect: " << strerror(errno);
+        return false;
+    }
+
+    // Room for twice the smoothing time at RING_MBPS.
+    size_t ms = 2 * m_smooth_ms + RING_EXTRA_MS;
+    m_ring.resize(ms * RING_MBPS * 125 / DATAGRAM);
+
+    random_device rd;
+    m_rtp_seq = rd();
+    m_ssrc    = rd();
+
+    m_sender = thread(&UDPSink::Run, this);
+
+    INFOLOG << m_name << ": " << (multicast ? "multicast" : "unicast")
+            << (m_rtp ? " RTP" : "") << ", "
+            << (m_smooth_ms ? "paced by PCR, " + to_string(m_smooth_ms) +
+                              "ms smoothing"
+                            : "not paced")
+            << ", " << m_ring.size() << " datagrams buffered at most.";
+    return true;
+}
+
+bool UDPSink::Write(const uint8_t * data, size_t len)
+{
+    while (len > 0)
+    {
+        if (m_broken || (m_fill == nullptr && !Reserve()))
+            return false;
+
+        // Fill up to the end of the current TS packet.
+        size_t take = TS_PACKET - m_fill->len % TS_PACKET;
+        if (take > len)
+            take = len;
+        memcpy(m_fill->data + RTP_HEADER + m_fill->len, data, take);
+        m_fill->len += take;
+        data += take;
+        len  -= take;
+        if (m_fill->len % TS_PACKET != 0)
+            continue;
+
+        Packet(m_fill->data + RTP_HEADER + m_fill->len - TS_PACKET);
+        if (m_fill->len == DATAGRAM)
+        {
+            ++m_tail;
+            m_fill = nullptr;
+        }
+    }
+
+    if (m_smooth_ms == 0 && m_published != m_tail)
+    {
+        Time(m_published, m_tail);
+        Publish();
+    }
+    return true;
+}
+
+/*
+ * Wait for a free slot and start filling it.  Datagrams still waiting
+ * for a PCR are sent off first if they take up half the ring: a stream
+ * without PCRs is not paced, but must not get stuck either.
+ */
+bool UDPSink::Reserve(void)
+{
+    if (m_tail - m_published >= m_ring.size() / 2)
+    {
+        if (m_pcr_pid < 0 && !m_no_pcr_logged)
+        {
+            WARNLOG << m_name << ": no PCR in the stream, not paced.";
+            m_no_pcr_logged = true;
+        }
+        Time(m_published, m_tail);
+        Publish();
+    }
+
+    unique_lock<mutex> lock(m_mutex);
+    steady::time_point since = steady::now();
+    while (m_tail - m_head >= m_ring.size())
+    {
+        if (m_broken || (m_stopping && steady::now() - since >
+                         chrono::milliseconds(STOP_GRACE_MS)))
+            return false;
+        m_room.wait_for(lock, chrono::milliseconds(POLL_MS));
+    }
+    lock.unlock();
+
+    m_fill = &m_ring[m_tail % m_ring.size()];
+    m_fill->len    = 0;
+    m_fill->packet = m_packets;
+    return true;
+}
+
+/*
+ * Look at a complete TS packet for a PCR.  A PCR times the datagrams
+ * since the previous one, by the rate between the two, and releases
+ * them to the sender.
+ */
+void UDPSink::Packet(const uint8_t * pkt)
+{
+    uint64_t packet = m_packets++;
+
+    if (m_smooth_ms == 0 || pkt[0] != 0x47 || !(pkt[3] & 0x20) ||
+        pkt[4] < 7 || !(pkt[5] & 0x10))
+        return;
+
+    int pid = ((pkt[1] & 0x1F) << 8) | pkt[2];
+    if (m_pcr_pid < 0)
+    {
+        m_pcr_pid = pid;
+        INFOLOG << m_name << ": pacing by the PCR on PID " << pid << ".";
+    }
+    else if (pid != m_pcr_pid)
+        return;
+
+    uint64_t base = (static_cast<uint64_t>(pkt[6]) << 25) |
+                    (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) |
+                    (pkt[10] >> 7);
+    uint64_t raw  = base * 300 + (((pkt[10] & 0x01) << 8) | pkt[11]);
+    steady::time_point now = steady::now();
+    chrono::milliseconds smooth(m_smooth_ms);
+
+    if (m_anchor_time == steady::time_point())
+    {
+        // Whatever came before goes out with the first PCR.
+        m_pcr_raw = raw;
+        m_pcr = raw;
+        m_pcr_packet = packet;
+        Anchor(m_pcr, now + smooth);
+        Time(m_published, m_tail);
+        Publish();
+        return;
+    }
+
+    // The PCR wraps after 2^33 90kHz ticks.
+    const int64_t wrap = (static_cast<int64_t>(1) << 33) * 300;
+    int64_t delta = static_cast<int64_t>(raw) -
+                    static_cast<int64_t>(m_pcr_raw);
+    if (delta > wrap / 2)
+        delta -= wrap;
+    else if (delta < -wrap / 2)
+        delta += wrap;
+    m_pcr_raw = raw;
+
+    if (delta <= 0 || delta > PCR_MAX_GAP || packet == m_pcr_packet)
+    {
+        // A discontinuity.  Finish off at the old rate, then carry on
+        // from this PCR, after what is already timed.
+        Time(m_published, m_tail);
+        m_pcr += delta;
+        m_pcr_packet = packet;
+        Anchor(m_pcr, max(now, m_last_due));
+        if (m_reanchors++ % 100 == 0)
+            WARNLOG << m_name << ": PCR discontinuity (" << m_reanchors
+                    << " re-timings).";
+        Publish();
+        return;
+    }
+
+    m_ticks_per_packet = static_cast<double>(delta) /
+                         (packet - m_pcr_packet);
+
+    /*
+     * Arrival is bursty, so this PCR may be due anywhere from now to
+     * twice the smoothing time from now.  Outside that the clocks
+     * have drifted apart, or the encoder stalled: start over.
+     */
+    steady::time_point due = Due(m_pcr + delta);
+    if (due < now || due > now + 2 * smooth)
+    {
+        Anchor(m_pcr + delta, now + smooth);
+        if (m_reanchors++ % 100 == 0)
+            WARNLOG << m_name << ": PCR out of step with the clock by "
+                    << chrono::duration_cast<chrono::milliseconds>
+                       (due - now - smooth).count()
+                    << "ms (" << m_reanchors << " re-timings).";
+    }
+
+    Time(m_published, m_tail);
+    m_pcr += delta;
+    m_pcr_packet = packet;
+    Publish();
+}
+
+void UDPSink::Anchor(int64_t pcr, steady::time_point when)
+{
+    m_anchor_pcr  = pcr;
+    m_anchor_time = when;
+}
+
+// Give the datagrams [from, to) their send time and RTP timestamp.
+void UDPSink::Time(size_t from, size_t to)
+{
+    steady::time_point now = steady::now();
+    bool paced = (m_smooth_ms > 0 && m_anchor_time != steady::time_point());
+
+    for (size_t idx = from; idx < to; ++idx)
+    {
+        Slot & slot = m_ring[idx % m_ring.size()];
+        if (paced)
+        {
+            int64_t pcr = m_pcr + static_cast<int64_t>
+                ((static_cast<int64_t>(slot.packet) -
+                  static_cast<int64_t>(m_pcr_packet)) * m_ticks_per_packet);
+            slot.due    = Due(pcr);
+            slot.rtp_ts = static_cast<uint32_t>(pcr / 300);
+        }
+        else
+        {
+            slot.due    = now;
+            slot.rtp_ts = static_cast<uint32_t>
+                (chrono::duration_cast<chrono::microseconds>
+                 (now.time_since_epoch()).count() * 9 / 100);
+        }
+        m_last_due = slot.due;
+    }
+}
+
+void UDPSink::Publish(void)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_published = m_tail;
+    }
+    m_ready.notify_one();
+}
+
+void UDPSink::Run(void)
+{
+    setThreadName("udp send");
+
+    unique_lock<mutex> lock(m_mutex);
+    for (;;)
+    {
+        if (m_head == m_published)
+        {
+            if (m_closing)
+                break;
+            m_ready.wait(lock);
+            continue;
+        }
+
+        // Send what is due, and what will be shortly, in one go.
+        steady::time_point ahead = steady::now() +
+                                   chrono::microseconds(SEND_AHEAD_US);
+        steady::time_point due = m_ring[m_head % m_ring.size()].due;
+        if (due > ahead)
+        {
+            m_ready.wait_until(lock, due);
+            continue;
+        }
+
+        size_t cnt = 1;
+        while (cnt < BATCH && m_head + cnt < m_published &&
+               m_ring[(m_head + cnt) % m_ring.size()].due <= ahead)
+            ++cnt;
+
+        lock.unlock();
+        Send(m_head, cnt);
+        lock.lock();
+        m_head += cnt;
+        m_room.notify_one();
+    }
+}
+
+void UDPSink::Send(size_t first, size_t cnt)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec   iov[BATCH];
+    size_t         skip = m_rtp ? 0 : RTP_HEADER;
+
+    for (size_t idx = 0; idx < cnt; ++idx)
+    {
+        Slot & slot = m_ring[(first + idx) % m_ring.size()];
+        if (m_rtp)
+        {
+            uint8_t *hdr = slot.data;
+            hdr[0]  = 0x80;                     // Version 2
+            hdr[1]  = RTP_PT_MP2T;
+            hdr[2]  = m_rtp_seq >> 8;
+            hdr[3]  = m_rtp_seq & 0xFF;
+            hdr[4]  = slot.rtp_ts >> 24;
+            hdr[5]  = slot.rtp_ts >> 16;
+            hdr[6]  = slot.rtp_ts >> 8;
+            hdr[7]  = slot.rtp_ts;
+            hdr[8]  = m_ssrc >> 24;
+            hdr[9]  = m_ssrc >> 16;
+            hdr[10] = m_ssrc >> 8;
+            hdr[11] = m_ssrc;
+            ++m_rtp_seq;
+        }
+        iov[idx].iov_base = slot.data + skip;
+        iov[idx].iov_len  = RTP_HEADER + slot.len - skip;
+        memset(&msgs[idx], 0, sizeof(msgs[idx]));
+        msgs[idx].msg_hdr.msg_iov    = &iov[idx];
+        msgs[idx].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t done = 0;
+    while (done < cnt && !m_broken)
+    {
+        int sent = sendmmsg(m_fd, msgs + done, cnt - done, 0);
+        if (sent > 0)
+        {
+            done   += sent;
+            m_sent += sent;
+            continue;
+        }
+
+        switch (errno)
+        {
+          case EINTR:
+            continue;
+          case ECONNREFUSED:    // Nobody listening, for now.
+          case ENOBUFS:
+          case EAGAIN:
+            if (m_send_errors++ % 1000 == 0)
+                WARNLOG << m_name << ": send failed: " << strerror(errno)
+                        << " (" << m_send_errors << " datagrams lost).";
+            ++done;
+            break;
+          default:
+            ERRORLOG << m_name << ": send failed: " << strerror(errno);
+            m_broken = true;
+            break;
+        }
+    }
+}
+
+void UDPSink::Close(void)
+{
+    if (m_sender.joinable())
+    {
+        // Let the sender finish, at its pace; a partial datagram goes
+        // out short.
+        if (m_fill != nullptr && m_fill->len > 0)
+            ++m_tail;
+        m_fill = nullptr;
+        Time(m_published, m_tail);
+        Publish();
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_closing = true;
+        }
+        m_ready.notify_one();
+        m_sender.join();
+    }
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+string UDPSink::Stats(void) const
+{
+    return "datagrams=" + to_string(m_sent) +
+           " send_errors=" + to_string(m_send_errors) +
+           " retimed=" + to_string(m_reanchors);
+}
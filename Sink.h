@@ -0,0 +1,219 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _Sink_H_
+#define _Sink_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * One extra destination for the stream; see FanOut.  Each sink is
+ * driven by a thread of its own, so Write() may block.
+ */
+class Sink
+{
+  public:
+    virtual ~Sink(void) {}
+
+    /*
+     * `type' is "file", "fifo", "udp" or "rtp"; `options' are its
+     * key=value settings.  Returns nullptr, with a message in errmsg,
+     * if either makes no sense.  Nothing is opened yet.
+     */
+    static Sink *Create(const std::string & type, const std::string & target,
+                        const std::vector<std::string> & options,
+                        std::string & errmsg);
+
+    virtual bool Open(void) = 0;
+    // False once the sink is broken for good.
+    virtual bool Write(const uint8_t * data, size_t len) = 0;
+    virtual void Close(void) = 0;
+    // Sink specific counters, for FanOut::Report().
+    virtual std::string Stats(void) const { return std::string(); }
+
+    // Stop waiting on a reader that is not coming back.
+    void Stop(void) { m_stopping = true; }
+
+    const std::string & Name(void) const { return m_name; }
+
+  protected:
+    explicit Sink(const std::string & name)
+        : m_name(name), m_stopping(false) {}
+
+    std::string      m_name;
+    std::atomic_bool m_stopping;
+};
+
+// A regular file, created or truncated.
+class FileSink : public Sink
+{
+  public:
+    explicit FileSink(const std::string & path);
+    ~FileSink(void);
+
+    bool Open(void);
+    bool Write(const uint8_t * data, size_t len);
+    void Close(void);
+
+  private:
+    std::string m_path;
+    int         m_fd;
+};
+
+/*
+ * An existing FIFO.  It is opened without waiting for a reader, and
+ * writes give up once Stop() was called and nothing more was taken
+ * for STOP_GRACE_MS.
+ */
+class FifoSink : public Sink
+{
+  public:
+    enum constants { POLL_MS = 100, STOP_GRACE_MS = 1000 };
+
+    explicit FifoSink(const std::string & path);
+    ~FifoSink(void);
+
+    bool Open(void);
+    bool Write(const uint8_t * data, size_t len);
+    void Close(void);
+
+  private:
+    std::string m_path;
+    int         m_fd;
+};
+
+/*
+ * Sends the stream over UDP, plain or as RTP (RFC 2250), to a unicast
+ * or multicast address: host:port, "[v6addr]:port" for IPv6.
+ * TS_PER_DATAGRAM packets go in each datagram, the usual size for TS
+ * over UDP.
+ *
+ * The encoder delivers in USB sized bursts, which overflow the receive
+ * buffers of small clients.  So datagrams wait in a ring, the
+ * smoothing buffer, and a thread of their own sends each at the time
+ * its PCR calls for: the arrival of a PCR times the datagrams since the
+ * previous one, by interpolation.  Everything is delayed by the
+ * smoothing time, which absorbs the bursts; sendmmsg() sends whatever
+ * is due together.  With a smoothing time of 0 datagrams go out as
+ * they come.
+ *
+ * Nothing is retried: a lost datagram is counted and the stream goes
+ * on.
+ */
+class UDPSink : public Sink
+{
+  public:
+    enum constants { TS_PACKET = 188, TS_PER_DATAGRAM = 7,
+                     DATAGRAM = TS_PACKET * TS_PER_DATAGRAM,
+                     RTP_HEADER = 12, RTP_PT_MP2T = 33,
+                     DEFAULT_SMOOTH_MS = 100, MAX_SMOOTH_MS = 2000,
+                     RING_MBPS = 50, RING_EXTRA_MS = 100, BATCH = 64,
+                     SEND_AHEAD_US = 1000, POLL_MS = 100,
+                     STOP_GRACE_MS = 1000, DEFAULT_TTL = 1,
+                     PCR_MAX_GAP = 27000000 };
+
+    UDPSink(const std::string & target, bool rtp);
+    ~UDPSink(void);
+
+    // smooth=MS (0 to send as received), or for multicast ttl=N and
+    // iface=NAME, the interface to send from.
+    bool SetOption(const std::string & key, const std::string & value,
+                   std::string & errmsg);
+
+    bool Open(void);
+    bool Write(const uint8_t * data, size_t len);
+    void Close(void);
+    std::string Stats(void) const;
+
+  private:
+    using steady = std::chrono::steady_clock;
+
+    struct Slot
+    {
+        uint8_t  data[RTP_HEADER + DATAGRAM];   // Header, if any, first
+        size_t   len;                           // TS bytes
+        uint64_t packet;        // Stream index of its first TS packet
+        steady::time_point due;
+        uint32_t rtp_ts;        // 90kHz
+    };
+
+    bool Reserve(void);
+    void Packet(const uint8_t * pkt);
+    void Time(size_t from, size_t to);
+    void Anchor(int64_t pcr, steady::time_point when);
+    steady::time_point Due(int64_t pcr) const
+    {
+        return m_anchor_time + std::chrono::nanoseconds
+            ((pcr - m_anchor_pcr) * 1000 / 27);
+    }
+    void Publish(void);
+    void Run(void);
+    void Send(size_t first, size_t cnt);
+
+    std::string        m_target;
+    bool               m_rtp;
+    int                m_smooth_ms;
+    int                m_ttl;
+    std::string        m_iface;
+    int                m_fd;
+
+    // Slots [m_head, m_published) belong to the sender thread, the
+    // rest to Write().  Indices only grow; the slot is index % size.
+    std::vector<Slot>       m_ring;
+    std::mutex              m_mutex;
+    std::condition_variable m_ready;        // Something to send
+    std::condition_variable m_room;         // A slot came free
+    size_t                  m_head;
+    size_t                  m_published;
+    bool                    m_closing;
+    std::thread             m_sender;
+
+    // Write() only.
+    size_t             m_tail;
+    Slot              *m_fill;
+    uint64_t           m_packets;
+    int                m_pcr_pid;
+    uint64_t           m_pcr_raw;
+    int64_t            m_pcr;               // Unwrapped, 27MHz
+    uint64_t           m_pcr_packet;
+    double             m_ticks_per_packet;  // Between the last two PCRs
+    int64_t            m_anchor_pcr;
+    steady::time_point m_anchor_time;
+    steady::time_point m_last_due;
+    bool               m_no_pcr_logged;
+
+    // Sender thread only.
+    uint16_t           m_rtp_seq;
+    uint32_t           m_ssrc;
+
+    std::atomic_bool      m_broken;
+    std::atomic<uint64_t> m_sent;
+    std::atomic<uint64_t> m_send_errors;
+    std::atomic<uint64_t> m_reanchors;
+};
+
+#endif
@@ -0,0 +1,159 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SpillFile.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+SpillFile::SpillFile(void)
+    : m_fd(-1)
+    , m_map(nullptr)
+    , m_size(0)
+    , m_head(0)
+    , m_tail(0)
+{
+}
+
+SpillFile::~SpillFile(void)
+{
+    Close();
+}
+
+bool SpillFile::Open(const string & dir, uint64_t size)
+{
+    if (m_map)
+    {
+        ERRORLOG << "Spill file already open.";
+        return false;
+    }
+
+#ifdef O_TMPFILE
+    m_fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (m_fd < 0)
+    {
+        // No O_TMPFILE support here; unlink it straight away instead.
+        string tmpl = dir + "/hauppauge2-spill.XXXXXX";
+        m_fd = mkostemp(&tmpl[0], O_CLOEXEC);
+        if (m_fd >= 0)
+            unlink(tmpl.c_str());
+    }
+    if (m_fd < 0)
+    {
+        ERRORLOG << "Unable to create spill file in '" << dir << "': "
+                 << strerror(errno);
+        return false;
+    }
+
+    // Reserve the blocks now, so a full disk shows up here and not as
+    // a SIGBUS in the middle of a recording.
+    int ret = posix_fallocate(m_fd, 0, size);
+    if (ret != 0)
+    {
+        ERRORLOG << "Unable to reserve " << size << " bytes for the spill "
+                 << "file in '" << dir << "': " << strerror(ret);
+        Close();
+        return false;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ERRORLOG << "Unable to map spill file: " << strerror(errno);
+        Close();
+        return false;
+    }
+    m_map  = reinterpret_cast<uint8_t *>(map);
+    m_size = size;
+    madvise(m_map, m_size, MADV_SEQUENTIAL);
+    Clear();
+
+    INFOLOG << "Spilling up to " << (size >> 20) << "MB to '" << dir << "'";
+    return true;
+}
+
+void SpillFile::Close(void)
+{
+    if (m_map)
+        munmap(m_map, m_size);
+    m_map = nullptr;
+    m_size = 0;
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+    Clear();
+}
+
+bool SpillFile::Append(const uint8_t *data, size_t len)
+{
+    uint64_t tail = m_tail;
+    if (Used() + len > m_size)
+        return false;
+
+    size_t pos   = tail % m_size;
+    size_t first = (len < m_size - pos) ? len : m_size - pos;
+    memcpy(m_map + pos, data, first);
+    memcpy(m_map, data + first, len - first);
+
+    m_tail = tail + len;
+    return true;
+}
+
+int SpillFile::Peek(struct iovec *iov, size_t max) const
+{
+    uint64_t used = Used();
+    if (used == 0 || max == 0)
+        return 0;
+    if (used > max)
+        used = max;
+
+    size_t pos   = m_head % m_size;
+    size_t first = (used < m_size - pos) ? used : m_size - pos;
+
+    iov[0].iov_base = m_map + pos;
+    iov[0].iov_len  = first;
+    if (first == used)
+        return 1;
+    iov[1].iov_base = m_map;
+    iov[1].iov_len  = used - first;
+    return 2;
+}
+
+void SpillFile::Consume(size_t len)
+{
+    m_head += len;
+}
+
+void SpillFile::Clear(void)
+{
+    m_head = 0;
+    m_tail = 0;
+}
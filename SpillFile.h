@@ -0,0 +1,74 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SpillFile_H_
+#define _SpillFile_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+struct iovec;
+
+/*
+ * A fixed size, memory mapped ring on local disk.  Buffer moves the
+ * oldest queued data here when memory runs short and writes it out
+ * again, in order, before anything still in memory.
+ *
+ * Append(), Peek(), Consume() and Clear() belong to the consumer
+ * thread; Used() may be read from anywhere.
+ */
+class SpillFile
+{
+  public:
+    SpillFile(void);
+    ~SpillFile(void);
+
+    // Creates an unnamed file of `size' bytes in `dir'.
+    bool Open(const std::string & dir, uint64_t size);
+    void Close(void);
+    bool IsOpen(void) const { return m_map != nullptr; }
+
+    // All or nothing; false if `len' does not fit.
+    bool Append(const uint8_t *data, size_t len);
+    // Fills up to two iovecs with the oldest data, at most `max' bytes.
+    int  Peek(struct iovec *iov, size_t max) const;
+    void Consume(size_t len);
+    void Clear(void);
+
+    uint64_t Used(void) const { return m_tail - m_head; }
+    uint64_t Size(void) const { return m_size; }
+
+  private:
+    SpillFile(const SpillFile &) = delete;
+    SpillFile & operator=(const SpillFile &) = delete;
+
+    int                   m_fd;
+    uint8_t              *m_map;
+    uint64_t              m_size;
+
+    // Running byte counts; the ring position is the count modulo m_size.
+    std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_tail;
+};
+
+#endif
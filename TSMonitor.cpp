@@ -0,0 +1,260 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "TSMonitor.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+    const uint64_t PCR_WRAP = (1ULL << 33) * 300;
+    // Anything further apart is a discontinuity, not an interval.
+    const uint64_t PCR_MAX_GAP_US = 1000000;
+}
+
+TSMonitor::Window::Window(void)
+    : when(clock_t::now())
+    , packets(0)
+    , nulls(0)
+{
+    memset(pid_packets, 0, sizeof(pid_packets));
+    memset(pcr_count, 0, sizeof(pcr_count));
+    memset(pcr_interval_us, 0, sizeof(pcr_interval_us));
+    memset(pcr_jitter_us, 0, sizeof(pcr_jitter_us));
+}
+
+TSMonitor::TSMonitor(void)
+    : m_pid_cnt(0)
+    , m_restart(false)
+    , m_packets(0)
+    , m_nulls(0)
+    , m_other(0)
+    , m_unaligned(0)
+    , m_start(clock_t::now())
+{
+    memset(m_slot, NO_SLOT, sizeof(m_slot));
+    for (PIDStats & st : m_pids)
+    {
+        st.pid      = NULL_PID;
+        st.last_cc  = -1;
+        st.last_pcr = PCR_WRAP;
+        st.packets  = 0;
+        st.cc_errors = 0;
+        st.pcr_count = 0;
+        st.pcr_interval_us  = 0;
+        st.pcr_interval_max = 0;
+        st.pcr_jitter_us  = 0;
+        st.pcr_jitter_max = 0;
+        st.pcr_discontinuities = 0;
+    }
+}
+
+TSMonitor::PIDStats *TSMonitor::Lookup(uint16_t pid)
+{
+    uint8_t idx = m_slot[pid];
+    if (idx != NO_SLOT)
+        return &m_pids[idx];
+
+    int cnt = m_pid_cnt.load(memory_order_relaxed);
+    if (cnt >= MAX_PIDS)
+        return nullptr;
+
+    m_pids[cnt].pid = pid;
+    m_slot[pid] = cnt;
+    // Publish the slot only once its PID is set.
+    m_pid_cnt.store(cnt + 1, memory_order_release);
+    return &m_pids[cnt];
+}
+
+void TSMonitor::Process(const uint8_t *pkts, size_t len)
+{
+    if (len % TS_PACKET != 0 || (len > 0 && pkts[0] != SYNC_BYTE))
+    {
+        add(m_unaligned);
+        return;
+    }
+
+    if (m_restart)
+    {
+        for (PIDStats & st : m_pids)
+        {
+            st.last_cc  = -1;
+            st.last_pcr = PCR_WRAP;
+        }
+        m_restart = false;
+    }
+
+    clock_t::time_point now = clock_t::now();
+    uint64_t nulls = 0;
+
+    for (const uint8_t *pkt = pkts; pkt < pkts + len; pkt += TS_PACKET)
+    {
+        uint16_t pid = ((pkt[1] & 0x1F) << 8) | pkt[2];
+        if (pid == NULL_PID)
+        {
+            ++nulls;
+            continue;
+        }
+
+        PIDStats *st = Lookup(pid);
+        if (st == nullptr)
+        {
+            add(m_other);
+            continue;
+        }
+        add(st->packets);
+
+        uint8_t afc = (pkt[3] >> 4) & 0x3;
+        uint8_t cc  = pkt[3] & 0x0F;
+        bool    has_af = (afc & 0x2) && pkt[4] > 0;
+
+        // The counter only moves on packets with payload, and may be
+        // reset where the discontinuity indicator is set.  A single
+        // repeat of the last value is a legal duplicate.
+        if (afc & 0x1)
+        {
+            if (st->last_cc >= 0 && !(has_af && (pkt[5] & 0x80)) &&
+                cc != ((st->last_cc + 1) & 0x0F) && cc != st->last_cc)
+                add(st->cc_errors);
+            st->last_cc = cc;
+        }
+
+        if (has_af && (pkt[5] & 0x10) && pkt[4] >= 7)
+            PCR(*st, pkt, now);
+    }
+
+    add(m_packets, len / TS_PACKET);
+    if (nulls)
+        add(m_nulls, nulls);
+}
+
+/*
+ * Interval is PCR to PCR on the same PID.  Jitter is how far that
+ * interval differs from the time between the two packets arriving
+ * here, so it includes the USB chunking (tens of ms at typical
+ * rates); a steady value is normal, spikes are not.
+ */
+void TSMonitor::PCR(PIDStats & st, const uint8_t *pkt, clock_t::time_point now)
+{
+    const uint8_t *p = pkt + 6;
+    uint64_t base = (static_cast<uint64_t>(p[0]) << 25) | (p[1] << 17) |
+                    (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+    uint64_t pcr  = base * 300 + (((p[4] & 0x01) << 8) | p[5]);
+
+    if (st.last_pcr < PCR_WRAP)
+    {
+        uint64_t delta = (pcr + PCR_WRAP - st.last_pcr) % PCR_WRAP;
+        uint64_t us    = delta / 27;
+        if (us == 0 || us > PCR_MAX_GAP_US)
+            add(st.pcr_discontinuities);
+        else
+        {
+            int64_t arrived = chrono::duration_cast<chrono::microseconds>
+                              (now - st.last_pcr_at).count();
+            uint64_t jitter = (arrived > static_cast<int64_t>(us))
+                              ? arrived - us : us - arrived;
+
+            add(st.pcr_count);
+            add(st.pcr_interval_us, us);
+            raise(st.pcr_interval_max, us);
+            add(st.pcr_jitter_us, jitter);
+            raise(st.pcr_jitter_max, jitter);
+        }
+    }
+    st.last_pcr    = pcr;
+    st.last_pcr_at = now;
+}
+
+uint64_t TSMonitor::CCErrors(void) const
+{
+    uint64_t total = 0;
+    int cnt = m_pid_cnt.load(memory_order_acquire);
+    for (int idx = 0; idx < cnt; ++idx)
+        total += load(m_pids[idx].cc_errors);
+    return total;
+}
+
+string TSMonitor::Report(Window & win) const
+{
+    clock_t::time_point now = clock_t::now();
+    double secs = chrono::duration<double>(now - win.when).count();
+    if (secs <= 0)
+        secs = 1e-6;
+
+    uint64_t packets = load(m_packets);
+    uint64_t nulls   = load(m_nulls);
+    uint64_t pkts    = packets - win.packets;
+    uint64_t nuls    = nulls - win.nulls;
+
+    ostringstream os;
+    os << fixed << setprecision(2)
+       << "packets=" << packets
+       << " rate=" << pkts * TS_PACKET * 8 / secs / 1e6 << "Mb/s"
+       << " null=" << (pkts ? 100.0 * nuls / pkts : 0) << "%"
+       << " cc_errors=" << CCErrors();
+    if (load(m_other))
+        os << " other_pids=" << load(m_other);
+    if (load(m_unaligned))
+        os << " unaligned=" << load(m_unaligned);
+
+    int cnt = m_pid_cnt.load(memory_order_acquire);
+    for (int idx = 0; idx < cnt; ++idx)
+    {
+        const PIDStats & st = m_pids[idx];
+        uint64_t pid_pkts  = load(st.packets);
+        uint64_t pcr_cnt   = load(st.pcr_count);
+        uint64_t pcr_int   = load(st.pcr_interval_us);
+        uint64_t pcr_jit   = load(st.pcr_jitter_us);
+        uint64_t d_pkts    = pid_pkts - win.pid_packets[idx];
+        uint64_t d_pcr     = pcr_cnt - win.pcr_count[idx];
+
+        os << "; pid=0x" << hex << st.pid << dec
+           << " rate=" << d_pkts * TS_PACKET * 8 / secs / 1e6 << "Mb/s"
+           << " cc_errors=" << load(st.cc_errors);
+        if (pcr_cnt)
+        {
+            os << " pcr_ms=" << (d_pcr ? (pcr_int - win.pcr_interval_us[idx])
+                                 / 1000.0 / d_pcr : 0)
+               << "/" << load(st.pcr_interval_max) / 1000.0
+               << " jitter_ms="
+               << (d_pcr ? (pcr_jit - win.pcr_jitter_us[idx])
+                   / 1000.0 / d_pcr : 0)
+               << "/" << load(st.pcr_jitter_max) / 1000.0;
+            if (load(st.pcr_discontinuities))
+                os << " pcr_disc=" << load(st.pcr_discontinuities);
+        }
+
+        win.pid_packets[idx]     = pid_pkts;
+        win.pcr_count[idx]       = pcr_cnt;
+        win.pcr_interval_us[idx] = pcr_int;
+        win.pcr_jitter_us[idx]   = pcr_jit;
+    }
+
+    win.when    = now;
+    win.packets = packets;
+    win.nulls   = nulls;
+    return os.str();
+}
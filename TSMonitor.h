@@ -0,0 +1,117 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TSMonitor_H_
+#define _TSMonitor_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*
+ * In-line transport stream health: per-PID packet counts, continuity
+ * counter errors, PCR interval and jitter, plus the null packet ratio.
+ *
+ * Process() runs on the producer thread and only ever does relaxed
+ * loads and stores on the counters.  Report() may be called from any
+ * thread; it only reads them, so it costs the producer nothing.
+ */
+class TSMonitor
+{
+  public:
+    enum constants { TS_PACKET = 188, SYNC_BYTE = 0x47, NULL_PID = 0x1FFF,
+                     PID_COUNT = 0x2000, MAX_PIDS = 64, NO_SLOT = 0xFF };
+
+    using clock_t = std::chrono::steady_clock;
+
+    // What the previous Report() saw, so rates cover the time since.
+    struct Window
+    {
+        Window(void);
+
+        clock_t::time_point when;
+        uint64_t packets;
+        uint64_t pid_packets[MAX_PIDS];
+        uint64_t pcr_count[MAX_PIDS];
+        uint64_t pcr_interval_us[MAX_PIDS];
+        uint64_t pcr_jitter_us[MAX_PIDS];
+        uint64_t nulls;
+    };
+
+    TSMonitor(void);
+
+    // Whole, aligned packets only; anything else is counted and skipped.
+    void Process(const uint8_t *pkts, size_t len);
+    // Forget continuity and PCR history, e.g. when streaming restarts.
+    void Restart(void) { m_restart = true; }
+
+    // One line summary of the time since `win' was last used.
+    std::string Report(Window & win) const;
+
+    uint64_t Packets(void) const { return load(m_packets); }
+    uint64_t CCErrors(void) const;
+
+  private:
+    struct PIDStats
+    {
+        uint16_t pid;
+        int8_t   last_cc;           // Producer only
+        uint64_t last_pcr;          // Producer only, 27MHz
+        clock_t::time_point last_pcr_at;
+
+        std::atomic<uint64_t> packets;
+        std::atomic<uint64_t> cc_errors;
+        std::atomic<uint64_t> pcr_count;
+        std::atomic<uint64_t> pcr_interval_us;  // Sum
+        std::atomic<uint64_t> pcr_interval_max;
+        std::atomic<uint64_t> pcr_jitter_us;    // Sum
+        std::atomic<uint64_t> pcr_jitter_max;
+        std::atomic<uint64_t> pcr_discontinuities;
+    };
+
+    static uint64_t load(const std::atomic<uint64_t> & v)
+    { return v.load(std::memory_order_relaxed); }
+    // Single writer, so a plain load and store is enough.
+    static void add(std::atomic<uint64_t> & v, uint64_t n = 1)
+    { v.store(v.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed); }
+    static void raise(std::atomic<uint64_t> & v, uint64_t n)
+    { if (n > v.load(std::memory_order_relaxed))
+            v.store(n, std::memory_order_relaxed); }
+
+    PIDStats *Lookup(uint16_t pid);
+    void PCR(PIDStats & st, const uint8_t *pkt, clock_t::time_point now);
+
+    uint8_t               m_slot[PID_COUNT];
+    PIDStats              m_pids[MAX_PIDS];
+    std::atomic<int>      m_pid_cnt;
+    bool                  m_restart;
+
+    std::atomic<uint64_t> m_packets;
+    std::atomic<uint64_t> m_nulls;
+    std::atomic<uint64_t> m_other;      // PIDs beyond MAX_PIDS
+    std::atomic<uint64_t> m_unaligned;
+    clock_t::time_point   m_start;
+};
+
+#endif
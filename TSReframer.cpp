@@ -0,0 +1,256 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "TSReframer.h"
+#include "Logger.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TSREFRAMER_X86 1
+#endif
+
+using namespace std;
+
+namespace
+{
+    using find_sync_t = size_t (*)(const uint8_t *, size_t);
+
+    // Single sync bytes are all that can be checked near the end.
+    inline size_t find_tail(const uint8_t *buf, size_t pos, size_t len)
+    {
+        const void *p = memchr(buf + pos, TSReframer::SYNC_BYTE, len - pos);
+        return p ? static_cast<const uint8_t *>(p) - buf : len;
+    }
+
+#ifdef TSREFRAMER_X86
+    /*
+     * Compare 16 (or 32) positions, and the positions one packet
+     * further on, against the sync byte at once; a set bit in both
+     * masks is a candidate that already has its confirmation.
+     */
+    __attribute__((target("sse2")))
+    size_t find_sync_sse2(const uint8_t *buf, size_t len)
+    {
+        const size_t PKT = TSReframer::TS_PACKET;
+        const __m128i sync = _mm_set1_epi8(TSReframer::SYNC_BYTE);
+        size_t pos = 0;
+
+        for (; pos + PKT + 16 <= len; pos += 16)
+        {
+            __m128i a = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(buf + pos));
+            __m128i b = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(buf + pos + PKT));
+            unsigned mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, sync),
+                              _mm_cmpeq_epi8(b, sync)));
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        for (; pos + PKT < len; ++pos)
+            if (buf[pos] == TSReframer::SYNC_BYTE &&
+                buf[pos + PKT] == TSReframer::SYNC_BYTE)
+                return pos;
+        return find_tail(buf, pos, len);
+    }
+
+    __attribute__((target("avx2")))
+    size_t find_sync_avx2(const uint8_t *buf, size_t len)
+    {
+        const size_t PKT = TSReframer::TS_PACKET;
+        const __m256i sync = _mm256_set1_epi8(TSReframer::SYNC_BYTE);
+        size_t pos = 0;
+
+        for (; pos + PKT + 32 <= len; pos += 32)
+        {
+            __m256i a = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(buf + pos));
+            __m256i b = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(buf + pos + PKT));
+            unsigned mask = _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, sync),
+                                 _mm256_cmpeq_epi8(b, sync)));
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        return pos + find_sync_sse2(buf + pos, len - pos);
+    }
+#endif
+
+    find_sync_t select_find_sync(const char *& name)
+    {
+#ifdef TSREFRAMER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            name = "avx2";
+            return find_sync_avx2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            name = "sse2";
+            return find_sync_sse2;
+        }
+#endif
+        name = "scalar";
+        return TSReframer::FindSyncScalar;
+    }
+
+    const char  *find_sync_name = nullptr;
+    find_sync_t  find_sync = select_find_sync(find_sync_name);
+}
+
+size_t TSReframer::FindSyncScalar(const uint8_t *buf, size_t len)
+{
+    size_t pos = 0;
+    for (; pos + TS_PACKET < len; ++pos)
+        if (buf[pos] == SYNC_BYTE && buf[pos + TS_PACKET] == SYNC_BYTE)
+            return pos;
+    return find_tail(buf, pos, len);
+}
+
+size_t TSReframer::FindSync(const uint8_t *buf, size_t len)
+{
+    return find_sync(buf, len);
+}
+
+const char *TSReframer::FindSyncImpl(void)
+{
+    return find_sync_name;
+}
+
+TSReframer::TSReframer(void)
+    : m_carry_len(0)
+    , m_in_sync(true)
+    , m_sync_losses(0)
+    , m_skipped(0)
+{
+}
+
+void TSReframer::Reset(void)
+{
+    m_carry_len = 0;
+    m_in_sync   = true;
+}
+
+void TSReframer::Process(const uint8_t *src, size_t len, const emit_t & emit)
+{
+    size_t pos = 0;
+    bool   pending = false;
+
+    if (len == 0)
+        return;
+
+    // Finish the packet left over from the last chunk.
+    if (m_carry_len > 0)
+    {
+        size_t need = TS_PACKET - m_carry_len;
+        if (len < need)
+        {
+            memcpy(m_carry + m_carry_len, src, len);
+            m_carry_len += len;
+            return;
+        }
+        memcpy(m_carry + m_carry_len, src, need);
+        pos = need;
+
+        if (pos == len && !m_in_sync)
+        {
+            // Still unconfirmed; hold on to it for the next chunk.
+            m_carry_len = TS_PACKET;
+            return;
+        }
+        m_carry_len = 0;
+
+        // If the next packet is not where it should be, this one is
+        // suspect too.
+        if (pos == len || src[pos] == SYNC_BYTE)
+        {
+            pending = true;
+            if (!m_in_sync)
+            {
+                DEBUGLOG << "TSReframer: sync regained after "
+                         << m_skipped << " bytes skipped in total.";
+                m_in_sync = true;
+            }
+        }
+        else
+            m_skipped += TS_PACKET;
+    }
+
+    while (pos < len)
+    {
+        // Out of sync, a sync byte counts only once the next packet
+        // confirms it -- the same at the start of a chunk as anywhere.
+        if (!m_in_sync || src[pos] != SYNC_BYTE)
+        {
+            if (m_in_sync)
+            {
+                ++m_sync_losses;
+                m_in_sync = false;
+            }
+            size_t off = FindSync(src + pos, len - pos);
+            m_skipped += off;
+            pos += off;
+            if (pos == len)
+                break;
+            if (pos + TS_PACKET >= len)
+            {
+                // Too close to the end to confirm; the next chunk will.
+                m_carry_len = len - pos;
+                memcpy(m_carry, src + pos, m_carry_len);
+                break;
+            }
+            DEBUGLOG << "TSReframer: sync regained after "
+                     << m_skipped << " bytes skipped in total.";
+            m_in_sync = true;
+        }
+
+        // Longest run of whole packets that all start with sync.
+        size_t end = pos;
+        while (end + TS_PACKET <= len && src[end] == SYNC_BYTE)
+            end += TS_PACKET;
+        if (pending)
+        {
+            // Send the finished carry along with the run after it,
+            // rather than have it take up a pool block on its own.
+            m_joined.assign(m_carry, m_carry + TS_PACKET);
+            m_joined.insert(m_joined.end(), src + pos, src + end);
+            emit(m_joined.data(), m_joined.size());
+            pending = false;
+        }
+        else if (end > pos)
+            emit(src + pos, end - pos);
+        pos = end;
+
+        if (pos < len && len - pos < TS_PACKET && src[pos] == SYNC_BYTE)
+        {
+            m_carry_len = len - pos;
+            memcpy(m_carry, src + pos, m_carry_len);
+            break;
+        }
+    }
+
+    if (pending)
+        emit(m_carry, TS_PACKET);
+}
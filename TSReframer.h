@@ -0,0 +1,74 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TSReframer_H_
+#define _TSReframer_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/*
+ * Turns arbitrary chunks of transport stream into runs of whole,
+ * aligned 188 byte packets.  A packet split across chunks is carried
+ * over; garbage between packets is skipped by looking for two sync
+ * bytes one packet apart.  Not thread safe.
+ */
+class TSReframer
+{
+  public:
+    enum constants { TS_PACKET = 188, SYNC_BYTE = 0x47 };
+
+    using emit_t = std::function<void(const uint8_t *, size_t)>;
+
+    TSReframer(void);
+
+    // Calls emit zero or more times with whole packets.
+    void Process(const uint8_t *src, size_t len, const emit_t & emit);
+    // Forget any partial packet, e.g. when streaming restarts.
+    void Reset(void);
+
+    uint64_t SyncLosses(void) const { return m_sync_losses; }
+    uint64_t BytesSkipped(void) const { return m_skipped; }
+
+    /*
+     * Offset of the first sync byte followed by another one packet
+     * later -- or, within the last packet's worth of data, of the
+     * first sync byte -- in buf.  len if there is none.
+     */
+    static size_t FindSync(const uint8_t *buf, size_t len);
+    static size_t FindSyncScalar(const uint8_t *buf, size_t len);
+    // Name of the implementation FindSync() dispatches to.
+    static const char *FindSyncImpl(void);
+
+  private:
+    uint8_t  m_carry[TS_PACKET];
+    size_t   m_carry_len;
+    // The finished carry packet and the run after it, emitted as one.
+    std::vector<uint8_t> m_joined;
+    bool     m_in_sync;
+
+    uint64_t m_sync_losses;
+    uint64_t m_skipped;
+};
+
+#endif
@@ -0,0 +1,367 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "URingWriter.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+using namespace std;
+
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup)
+
+namespace
+{
+    int uring_setup(unsigned entries, struct io_uring_params *p)
+    { return syscall(__NR_io_uring_setup, entries, p); }
+    int uring_enter(int fd, unsigned submit, unsigned complete,
+                    unsigned flags)
+    { return syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+                     nullptr, 0); }
+    int uring_register(int fd, unsigned op, const void *arg, unsigned cnt)
+    { return syscall(__NR_io_uring_register, fd, op, arg, cnt); }
+
+    template <typename T> T *ring(void *base, unsigned off)
+    { return reinterpret_cast<T *>(static_cast<uint8_t *>(base) + off); }
+}
+
+URingWriter::URingWriter(void)
+    : m_ring_fd(-1)
+    , m_fd(-1)
+    , m_depth(0)
+    , m_inflight(0)
+    , m_fixed_file(false)
+    , m_buf(nullptr)
+    , m_buf_len(0)
+    , m_sq_ptr(MAP_FAILED)
+    , m_sq_len(0)
+    , m_cq_ptr(MAP_FAILED)
+    , m_cq_len(0)
+    , m_sqes(reinterpret_cast<struct io_uring_sqe *>(MAP_FAILED))
+    , m_sqes_len(0)
+{
+}
+
+URingWriter::~URingWriter(void)
+{
+    // The kernel may still be reading from the caller's buffers.
+    WriteCompletion done[16];
+    while (m_inflight > 0 && Completed(done, 16, true) >= 0)
+        ;
+    Close();
+}
+
+void URingWriter::Close(void)
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqes_len);
+    if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+        munmap(m_cq_ptr, m_cq_len);
+    if (m_sq_ptr != MAP_FAILED)
+        munmap(m_sq_ptr, m_sq_len);
+    m_sqes   = reinterpret_cast<struct io_uring_sqe *>(MAP_FAILED);
+    m_cq_ptr = m_sq_ptr = MAP_FAILED;
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+    m_ring_fd = -1;
+}
+
+bool URingWriter::Open(int fd, int depth, int event_fd, void *buf,
+                       size_t buf_len)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    if (depth < 1)
+        depth = 1;
+    m_ring_fd = uring_setup(depth, &p);
+    if (m_ring_fd < 0)
+    {
+        DEBUGLOG << "io_uring_setup: " << strerror(errno);
+        return false;
+    }
+
+    m_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_sq_len = m_cq_len = max(m_sq_len, m_cq_len);
+
+    m_sq_ptr = mmap(nullptr, m_sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED)
+    {
+        ERRORLOG << "io_uring: unable to map SQ ring: " << strerror(errno);
+        Close();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_cq_ptr = m_sq_ptr;
+    else
+    {
+        m_cq_ptr = mmap(nullptr, m_cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ring_fd,
+                        IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED)
+        {
+            ERRORLOG << "io_uring: unable to map CQ ring: "
+                     << strerror(errno);
+            Close();
+            return false;
+        }
+    }
+    m_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = reinterpret_cast<struct io_uring_sqe *>(
+        mmap(nullptr, m_sqes_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES));
+    if (m_sqes == MAP_FAILED)
+    {
+        ERRORLOG << "io_uring: unable to map SQEs: " << strerror(errno);
+        Close();
+        return false;
+    }
+
+    m_sq_head  = ring<unsigned>(m_sq_ptr, p.sq_off.head);
+    m_sq_tail  = ring<unsigned>(m_sq_ptr, p.sq_off.tail);
+    m_sq_mask  = ring<unsigned>(m_sq_ptr, p.sq_off.ring_mask);
+    m_sq_array = ring<unsigned>(m_sq_ptr, p.sq_off.array);
+    m_cq_head  = ring<unsigned>(m_cq_ptr, p.cq_off.head);
+    m_cq_tail  = ring<unsigned>(m_cq_ptr, p.cq_off.tail);
+    m_cq_mask  = ring<unsigned>(m_cq_ptr, p.cq_off.ring_mask);
+    m_cqes     = ring<struct io_uring_cqe>(m_cq_ptr, p.cq_off.cqes);
+
+    // Fixed files and buffers save a lookup and a page pin per write;
+    // without them it still works, just not quite as cheaply.
+    m_fd = fd;
+    m_fixed_file = (uring_register(m_ring_fd, IORING_REGISTER_FILES,
+                                   &fd, 1) == 0);
+    if (buf && buf_len)
+    {
+        struct iovec reg;
+        reg.iov_base = buf;
+        reg.iov_len  = buf_len;
+        if (uring_register(m_ring_fd, IORING_REGISTER_BUFFERS, &reg, 1) == 0)
+        {
+            m_buf     = static_cast<uint8_t *>(buf);
+            m_buf_len = buf_len;
+        }
+        else
+            WARNLOG << "io_uring: unable to register " << buf_len
+                    << " byte buffer: " << strerror(errno);
+    }
+    if (event_fd >= 0 &&
+        uring_register(m_ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+    {
+        ERRORLOG << "io_uring: unable to register eventfd: "
+                 << strerror(errno);
+        Close();
+        return false;
+    }
+
+    m_depth = min<int>(depth, p.sq_entries);
+    m_slots.resize(m_depth, Slot{false, 0, {}});
+    for (int idx = m_depth - 1; idx >= 0; --idx)
+        m_free.push_back(idx);
+
+    INFOLOG << "io_uring writer: depth " << m_depth
+            << (m_fixed_file ? ", fixed file" : "")
+            << (m_buf ? ", registered buffer" : "");
+    return true;
+}
+
+struct io_uring_sqe *URingWriter::NextSQE(void)
+{
+    struct io_uring_sqe *sqe = &m_sqes[*m_sq_tail & *m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish the SQE from NextSQE() and hand it to the kernel.
+bool URingWriter::Enter(void)
+{
+    unsigned tail = *m_sq_tail;
+    unsigned idx  = tail & *m_sq_mask;
+
+    m_sq_array[idx] = idx;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    while ((ret = uring_enter(m_ring_fd, 1, 0, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (ret < 1)
+    {
+        // Never reached the kernel; take the SQE back.
+        ERRORLOG << "io_uring_enter: " << strerror(errno);
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+bool URingWriter::Submit(const struct iovec *iov, int cnt, int64_t offset,
+                         uint64_t tag)
+{
+    if (m_free.empty() || cnt < 1)
+        return false;
+
+    unsigned slot = m_free.back();
+    m_free.pop_back();
+    m_slots[slot].tag = tag;
+    m_slots[slot].iov.assign(iov, iov + cnt);
+
+    struct io_uring_sqe *sqe = NextSQE();
+
+    const uint8_t *base = static_cast<const uint8_t *>(iov[0].iov_base);
+    if (cnt == 1 && m_buf && base >= m_buf &&
+        base + iov[0].iov_len <= m_buf + m_buf_len)
+    {
+        sqe->opcode    = IORING_OP_WRITE_FIXED;
+        sqe->addr      = reinterpret_cast<uint64_t>(base);
+        sqe->len       = iov[0].iov_len;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr   = reinterpret_cast<uint64_t>(m_slots[slot].iov.data());
+        sqe->len    = cnt;
+    }
+    if (m_fixed_file)
+    {
+        sqe->fd     = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else
+        sqe->fd = m_fd;
+    sqe->off       = (offset < 0) ? static_cast<uint64_t>(-1) : offset;
+    sqe->user_data = slot;
+
+    if (!Enter())
+    {
+        m_free.push_back(slot);
+        return false;
+    }
+    m_slots[slot].busy = true;
+    ++m_inflight;
+    return true;
+}
+
+void URingWriter::Cancel(void)
+{
+    for (unsigned slot = 0; slot < m_slots.size(); ++slot)
+    {
+        if (!m_slots[slot].busy)
+            continue;
+
+        struct io_uring_sqe *sqe = NextSQE();
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->fd        = -1;
+        sqe->addr      = slot;
+        sqe->user_data = CANCEL_DATA;
+        Enter();
+    }
+}
+
+int URingWriter::Completed(WriteCompletion *done, int max, bool wait)
+{
+    unsigned head = *m_cq_head;
+
+    if (wait && m_inflight > 0 &&
+        head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR)
+        {
+            ERRORLOG << "io_uring_enter: " << strerror(errno);
+            return -1;
+        }
+    }
+
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    int      cnt  = 0;
+    while (head != tail && cnt < max)
+    {
+        struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+        unsigned slot = cqe->user_data;
+
+        ++head;
+        if (slot == CANCEL_DATA)
+            continue;
+
+        done[cnt].tag    = m_slots[slot].tag;
+        done[cnt].result = cqe->res;
+        ++cnt;
+
+        m_slots[slot].busy = false;
+        m_free.push_back(slot);
+        --m_inflight;
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return cnt;
+}
+
+#else
+
+URingWriter::URingWriter(void)
+    : m_ring_fd(-1), m_fd(-1), m_depth(0), m_inflight(0)
+{
+}
+
+URingWriter::~URingWriter(void)
+{
+}
+
+void URingWriter::Close(void)
+{
+}
+
+bool URingWriter::Open(int, int, int, void *, size_t)
+{
+    return false;
+}
+
+void URingWriter::Cancel(void)
+{
+}
+
+bool URingWriter::Submit(const struct iovec *, int, int64_t, uint64_t)
+{
+    return false;
+}
+
+int URingWriter::Completed(WriteCompletion *, int, bool)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _URingWriter_H_
+#define _URingWriter_H_
+
+#include "OutputWriter.h"
+
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * OutputWriter on io_uring, through the raw system calls so there is
+ * no library to depend on.  Submit() queues one SQE and enters the
+ * kernel once; it never waits for the write.  Completed() reads the
+ * completion ring directly and only enters the kernel when asked to
+ * wait.
+ */
+class URingWriter : public OutputWriter
+{
+  public:
+    URingWriter(void);
+    ~URingWriter(void) override;
+
+    // False if io_uring can't be used here; the caller falls back.
+    bool Open(int fd, int depth, int event_fd, void *buf, size_t buf_len);
+
+    bool Submit(const struct iovec *iov, int cnt, int64_t offset,
+                uint64_t tag) override;
+    int  Completed(WriteCompletion *done, int max, bool wait) override;
+    void Cancel(void) override;
+
+    int  InFlight(void) const override { return m_inflight; }
+    int  Depth(void) const override { return m_depth; }
+    const char *Name(void) const override { return "io_uring"; }
+
+  private:
+    enum constants { CANCEL_DATA = ~0U };
+
+    struct Slot
+    {
+        bool     busy;
+        uint64_t tag;
+        std::vector<struct iovec> iov;
+    };
+
+    struct io_uring_sqe *NextSQE(void);
+    bool Enter(void);
+    void Close(void);
+
+    int       m_ring_fd;
+    int       m_fd;
+    int       m_depth;
+    int       m_inflight;
+    bool      m_fixed_file;
+    uint8_t  *m_buf;            // Registered for fixed writes, or null
+    size_t    m_buf_len;
+
+    void     *m_sq_ptr;
+    size_t    m_sq_len;
+    void     *m_cq_ptr;
+    size_t    m_cq_len;
+    struct io_uring_sqe *m_sqes;
+    size_t    m_sqes_len;
+
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_mask;
+    unsigned *m_sq_array;
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned *m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    std::vector<Slot>     m_slots;
+    std::vector<unsigned> m_free;
+};
+
+#endif
@@ -0,0 +1,321 @@
+/*  -*- Mode: c++ -*-
+ *
+ * Copyright (C) John Poet 2018
+ *
+ * This file is part of HauppaugeUSB.
+ *
+ * HauppaugeUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HauppaugeUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HauppaugeUSB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load for the USB read path, no capture device needed: USBWrapper_t
+ * is linked against the libusb stand-in in Wrappers/linux.
+ *
+ * A reader thread does what the encoder's data thread does: keeps
+ * --inflight bulkReadAsync() calls outstanding and waits for them in
+ * order.  The stand-in hands out numbered TS packets, so the reader
+ * can tell lost or reordered data, and every read is timed from
+ * submission to the wakeup that sees it finished.
+ *
+ * --record captures the run as a USBTrace, which --replay then feeds
+ * through USBReplay_t instead of the stand-in; a replay starts over
+ * at the end of the trace, which is counted as a rewind, not a loss.
+ */
+
+#include "USBif.h"
+#include "USBReplay.h"
+#include "USBStandIn.h"
+#include "Logger.h"
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace po = boost::program_options;
+using namespace std;
+
+using bench_clock = chrono::steady_clock;
+
+enum constants { TS_PACKET = 188, TS_ENDPOINT = 0x04, TIMEOUT_MS = 1000 };
+
+struct BenchParams
+{
+    uint32_t xfer_size;
+    int      inflight;
+    int      pool;
+    bool     atomic;
+    int      read_ahead;
+    uint64_t rate;
+    uint64_t limit;
+    uint64_t fifo;
+    int      stall_ms;
+    int      stall_every;
+    int      duration;      // seconds
+    string   record;
+    string   replay;
+};
+
+struct BenchStats
+{
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t timeouts;
+    uint64_t errors;        // Reads that failed otherwise
+    uint64_t lost;          // Packets missing from the sequence
+    uint64_t rewound;       // Times the sequence went backwards
+    vector<uint32_t> latency;   // us, submit to wakeup
+
+    BenchStats(void) : reads(0), bytes(0), timeouts(0), errors(0), lost(0)
+                     , rewound(0) {}
+};
+
+// Ctx is the completion object under test.
+template <class Ctx>
+static void read_loop(USBWrapper_t & usb, const BenchParams & p,
+                      BenchStats & st)
+{
+    unique_ptr<Ctx[]> ctxs(new Ctx[p.inflight]);
+    vector<vector<uint8_t> > bufs(p.inflight,
+                                  vector<uint8_t>(p.xfer_size));
+    vector<bench_clock::time_point> submitted(p.inflight);
+    uint64_t expected = 0;
+
+    auto submit = [&](int idx)
+    {
+        submitted[idx] = bench_clock::now();
+        usb.bulkReadAsync(ctxs[idx], TS_ENDPOINT, bufs[idx].data(),
+                          p.xfer_size, TIMEOUT_MS);
+    };
+
+    for (int idx = 0; idx < p.inflight; ++idx)
+        submit(idx);
+
+    auto end = bench_clock::now() + chrono::seconds(p.duration);
+    for (int idx = 0; ; idx = (idx + 1) % p.inflight)
+    {
+        ctxs[idx].wait();
+        auto done = bench_clock::now();
+        st.latency.push_back(chrono::duration_cast<chrono::microseconds>
+                             (done - submitted[idx]).count());
+        ++st.reads;
+
+        int result = ctxs[idx].getState();
+        if (result == USBWRAP_ERROR_TIMEOUT)
+            ++st.timeouts;
+        else if (result != USBWRAP_SUCCESS)
+            ++st.errors;
+        else
+        {
+            uint32_t size = ctxs[idx].size;
+            st.bytes += size;
+            for (uint32_t pos = 0; pos + TS_PACKET <= size;
+                 pos += TS_PACKET)
+            {
+                uint64_t seq;
+                memcpy(&seq, &bufs[idx][pos + USBStandInConfig_t::PAYLOAD],
+                       sizeof(seq));
+                if (seq < expected)
+                    ++st.rewound;
+                else if (seq > expected)
+                    st.lost += seq - expected;
+                expected = seq + 1;
+            }
+        }
+
+        if (done >= end)
+            break;
+        if (p.stall_every && st.reads % p.stall_every == 0)
+            this_thread::sleep_for(chrono::milliseconds(p.stall_ms));
+        submit(idx);
+    }
+
+    // Let the rest finish before their buffers go away.
+    for (int idx = 0; idx < p.inflight; ++idx)
+        ctxs[idx].wait();
+}
+
+static uint32_t percentile(const vector<uint32_t> & sorted, double pct)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = static_cast<size_t>(pct / 100 * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchParams p;
+
+    po::options_description opts{"USB read path benchmark options"};
+    opts.add_options()
+        ("help,h", "Print this help text.")
+        ("xfer-size", po::value<uint32_t>(&p.xfer_size)
+         ->default_value(188 * 348), "Bytes per bulkReadAsync().")
+        ("inflight", po::value<int>(&p.inflight)->default_value(4),
+         "bulkReadAsync() calls kept outstanding.")
+        ("pool", po::value<int>(&p.pool)
+         ->default_value(USBWrapper_t::XFER_POOL),
+         "Size of the transfer pool. 0 allocates a transfer per read.")
+        ("atomic", po::bool_switch(&p.atomic),
+         "Complete reads through USBWrapperAtomicCtx_t instead of "
+         "USBWrapperAsyncCtx_t.")
+        ("read-ahead", po::value<int>(&p.read_ahead)->default_value(0),
+         "Serve the reads from this many streaming transfers, as "
+         "hauppauge2 --usb-read-ahead does.")
+        ("rate", po::value<uint64_t>(&p.rate)->default_value(0),
+         "Rate of the device, bits/sec. 0 = as fast as it is asked.")
+        ("limit", po::value<uint64_t>(&p.limit)->default_value(0),
+         "The stand-in goes quiet after this many bytes, so later reads "
+         "time out. 0 = never.")
+        ("fifo", po::value<uint64_t>(&p.fifo)->default_value(0),
+         "With --rate, bytes the stand-in holds while no read is queued "
+         "before it loses data. 0 = unlimited.")
+        ("stall-ms", po::value<int>(&p.stall_ms)->default_value(0),
+         "Let the reader stall this long, as a slow write would ...")
+        ("stall-every", po::value<int>(&p.stall_every)->default_value(0),
+         "... every this many reads. 0 = never.")
+        ("record", po::value<string>(&p.record),
+         "Capture the run, with data, to this USBTrace file.")
+        ("replay", po::value<string>(&p.replay),
+         "Read from this USBTrace file through USBReplay_t instead of "
+         "the stand-in.")
+        ("duration", po::value<int>(&p.duration)->default_value(5),
+         "Seconds to run.")
+        ("loglevel", po::value<string>(),
+         "debug, info, notice, warning, error, critical");
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, opts), vm);
+        po::notify(vm);
+    }
+    catch (std::exception &e)
+    {
+        cerr << e.what() << endl << opts << endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        cout << opts << endl;
+        return 0;
+    }
+    if (vm.count("loglevel"))
+        setLogLevelFilter(vm["loglevel"].as<string>());
+    if (p.inflight < 1 || p.xfer_size < TS_PACKET)
+    {
+        cerr << "inflight must be positive and xfer-size at least one "
+             << "TS packet." << endl;
+        return 1;
+    }
+
+    USBStandInConfig_t standin = { "E505-00-00STANDIN", p.rate, p.limit,
+                                   p.fifo };
+    USBStandIn_configure(standin);
+    USBWrapper_t::setTransferPool(p.pool);
+    if (!p.replay.empty())
+    {
+        string   file = p.replay;
+        uint64_t rate = p.rate;
+        USBWrapper_t::setBackend([file, rate]()
+                                 { return new USBReplay_t(file, rate); });
+    }
+    if (!p.record.empty())
+        USBWrapper_t::setRecord(p.record, true);
+
+    BenchStats st;
+    double     elapsed;
+    double     cpu;
+    uint64_t   allocated;
+    uint64_t   reused;
+    uint64_t   exhausted;
+    {
+        USBWrapper_t usb;
+        if (!usb.Open(standin.serial))
+        {
+            cerr << usb.ErrorString() << endl;
+            return 1;
+        }
+        usb.startEventThread();
+        if (p.read_ahead > 0)
+            usb.readAhead(p.read_ahead);
+
+        allocated = USBStandIn_allocated();
+        double cpu_start = cpu_seconds();
+        auto   start = bench_clock::now();
+        if (p.atomic)
+            read_loop<USBWrapperAtomicCtx_t>(usb, p, st);
+        else
+            read_loop<USBWrapperAsyncCtx_t>(usb, p, st);
+        usb.stopStreaming();
+        elapsed = chrono::duration<double>(bench_clock::now() -
+                                           start).count();
+        cpu = cpu_seconds() - cpu_start;
+        allocated = USBStandIn_allocated() - allocated;
+        reused    = usb.poolReused();
+        exhausted = usb.poolExhausted();
+    }
+
+    sort(st.latency.begin(), st.latency.end());
+
+    cout << fixed << setprecision(2)
+         << "Reads          : " << st.reads << " of " << p.xfer_size
+         << " bytes, " << p.inflight << " in flight, "
+         << (p.atomic ? "USBWrapperAtomicCtx_t" : "USBWrapperAsyncCtx_t")
+         << (p.read_ahead ? ", read ahead" : "")
+         << (p.replay.empty() ? "" : ", replayed") << "\n"
+         << "Throughput     : " << st.reads / elapsed << " reads/s, "
+         << st.bytes * 8 / elapsed / 1e6 << " Mb/s\n"
+         << "CPU            : " << cpu * 1e6 / max<uint64_t>(st.reads, 1)
+         << " us per read\n"
+         << "Transfers      : " << allocated << " allocated, "
+         << reused << " reused from a pool of " << p.pool << ", "
+         << exhausted << " times exhausted\n"
+         << "Timeouts       : " << st.timeouts << "\n"
+         << "Errors         : " << st.errors << "\n"
+         << "Lost packets   : " << st.lost << " ("
+         << USBStandIn_overflowed() / TS_PACKET << " overflowed the "
+         << "device)\n"
+         << "Rewinds        : " << st.rewound << "\n"
+         << "Latency (us)   : p50 " << percentile(st.latency, 50)
+         << ", p90 " << percentile(st.latency, 90)
+         << ", p99 " << percentile(st.latency, 99)
+         << ", p99.9 " << percentile(st.latency, 99.9)
+         << ", max " << (st.latency.empty() ? 0 : st.latency.back())
+         << endl;
+
+    bool ok = (st.errors == 0 && st.lost == 0 &&
+               (p.limit || st.timeouts == 0) &&
+               (!p.replay.empty() || st.rewound == 0));
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+#ifndef __USBBACKEND_H_
+#define __USBBACKEND_H_
+
+#include "USBif.h"
+
+/*
+ * Something other than libusb that USBWrapper_t can hand its device
+ * traffic to, selected at run time with USBWrapper_t::setBackend().
+ * Return values follow the USBWRAP_* conventions of the matching
+ * USBWrapper_t method.
+ */
+class USBBackend_t
+{
+  public:
+    virtual ~USBBackend_t(void) {}
+
+    virtual bool Open(const std::string& serial) = 0;
+    virtual void Close(void) = 0;
+    virtual bool Reset(void) = 0;
+    virtual bool DeviceList(DeviceIDVec& devs) = 0;
+    virtual void USBDevDesc(std::string& desc) = 0;
+    virtual std::string ErrorString(void) = 0;
+
+    virtual int controlMessage(USBWrapperControlMessage_t &msg,
+                               uint8_t *buf, uint32_t timeout) = 0;
+    virtual int bulkRead(uint8_t num, uint8_t *buf, uint32_t len,
+                         uint32_t timeout) = 0;
+    // Exactly one of ctx and actx is set; complete it with set().
+    virtual int bulkReadAsync(USBWrapperAsyncCtx_t *ctx,
+                              USBWrapperAtomicCtx_t *actx, uint8_t num,
+                              uint8_t *buf, uint32_t len,
+                              uint32_t timeout) = 0;
+    virtual int bulkWrite(uint8_t num, const uint8_t *buf, uint32_t len,
+                          uint32_t timeout) = 0;
+    virtual int clearStall(uint8_t num) = 0;
+
+    virtual int startStreaming(uint8_t num, uint32_t xfer_size,
+                               int xfer_cnt,
+                               USBWrapper_t::stream_cb_t cb,
+                               uint32_t timeout) = 0;
+    virtual int stopStreaming(void) = 0;
+};
+
+#endif
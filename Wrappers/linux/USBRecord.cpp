@@ -0,0 +1,207 @@
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "USBRecord.h"
+
+using namespace std;
+
+USBRecorder_t::USBRecorder_t(const string & file, bool payload)
+    : m_file(file)
+    , m_payload(payload)
+    , m_fd(-1)
+    , m_start(chrono::steady_clock::now())
+    , m_run(false)
+    , m_records(0)
+    , m_dropped(0)
+    , m_written(0)
+{
+}
+
+USBRecorder_t::~USBRecorder_t(void)
+{
+    Stop();
+}
+
+bool USBRecorder_t::Start(const USBTraceHeader_t & header)
+{
+    m_fd = open(m_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+    if (m_fd < 0)
+    {
+        ERRORLOG << "Unable to create USB trace '" << m_file << "': "
+                 << strerror(errno);
+        return false;
+    }
+
+    m_active.reserve(FLUSH_BYTES * 2);
+    m_writing.reserve(FLUSH_BYTES * 2);
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&header);
+    m_active.insert(m_active.end(), p, p + sizeof(header));
+
+    m_start = chrono::steady_clock::now();
+    m_run = true;
+    m_thread = thread(&USBRecorder_t::Run, this);
+
+    INFOLOG << "Recording USB traffic to '" << m_file << "'"
+            << (m_payload ? " with payload." : ".");
+    return true;
+}
+
+void USBRecorder_t::Stop(void)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_run = false;
+    }
+    m_cond.notify_one();
+    if (!m_thread.joinable())
+        return;
+    m_thread.join();
+
+    // Run() closes it itself if writing failed.
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+
+    INFOLOG << "USB trace '" << m_file << "': " << m_records
+            << " records, " << m_written << " bytes"
+            << (m_dropped ? ", " + to_string(m_dropped) + " dropped." : ".");
+}
+
+uint64_t USBRecorder_t::Now(void) const
+{
+    return chrono::duration_cast<chrono::microseconds>
+        (chrono::steady_clock::now() - m_start).count();
+}
+
+void USBRecorder_t::append(USBTraceRecord_t & rec, const uint8_t *buf)
+{
+    if (m_payload && buf && rec.length)
+        rec.flags |= USBTRACE_HAS_PAYLOAD;
+    else
+        rec.flags &= ~USBTRACE_HAS_PAYLOAD;
+
+    size_t bytes = sizeof(rec) +
+                   ((rec.flags & USBTRACE_HAS_PAYLOAD) ? rec.length : 0);
+
+    unique_lock<mutex> lock(m_mutex);
+    if (!m_run)
+        return;
+
+    // Rather lose records than let a stalled disk eat all memory.
+    if (m_active.size() + bytes > MAX_PENDING)
+    {
+        ++m_dropped;
+        return;
+    }
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&rec);
+    m_active.insert(m_active.end(), p, p + sizeof(rec));
+    if (rec.flags & USBTRACE_HAS_PAYLOAD)
+        m_active.insert(m_active.end(), buf, buf + rec.length);
+    ++m_records;
+
+    bool flush = (m_active.size() >= FLUSH_BYTES);
+    lock.unlock();
+    if (flush)
+        m_cond.notify_one();
+}
+
+void USBRecorder_t::Control(uint64_t start,
+                            const USBWrapperControlMessage_t & msg,
+                            int result, const uint8_t *buf)
+{
+    USBTraceRecord_t rec = {};
+    uint64_t now = Now();
+
+    rec.time_us       = start;
+    rec.duration_us   = now - start;
+    rec.type          = USBTRACE_CONTROL;
+    rec.bmRequestType = msg.bmRequestType;
+    rec.bRequest      = msg.bRequest;
+    rec.wValue        = msg.wValue;
+    rec.wIndex        = msg.wIndex;
+    rec.wLength       = msg.wLength;
+    rec.result        = result;
+    rec.requested     = msg.wLength;
+    rec.length        = (result > 0) ? result : 0;
+
+    append(rec, buf);
+}
+
+void USBRecorder_t::Transfer(uint64_t start, uint8_t type, uint8_t flags,
+                             uint8_t ep, int result, uint32_t requested,
+                             uint32_t length, const uint8_t *buf)
+{
+    USBTraceRecord_t rec = {};
+    uint64_t now = Now();
+
+    rec.time_us     = start;
+    rec.duration_us = now - start;
+    rec.type        = type;
+    rec.flags       = flags;
+    rec.endpoint    = ep;
+    rec.result      = result;
+    rec.requested   = requested;
+    rec.length      = length;
+
+    append(rec, buf);
+}
+
+void USBRecorder_t::Event(uint8_t type, uint8_t ep, int result)
+{
+    Transfer(Now(), type, 0, ep, result, 0, 0, nullptr);
+}
+
+void USBRecorder_t::Run(void)
+{
+    setThreadName("USB record");
+
+    unique_lock<mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_cond.wait_for(lock, chrono::milliseconds(FLUSH_MS),
+                        [this] { return !m_run ||
+                                 m_active.size() >= FLUSH_BYTES; });
+        bool run = m_run;
+
+        m_writing.swap(m_active);
+        lock.unlock();
+
+        size_t pos = 0;
+        bool   failed = false;
+        while (pos < m_writing.size())
+        {
+            ssize_t r = write(m_fd, m_writing.data() + pos,
+                              m_writing.size() - pos);
+            if (r < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ERRORLOG << "USB trace write failed, recording stopped: "
+                         << strerror(errno);
+                failed = true;
+                break;
+            }
+            pos += r;
+        }
+        m_written += pos;
+        m_writing.clear();
+
+        lock.lock();
+        if (failed)
+        {
+            // Anything after a torn record would be garbage anyway.
+            m_run = false;
+            m_active.clear();
+            close(m_fd);
+            m_fd = -1;
+            break;
+        }
+        if (!run && m_active.empty())
+            break;
+    }
+}
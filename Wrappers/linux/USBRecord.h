@@ -0,0 +1,63 @@
+#ifndef __USBRECORD_H_
+#define __USBRECORD_H_
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "USBif.h"
+#include "USBTrace.h"
+
+/*
+ * Captures the traffic of one USBWrapper_t to a USBTrace file.  The
+ * calling threads only append to an in-memory buffer; a background
+ * thread swaps it out and writes it, so the device timing is not
+ * disturbed by disk latency.
+ */
+class USBRecorder_t
+{
+  public:
+    enum constants { FLUSH_BYTES = 1 << 20, FLUSH_MS = 500,
+                     MAX_PENDING = 64 << 20 };
+
+    USBRecorder_t(const std::string & file, bool payload);
+    ~USBRecorder_t(void);
+
+    bool Start(const USBTraceHeader_t & header);
+    void Stop(void);
+
+    // Microseconds since Start()
+    uint64_t Now(void) const;
+
+    void Control(uint64_t start, const USBWrapperControlMessage_t & msg,
+                 int result, const uint8_t *buf);
+    void Transfer(uint64_t start, uint8_t type, uint8_t flags, uint8_t ep,
+                  int result, uint32_t requested, uint32_t length,
+                  const uint8_t *buf);
+    void Event(uint8_t type, uint8_t ep, int result);
+
+  private:
+    void append(USBTraceRecord_t & rec, const uint8_t *buf);
+    void Run(void);
+
+    std::string           m_file;
+    bool                  m_payload;
+    int                   m_fd;
+    std::chrono::steady_clock::time_point m_start;
+
+    std::mutex            m_mutex;
+    std::condition_variable m_cond;
+    std::vector<uint8_t>  m_active;
+    std::vector<uint8_t>  m_writing;
+    bool                  m_run;
+    std::thread           m_thread;
+
+    uint64_t              m_records;
+    uint64_t              m_dropped;
+    uint64_t              m_written;
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+#include "USBReplay.h"
+
+using namespace std;
+
+static const uint8_t null_ts[4] = { 0x47, 0x1F, 0xFF, 0x10 };
+
+USBReplay_t::USBReplay_t(const string & file, uint64_t rate_bps)
+    : m_file(file)
+    , m_rate(rate_bps)
+    , m_loaded(false)
+    , m_open(false)
+    , m_header()
+    , m_cursor(0)
+    , m_mismatches(0)
+    , m_paced_bytes(0)
+    , m_streaming(false)
+{
+}
+
+USBReplay_t::~USBReplay_t(void)
+{
+    Close();
+}
+
+bool USBReplay_t::load(void)
+{
+    if (m_loaded)
+        return true;
+
+    ifstream ifs(m_file.c_str(), ios::binary);
+    if (!ifs)
+    {
+        m_errmsg << "Unable to open USB trace '" << m_file << "'.\n";
+        return false;
+    }
+
+    if (!ifs.read(reinterpret_cast<char *>(&m_header), sizeof(m_header)) ||
+        memcmp(m_header.magic, USBTRACE_MAGIC, sizeof(m_header.magic)) != 0 ||
+        m_header.version != USBTRACE_VERSION)
+    {
+        m_errmsg << "'" << m_file << "' is not a version "
+                 << USBTRACE_VERSION << " USB trace.\n";
+        return false;
+    }
+    m_header.serial[sizeof(m_header.serial) - 1] = '\0';
+    m_header.name[sizeof(m_header.name) - 1] = '\0';
+
+    Record_t r;
+    while (ifs.read(reinterpret_cast<char *>(&r.rec), sizeof(r.rec)))
+    {
+        r.payload = m_data.size();
+        if (r.rec.flags & USBTRACE_HAS_PAYLOAD)
+        {
+            m_data.resize(m_data.size() + r.rec.length);
+            if (!ifs.read(reinterpret_cast<char *>(&m_data[r.payload]),
+                          r.rec.length))
+            {
+                WARNLOG << "USB trace '" << m_file << "' is truncated.";
+                m_data.resize(r.payload);
+                break;
+            }
+        }
+
+        r.ts = false;
+        if (r.rec.type == USBTRACE_BULK_READ && r.rec.result >= 0 &&
+            r.rec.length >= TS_PACKET && r.rec.length % TS_PACKET == 0)
+        {
+            if (r.rec.flags & USBTRACE_STREAM)
+                r.ts = true;
+            else if (r.rec.flags & USBTRACE_HAS_PAYLOAD)
+                r.ts = (m_data[r.payload] == 0x47);
+        }
+
+        if (r.rec.type == USBTRACE_BULK_READ)
+        {
+            uint8_t ep = r.rec.endpoint & 0x7F;
+            m_reads[ep].push_back(m_records.size());
+            if (r.ts)
+                m_ts_reads[ep].push_back(m_records.size());
+        }
+        m_records.push_back(r);
+    }
+
+    INFOLOG << "USB replay: " << m_records.size() << " records, "
+            << m_data.size() << " bytes of payload from '" << m_file << "'";
+
+    m_loaded = true;
+    return true;
+}
+
+/*
+ * Find the captured transfer that answers `want'.  Normally that is
+ * within a few records of the previous match; polling loops may spin
+ * a different number of times than when captured, so fall back to the
+ * first identical request anywhere in the trace.
+ */
+const USBReplay_t::Record_t *USBReplay_t::match(uint8_t type,
+                                           const USBTraceRecord_t & want)
+{
+    auto same = [type, &want](const Record_t & r)
+    {
+        if (r.rec.type != type)
+            return false;
+        if (type == USBTRACE_CONTROL)
+            return (r.rec.bmRequestType == want.bmRequestType &&
+                    r.rec.bRequest == want.bRequest &&
+                    r.rec.wValue == want.wValue &&
+                    r.rec.wIndex == want.wIndex &&
+                    r.rec.wLength == want.wLength);
+        return ((r.rec.endpoint & 0x7F) == (want.endpoint & 0x7F) &&
+                r.rec.requested == want.requested);
+    };
+
+    size_t end = min(m_cursor + LOOKAHEAD, m_records.size());
+    for (size_t idx = m_cursor; idx < end; ++idx)
+    {
+        if (same(m_records[idx]))
+        {
+            m_cursor = idx + 1;
+            return &m_records[idx];
+        }
+    }
+
+    auto Irec = find_if(m_records.begin(), m_records.end(), same);
+    if (Irec != m_records.end())
+        return &(*Irec);
+
+    ++m_mismatches;
+    return nullptr;
+}
+
+void USBReplay_t::fill(const Record_t & r, uint8_t *buf, uint32_t len)
+{
+    if (r.rec.flags & USBTRACE_HAS_PAYLOAD)
+    {
+        memcpy(buf, &m_data[r.payload], min(len, r.rec.length));
+        return;
+    }
+
+    if (!r.ts)
+    {
+        memset(buf, 0, len);
+        return;
+    }
+
+    for (uint32_t pos = 0; pos + TS_PACKET <= len; pos += TS_PACKET)
+    {
+        memcpy(buf + pos, null_ts, sizeof(null_ts));
+        memset(buf + pos + sizeof(null_ts), 0xFF,
+               TS_PACKET - sizeof(null_ts));
+    }
+}
+
+/*
+ * When `bytes' more of the stream may be delivered.  If the consumer
+ * fell more than a second behind (e.g. encoding was stopped) the
+ * clock starts over instead of bursting to catch up.
+ */
+chrono::steady_clock::time_point USBReplay_t::pace(size_t bytes)
+{
+    auto now = chrono::steady_clock::now();
+    auto due = m_pace_start + chrono::microseconds(static_cast<int64_t>
+                        (m_paced_bytes * 8000000.0 / m_rate));
+
+    if (m_paced_bytes == 0 || now - due > chrono::seconds(1))
+    {
+        m_pace_start = now;
+        m_paced_bytes = 0;
+    }
+
+    m_paced_bytes += bytes;
+    return m_pace_start + chrono::microseconds(static_cast<int64_t>
+                        (m_paced_bytes * 8000000.0 / m_rate));
+}
+
+int USBReplay_t::read(uint8_t num, uint8_t *buf, uint32_t len,
+                      uint32_t timeout)
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    if (!m_open)
+        return USBWRAP_ERROR_NO_DEVICE;
+
+    uint8_t ep = num & 0x7F;
+    const Record_t *r = nullptr;
+
+    vector<size_t> & reads = m_reads[ep];
+    size_t & pos = m_read_pos[ep];
+    if (pos < reads.size())
+        r = &m_records[reads[pos++]];
+    else
+    {
+        vector<size_t> & ts = m_ts_reads[ep];
+        if (!ts.empty())
+            r = &m_records[ts[m_ts_pos[ep]++ % ts.size()]];
+    }
+
+    if (r == nullptr)
+    {
+        // Nothing left to say on this endpoint.
+        lock.unlock();
+        this_thread::sleep_for(chrono::milliseconds
+                               (timeout ? min(timeout, 100U) : 100U));
+        return USBWRAP_ERROR_TIMEOUT;
+    }
+
+    if (r->rec.result < 0)
+        return r->rec.result;
+
+    uint32_t n = min(len, r->rec.length);
+    fill(*r, buf, n);
+
+    if (r->ts && m_rate)
+    {
+        auto due = pace(n);
+        lock.unlock();
+        this_thread::sleep_until(due);
+    }
+
+    return n;
+}
+
+bool USBReplay_t::Open(const string& serial)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!load())
+        return false;
+
+    string have(m_header.serial);
+    if (have.compare(0, serial.size(), serial) != 0)
+    {
+        m_errmsg << "USB trace '" << m_file << "' was captured from "
+                 << have << ", not " << serial << ".\n";
+        return false;
+    }
+
+    m_cursor = 0;
+    m_read_pos.clear();
+    m_ts_pos.clear();
+    m_paced_bytes = 0;
+    m_open = true;
+
+    INFOLOG << "Replaying " << m_header.name << " " << have << " from '"
+            << m_file << "' at " << m_rate << " bps";
+    return true;
+}
+
+void USBReplay_t::Close(void)
+{
+    stopStreaming();
+
+    lock_guard<mutex> lock(m_mutex);
+    if (m_open && m_mismatches)
+        WARNLOG << "USB replay: " << m_mismatches
+                << " requests were not in the trace.";
+    m_open = false;
+}
+
+/*
+ * A reset puts the device back to power-on state, so the start-up
+ * conversation will be repeated: rewind.
+ */
+bool USBReplay_t::Reset(void)
+{
+    stopStreaming();
+
+    lock_guard<mutex> lock(m_mutex);
+    m_cursor = 0;
+    m_read_pos.clear();
+    m_ts_pos.clear();
+    m_paced_bytes = 0;
+    return true;
+}
+
+bool USBReplay_t::DeviceList(DeviceIDVec& devs)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!load())
+        return false;
+
+    devs.push_back(make_tuple(m_header.vendor, m_header.product,
+                              string(m_header.serial),
+                              string(m_header.name), 0, 0));
+    return true;
+}
+
+void USBReplay_t::USBDevDesc(string& desc)
+{
+    ostringstream msg;
+
+    msg << "USB replay of '" << m_file << "'\n"
+        << "  Vendor:Product : " << hex << setfill('0')
+        << setw(4) << m_header.vendor << ":"
+        << setw(4) << m_header.product << dec << "\n"
+        << "  Serial         : " << m_header.serial << "\n"
+        << "  Records        : " << m_records.size() << "\n";
+    desc = msg.str();
+}
+
+string USBReplay_t::ErrorString(void)
+{
+    string msg = m_errmsg.str();
+    m_errmsg.str("");
+    return msg;
+}
+
+int USBReplay_t::controlMessage(USBWrapperControlMessage_t &msg,
+                                uint8_t *buf, uint32_t timeout)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_open)
+        return USBWRAP_ERROR_NO_DEVICE;
+
+    USBTraceRecord_t want = {};
+    want.bmRequestType = msg.bmRequestType;
+    want.bRequest      = msg.bRequest;
+    want.wValue        = msg.wValue;
+    want.wIndex        = msg.wIndex;
+    want.wLength       = msg.wLength;
+
+    bool in = (msg.bmRequestType & 0x80);
+    const Record_t *r = match(USBTRACE_CONTROL, want);
+    if (r == nullptr)
+    {
+        DEBUGLOG << "USB replay: no control transfer " << hex
+                 << static_cast<int>(msg.bmRequestType) << "/"
+                 << static_cast<int>(msg.bRequest) << " " << msg.wValue
+                 << " " << msg.wIndex << dec << " in trace.";
+        if (in)
+            memset(buf, 0, msg.wLength);
+        return msg.wLength;
+    }
+
+    if (in && r->rec.result > 0)
+        fill(*r, buf, r->rec.result);
+    return r->rec.result;
+}
+
+int USBReplay_t::bulkRead(uint8_t num, uint8_t *buf, uint32_t len,
+                          uint32_t timeout)
+{
+    return read(num, buf, len, timeout);
+}
+
+int USBReplay_t::bulkReadAsync(USBWrapperAsyncCtx_t *ctx,
+                               USBWrapperAtomicCtx_t *actx, uint8_t num,
+                               uint8_t *buf, uint32_t len, uint32_t timeout)
+{
+    // Completes before returning; pacing makes the caller wait here.
+    int r = read(num, buf, len, timeout);
+    int result = (r < 0) ? r : static_cast<int>(USBWRAP_SUCCESS);
+    uint32_t size = (r < 0) ? 0 : r;
+
+    if (ctx)
+        ctx->set(result, size);
+    else
+        actx->set(result, size);
+    return USBWRAP_SUCCESS;
+}
+
+int USBReplay_t::bulkWrite(uint8_t num, const uint8_t *buf, uint32_t len,
+                           uint32_t timeout)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if (!m_open)
+        return USBWRAP_ERROR_NO_DEVICE;
+
+    USBTraceRecord_t want = {};
+    want.endpoint  = num;
+    want.requested = len;
+
+    const Record_t *r = match(USBTRACE_BULK_WRITE, want);
+    return r ? r->rec.result : static_cast<int>(len);
+}
+
+int USBReplay_t::clearStall(uint8_t num)
+{
+    return m_open ? USBWRAP_SUCCESS : USBWRAP_ERROR_NO_DEVICE;
+}
+
+void USBReplay_t::stream_loop(uint8_t num, uint32_t xfer_size,
+                              uint32_t timeout)
+{
+    setThreadName("USB replay");
+
+    vector<uint8_t> buf(xfer_size);
+    while (m_streaming)
+    {
+        int r = read(num, buf.data(), xfer_size, timeout);
+        if (r > 0)
+            m_stream_cb(buf.data(), r);
+        else if (r == USBWRAP_ERROR_TIMEOUT || r == 0)
+            m_stream_cb(nullptr, 0);
+        else
+        {
+            ERRORLOG << "USB replay: stream read failed (" << r << ")";
+            m_stream_cb(nullptr, r);
+            break;
+        }
+    }
+}
+
+int USBReplay_t::startStreaming(uint8_t num, uint32_t xfer_size,
+                                int xfer_cnt, USBWrapper_t::stream_cb_t cb,
+                                uint32_t timeout)
+{
+    if (!m_open)
+        return USBWRAP_ERROR_NO_DEVICE;
+    if (m_streaming)
+        return USBWRAP_ERROR_BUSY;
+
+    m_stream_cb = cb;
+    m_streaming = true;
+    m_stream_thread = thread(&USBReplay_t::stream_loop, this,
+                             num, xfer_size, timeout);
+    return USBWRAP_SUCCESS;
+}
+
+int USBReplay_t::stopStreaming(void)
+{
+    m_streaming = false;
+    if (m_stream_thread.joinable())
+        m_stream_thread.join();
+    return USBWRAP_SUCCESS;
+}
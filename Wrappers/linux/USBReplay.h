@@ -0,0 +1,92 @@
+#ifndef __USBREPLAY_H_
+#define __USBREPLAY_H_
+
+#include <map>
+#include <chrono>
+
+#include "USBBackend.h"
+#include "USBTrace.h"
+
+/*
+ * Stands in for an HD-PVR2 by answering from a captured USBTrace file,
+ * so everything above USBWrapper_t can run on a machine without one.
+ *
+ * Control transfers and bulk writes are matched against the trace in
+ * order; requests the trace does not contain are acknowledged and
+ * counted.  Bulk reads are served per endpoint in the order they were
+ * captured.  Transport stream reads are paced to rate_bps and, once
+ * the trace runs out, loop over the captured stream.
+ */
+class USBReplay_t : public USBBackend_t
+{
+  public:
+    enum constants { LOOKAHEAD = 64, TS_PACKET = 188 };
+
+    USBReplay_t(const std::string & file, uint64_t rate_bps);
+    ~USBReplay_t(void);
+
+    bool Open(const std::string& serial);
+    void Close(void);
+    bool Reset(void);
+    bool DeviceList(DeviceIDVec& devs);
+    void USBDevDesc(std::string& desc);
+    std::string ErrorString(void);
+
+    int controlMessage(USBWrapperControlMessage_t &msg, uint8_t *buf,
+                       uint32_t timeout);
+    int bulkRead(uint8_t num, uint8_t *buf, uint32_t len, uint32_t timeout);
+    int bulkReadAsync(USBWrapperAsyncCtx_t *ctx, USBWrapperAtomicCtx_t *actx,
+                      uint8_t num, uint8_t *buf, uint32_t len,
+                      uint32_t timeout);
+    int bulkWrite(uint8_t num, const uint8_t *buf, uint32_t len,
+                  uint32_t timeout);
+    int clearStall(uint8_t num);
+
+    int startStreaming(uint8_t num, uint32_t xfer_size, int xfer_cnt,
+                       USBWrapper_t::stream_cb_t cb, uint32_t timeout);
+    int stopStreaming(void);
+
+    uint64_t Mismatches(void) const { return m_mismatches; }
+
+  private:
+    struct Record_t
+    {
+        USBTraceRecord_t rec;
+        size_t           payload;   // Offset into m_data
+        bool             ts;        // Carries transport stream
+    };
+
+    bool load(void);
+    const Record_t *match(uint8_t type, const USBTraceRecord_t & want);
+    int  read(uint8_t num, uint8_t *buf, uint32_t len, uint32_t timeout);
+    void fill(const Record_t & r, uint8_t *buf, uint32_t len);
+    std::chrono::steady_clock::time_point pace(size_t bytes);
+    void stream_loop(uint8_t num, uint32_t xfer_size, uint32_t timeout);
+
+    std::string           m_file;
+    uint64_t              m_rate;
+    bool                  m_loaded;
+    bool                  m_open;
+    USBTraceHeader_t      m_header;
+    std::vector<uint8_t>  m_data;
+    std::vector<Record_t> m_records;
+
+    std::mutex            m_mutex;
+    size_t                m_cursor;     // Next control/write record
+    std::map<uint8_t, std::vector<size_t> > m_reads;
+    std::map<uint8_t, std::vector<size_t> > m_ts_reads;
+    std::map<uint8_t, size_t> m_read_pos;
+    std::map<uint8_t, size_t> m_ts_pos;
+    std::atomic<uint64_t> m_mismatches;
+
+    std::chrono::steady_clock::time_point m_pace_start;
+    uint64_t              m_paced_bytes;
+
+    std::thread           m_stream_thread;
+    std::atomic<bool>     m_streaming;
+    USBWrapper_t::stream_cb_t m_stream_cb;
+
+    std::ostringstream    m_errmsg;
+};
+
+#endif
@@ -0,0 +1,524 @@
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "USBStandIn.h"
+
+using namespace std;
+
+using standin_clock = chrono::steady_clock;
+
+namespace
+{
+    enum constants { TS_PACKET = 188, IDLE_POLL_MS = 10 };
+
+    USBStandInConfig_t    config = { "E505-00-00STANDIN", 0, 0, 0 };
+    std::atomic<uint64_t> allocated(0);
+    std::atomic<uint64_t> overflowed(0);
+
+    // Kept in front of every libusb_transfer, as libusb does.
+    struct Priv_t
+    {
+        bool                     cancelled;
+        standin_clock::time_point deadline;
+    };
+    const size_t PRIV_SIZE = (sizeof(Priv_t) + alignof(max_align_t) - 1) /
+                             alignof(max_align_t) * alignof(max_align_t);
+
+    inline Priv_t *priv(libusb_transfer *t)
+    {
+        return reinterpret_cast<Priv_t *>
+            (reinterpret_cast<uint8_t *>(t) - PRIV_SIZE);
+    }
+}
+
+struct libusb_device
+{
+    int             refs;
+    libusb_context *ctx;
+};
+
+struct libusb_device_handle
+{
+    libusb_context *ctx;
+};
+
+/*
+ * The device side runs on its own thread: it works through submitted
+ * transfers in order, paced to config.rate_bps, and queues them as
+ * completed for whoever handles events.
+ */
+struct libusb_context
+{
+    mutex                     lock;
+    condition_variable        device_cond;
+    condition_variable        event_cond;
+    deque<libusb_transfer *>  submitted;
+    deque<libusb_transfer *>  completed;
+    bool                      run;
+    thread                    device;
+
+    uint64_t                  sent;     // Stream bytes handed out
+    standin_clock::time_point start;
+    libusb_device             dev;
+
+    void fill(uint8_t *buf, size_t len);
+    void complete(libusb_transfer *t, libusb_transfer_status st, int len);
+    void device_loop(void);
+};
+
+// Continue the packet stream where the last transfer left it.
+void libusb_context::fill(uint8_t *buf, size_t len)
+{
+    uint8_t pkt[TS_PACKET];
+
+    while (len > 0)
+    {
+        uint64_t seq = sent / TS_PACKET;
+        size_t   off = sent % TS_PACKET;
+
+        memset(pkt, 0xFF, sizeof(pkt));
+        pkt[0] = 0x47;
+        pkt[1] = USBStandInConfig_t::PID >> 8;
+        pkt[2] = USBStandInConfig_t::PID & 0xFF;
+        pkt[3] = 0x10 | (seq & 0x0F);
+        memcpy(pkt + USBStandInConfig_t::PAYLOAD, &seq, sizeof(seq));
+
+        size_t cnt = min(len, TS_PACKET - off);
+        memcpy(buf, pkt + off, cnt);
+        buf  += cnt;
+        len  -= cnt;
+        sent += cnt;
+    }
+}
+
+// Called with lock held.
+void libusb_context::complete(libusb_transfer *t, libusb_transfer_status st,
+                              int len)
+{
+    t->status = st;
+    t->actual_length = len;
+    completed.push_back(t);
+    event_cond.notify_all();
+}
+
+void libusb_context::device_loop(void)
+{
+    unique_lock<mutex> guard(lock);
+
+    while (run)
+    {
+        if (submitted.empty())
+        {
+            device_cond.wait(guard);
+            continue;
+        }
+
+        libusb_transfer *t = submitted.front();
+        auto now = standin_clock::now();
+
+        if (priv(t)->cancelled)
+        {
+            submitted.pop_front();
+            complete(t, LIBUSB_TRANSFER_CANCELLED, 0);
+            continue;
+        }
+        if (!(t->endpoint & LIBUSB_ENDPOINT_IN))
+        {
+            submitted.pop_front();
+            complete(t, LIBUSB_TRANSFER_COMPLETED, t->length);
+            continue;
+        }
+
+        if (config.limit_bytes && sent >= config.limit_bytes)
+        {
+            // Gone quiet: transfers can only time out or be cancelled.
+            auto wake = now + chrono::milliseconds(IDLE_POLL_MS);
+            for (auto It = submitted.begin(); It != submitted.end(); )
+            {
+                libusb_transfer *x = *It;
+                if (priv(x)->cancelled)
+                {
+                    It = submitted.erase(It);
+                    complete(x, LIBUSB_TRANSFER_CANCELLED, 0);
+                }
+                else if (x->timeout && priv(x)->deadline <= now)
+                {
+                    It = submitted.erase(It);
+                    complete(x, LIBUSB_TRANSFER_TIMED_OUT, 0);
+                }
+                else
+                {
+                    if (x->timeout)
+                        wake = min(wake, priv(x)->deadline);
+                    ++It;
+                }
+            }
+            device_cond.wait_until(guard, wake);
+            continue;
+        }
+
+        size_t len = t->length;
+        if (config.limit_bytes)
+            len = min<uint64_t>(len, config.limit_bytes - sent);
+
+        if (config.rate_bps)
+        {
+            if (sent == 0)
+                start = now;
+            if (config.fifo_bytes)
+            {
+                // The encoder does not wait: what it made beyond what
+                // the device holds while no transfer was queued is gone.
+                uint64_t made = chrono::duration_cast<chrono::microseconds>
+                                (now - start).count() *
+                                config.rate_bps / 8000000;
+                if (made > sent + config.fifo_bytes)
+                {
+                    uint64_t skip = (made - sent - config.fifo_bytes +
+                                     TS_PACKET - 1) / TS_PACKET * TS_PACKET;
+                    sent       += skip;
+                    overflowed += skip;
+                }
+            }
+            auto due = start + chrono::microseconds
+                       (static_cast<int64_t>((sent + len) * 8e6 /
+                                             config.rate_bps));
+            if (due > now)
+            {
+                // Woken early by a submit or cancel; look again.
+                device_cond.wait_until(guard, due);
+                if (standin_clock::now() < due)
+                    continue;
+            }
+        }
+
+        submitted.pop_front();
+        fill(t->buffer, len);
+        complete(t, LIBUSB_TRANSFER_COMPLETED, len);
+    }
+
+    for (libusb_transfer *t : submitted)
+        complete(t, LIBUSB_TRANSFER_CANCELLED, 0);
+    submitted.clear();
+}
+
+void USBStandIn_configure(const USBStandInConfig_t & cfg)
+{
+    config = cfg;
+}
+
+uint64_t USBStandIn_allocated(void)
+{
+    return allocated;
+}
+
+uint64_t USBStandIn_overflowed(void)
+{
+    return overflowed;
+}
+
+/**
+ * libusb
+ **/
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx)
+{
+    libusb_context *c = new libusb_context;
+    c->run  = true;
+    c->sent = 0;
+    c->dev.refs = 1;
+    c->dev.ctx  = c;
+    c->device = thread(&libusb_context::device_loop, c);
+    *ctx = c;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+    {
+        lock_guard<mutex> guard(ctx->lock);
+        ctx->run = false;
+        ctx->device_cond.notify_all();
+    }
+    ctx->device.join();
+    delete ctx;
+}
+
+void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode)
+{
+    switch (errcode)
+    {
+        case LIBUSB_SUCCESS:             return "Success";
+        case LIBUSB_ERROR_IO:            return "Input/Output Error";
+        case LIBUSB_ERROR_NOT_FOUND:     return "Entity not found";
+        case LIBUSB_ERROR_BUSY:          return "Resource busy";
+        case LIBUSB_ERROR_TIMEOUT:       return "Operation timed out";
+        case LIBUSB_ERROR_INTERRUPTED:   return "System call interrupted";
+        case LIBUSB_ERROR_NO_MEM:        return "Insufficient memory";
+        case LIBUSB_ERROR_NOT_SUPPORTED: return "Operation not supported";
+        default:                         return "Other error";
+    }
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+    return 0;
+}
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx,
+                        libusb_hotplug_event events, libusb_hotplug_flag flags,
+                        int vendor_id, int product_id, int dev_class,
+                        libusb_hotplug_callback_fn cb_fn, void *user_data,
+                        libusb_hotplug_callback_handle *handle)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx,
+                        libusb_hotplug_callback_handle handle)
+{
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
+                                           libusb_device ***list)
+{
+    *list = new libusb_device *[2];
+    (*list)[0] = libusb_ref_device(&ctx->dev);
+    (*list)[1] = nullptr;
+    return 1;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
+                                         int unref_devices)
+{
+    if (unref_devices)
+        for (libusb_device **dev = list; *dev; ++dev)
+            libusb_unref_device(*dev);
+    delete[] list;
+}
+
+libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
+{
+    ++dev->refs;
+    return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev)
+{
+    --dev->refs;
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev,
+                        struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength         = LIBUSB_DT_DEVICE_SIZE;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->idVendor        = 0x2040;
+    desc->idProduct       = 0xe505;
+    desc->iSerialNumber   = 3;
+    desc->bNumConfigurations = 1;
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device *dev,
+                        struct libusb_config_descriptor **config)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor(libusb_device *dev,
+                        uint8_t config_index,
+                        struct libusb_config_descriptor **config)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(
+                        struct libusb_config_descriptor *config)
+{
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+    return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device *dev)
+{
+    return 1;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device *dev,
+                        uint8_t *port_numbers, int port_numbers_len)
+{
+    // No sysfs entry to look at; the serial is read from the device.
+    return 0;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+    *handle = new libusb_device_handle;
+    (*handle)->ctx = dev->ctx;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+    delete dev_handle;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
+                        uint8_t desc_index, unsigned char *data, int length)
+{
+    int len = min<int>(config.serial.size(), length);
+    memcpy(data, config.serial.data(), len);
+    return len;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
+                                            int interface_number)
+{
+    return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
+                                            int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev,
+                                       int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev,
+                                         int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
+                                  unsigned char endpoint)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
+                        uint8_t request_type, uint8_t bRequest,
+                        uint16_t wValue, uint16_t wIndex,
+                        unsigned char *data, uint16_t wLength,
+                        unsigned int timeout)
+{
+    if (request_type & LIBUSB_ENDPOINT_IN)
+        memset(data, 0, wLength);
+    return wLength;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
+                        unsigned char endpoint, unsigned char *data,
+                        int length, int *actual_length, unsigned int timeout)
+{
+    libusb_context *ctx = dev_handle->ctx;
+    lock_guard<mutex> guard(ctx->lock);
+
+    if (endpoint & LIBUSB_ENDPOINT_IN)
+        ctx->fill(data, length);
+    *actual_length = length;
+    return LIBUSB_SUCCESS;
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+    size_t len = PRIV_SIZE + sizeof(libusb_transfer) +
+                 sizeof(libusb_iso_packet_descriptor) * iso_packets;
+    uint8_t *mem = static_cast<uint8_t *>(calloc(1, len));
+    if (mem == nullptr)
+        return nullptr;
+    ++allocated;
+
+    libusb_transfer *t = reinterpret_cast<libusb_transfer *>
+                         (mem + PRIV_SIZE);
+    t->num_iso_packets = iso_packets;
+    return t;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    if (transfer == nullptr)
+        return;
+    if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+        free(transfer->buffer);
+    free(reinterpret_cast<uint8_t *>(transfer) - PRIV_SIZE);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    libusb_context *ctx = transfer->dev_handle->ctx;
+    lock_guard<mutex> guard(ctx->lock);
+
+    priv(transfer)->cancelled = false;
+    priv(transfer)->deadline  = standin_clock::now() +
+                                chrono::milliseconds(transfer->timeout);
+    ctx->submitted.push_back(transfer);
+    ctx->device_cond.notify_all();
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    libusb_context *ctx = transfer->dev_handle->ctx;
+    lock_guard<mutex> guard(ctx->lock);
+
+    if (find(ctx->submitted.begin(), ctx->submitted.end(), transfer) ==
+        ctx->submitted.end())
+        return LIBUSB_ERROR_NOT_FOUND;
+    priv(transfer)->cancelled = true;
+    ctx->device_cond.notify_all();
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx,
+                        struct timeval *tv, int *completed)
+{
+    deque<libusb_transfer *> done;
+    {
+        unique_lock<mutex> guard(ctx->lock);
+        auto timeout = chrono::seconds(tv->tv_sec) +
+                       chrono::microseconds(tv->tv_usec);
+        ctx->event_cond.wait_for(guard, timeout,
+                                 [ctx] { return !ctx->completed.empty(); });
+        done.swap(ctx->completed);
+    }
+
+    for (libusb_transfer *t : done)
+    {
+        bool free_it = (t->flags & LIBUSB_TRANSFER_FREE_TRANSFER);
+        t->callback(t);
+        if (free_it)
+            libusb_free_transfer(t);
+    }
+    return LIBUSB_SUCCESS;
+}
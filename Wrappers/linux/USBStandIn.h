@@ -0,0 +1,38 @@
+#ifndef __USBSTANDIN_H_
+#define __USBSTANDIN_H_
+
+#include <cstdint>
+#include <string>
+
+/*
+ * A stand-in for libusb-1.0, linked into hauppauge2-usb-bench instead
+ * of the real library so the libusb side of USBWrapper_t -- transfer
+ * pool, completions, streaming -- can be run and timed without a
+ * device.
+ *
+ * It presents a single HD-PVR2.  Control transfers and bulk writes
+ * succeed at once.  Bulk IN transfers, on any endpoint, receive one
+ * continuous stream of TS packets on PID 0x100, each with a 64 bit
+ * sequence number at offset PAYLOAD.  Completions are queued for
+ * libusb_handle_events_timeout_completed(), as with the real thing.
+ */
+struct USBStandInConfig_t
+{
+    enum constants { PAYLOAD = 12, PID = 0x100 };
+
+    std::string serial;
+    uint64_t    rate_bps;       // 0 = as fast as transfers are submitted
+    uint64_t    limit_bytes;    // Go quiet after this many, 0 = never
+    uint64_t    fifo_bytes;     // With rate_bps, what the device holds
+                                // while no transfer is queued before
+                                // it loses data; 0 = unlimited
+};
+
+void USBStandIn_configure(const USBStandInConfig_t & config);
+
+// libusb_alloc_transfer() calls so far.
+uint64_t USBStandIn_allocated(void);
+// Stream bytes lost to a full FIFO so far.
+uint64_t USBStandIn_overflowed(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __USBTRACE_H_
+#define __USBTRACE_H_
+
+#include <cstdint>
+
+/*
+ * On-disk format of a captured USB session, written by USBRecorder_t
+ * and read by USBReplay_t.  Native (little endian) byte order, no padding:
+ *
+ *   USBTraceHeader_t
+ *   USBTraceRecord_t [payload]
+ *   USBTraceRecord_t [payload]
+ *   ...
+ *
+ * When a record has USBTRACE_HAS_PAYLOAD set it is followed by
+ * `length` bytes: the data returned by an IN transfer or sent by an
+ * OUT transfer.  Traces captured without payload still replay; IN
+ * data is then synthesized (null TS packets for stream reads, zeros
+ * otherwise).
+ */
+
+#define USBTRACE_MAGIC "HDPVR2TR"
+
+enum { USBTRACE_VERSION = 1 };
+
+typedef enum : uint8_t {
+        USBTRACE_CONTROL = 1,
+        USBTRACE_BULK_READ,
+        USBTRACE_BULK_WRITE,
+        USBTRACE_CLEAR_STALL,
+        USBTRACE_RESET
+} USBTraceType_t;
+
+// USBTraceRecord_t::flags
+enum {
+        USBTRACE_HAS_PAYLOAD = 0x01,
+        USBTRACE_STREAM      = 0x02   // Delivered by startStreaming
+};
+
+#pragma pack(push, 1)
+
+typedef struct {
+        char     magic[8];
+        uint32_t version;
+        uint16_t vendor;
+        uint16_t product;
+        char     serial[32];
+        char     name[64];
+} USBTraceHeader_t;
+
+typedef struct {
+        uint64_t time_us;       // Start, since the device was opened
+        uint32_t duration_us;   // 0 for asynchronous transfers
+        uint8_t  type;          // USBTraceType_t
+        uint8_t  flags;
+        uint8_t  endpoint;
+        uint8_t  bmRequestType; // Control transfers only
+        uint8_t  bRequest;
+        uint8_t  reserved;
+        uint16_t wValue;
+        uint16_t wIndex;
+        uint16_t wLength;
+        int32_t  result;        // Return value of the wrapper call
+        uint32_t requested;     // Bytes asked for
+        uint32_t length;        // Bytes transferred
+} USBTraceRecord_t;
+
+#pragma pack(pop)
+
+#endif
@@ -3,22 +3,81 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <chrono>
+#include <climits>
 #include <libusb.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
 
 #include "USBif.h"
+#include "USBBackend.h"
+#include "USBRecord.h"
 
 using namespace std;
 
+static USBWrapper_t::backend_factory_t backend_factory;
+static string record_file;
+static bool   record_payload = false;
+static int    xfer_pool = USBWrapper_t::XFER_POOL;
+
+void USBWrapper_t::setBackend(backend_factory_t factory)
+{
+    backend_factory = factory;
+}
+
+void USBWrapper_t::setRecord(const string & file, bool payload)
+{
+    record_file    = file;
+    record_payload = payload;
+}
+
+void USBWrapper_t::setTransferPool(int size)
+{
+    xfer_pool = size;
+}
+
 USBWrapper_t::USBWrapper_t(void)
     : m_use_error_cb(false)
     , m_ctx(nullptr)
-    , m_dev_list(nullptr)
-    , m_dev_cnt(0)
     , m_device(nullptr)
     , m_handle(nullptr)
+    , m_index_ready(false)
+    , m_hotplug_active(false)
+    , m_xfer_reused(0)
+    , m_xfer_exhausted(0)
+    , m_stream_dma(false)
+    , m_streaming(false)
+    , m_stream_inflight(0)
+    , m_stream_ep(0)
+    , m_stream_bytes(0)
+    , m_stream_errors(0)
+    , m_ra_arm(0)
+    , m_ra_ep(-1)
+    , m_ra_offset(0)
+    , m_ra_depth(0)
+    , m_ra_error(USBWRAP_SUCCESS)
+    , m_ra_queued(0)
+    , m_ra_direct(0)
+    , m_ra_dropped(0)
+    , m_event_run(false)
+    , m_ev_iterations(0)
+    , m_ev_late_max(0)
+    , m_ev_late_total(0)
+    , m_ev_late_cnt(0)
+    , m_ev_busy_max(0)
 {
     int ret;
 
+    if (backend_factory)
+    {
+        m_backend.reset(backend_factory());
+        return;
+    }
+
     if ((ret = libusb_init(&m_ctx)) < 0)
     {
         m_errmsg << "Failed to initialize libusb: " << ret << endl;
@@ -38,20 +97,42 @@ USBWrapper_t::USBWrapper_t(void)
     libusb_set_debug(m_ctx, LIBUSB_LOG_LEVEL_NONE);
 #endif
 
+    // Transfers for bulkReadAsync are allocated once and recycled.
+    m_xfer_slots.resize(xfer_pool);
+    for (AsyncSlot_t & slot : m_xfer_slots)
+    {
+        slot.usb  = this;
+        slot.ctx  = nullptr;
+        slot.actx = nullptr;
+        slot.xfer = libusb_alloc_transfer(0);
+        if (slot.xfer)
+            m_xfer_free.push_back(&slot);
+    }
 }
 
 USBWrapper_t::~USBWrapper_t(void)
 {
     Close();
+    stopEventThread();
+
+    if (m_xfer_free.size() != m_xfer_slots.size())
+        WARNLOG << (m_xfer_slots.size() - m_xfer_free.size())
+                << " async transfers still pending at shutdown.";
+    else
+    {
+        for (AsyncSlot_t & slot : m_xfer_slots)
+            libusb_free_transfer(slot.xfer);
+    }
+    DEBUGLOG << "Async transfer pool: " << m_xfer_reused << " reused, "
+             << m_xfer_exhausted << " times exhausted.";
+
+    index_clear();
+
     if (m_ctx)
     {
         libusb_exit(m_ctx);
         m_ctx = NULL;
     }
-    if (m_dev_list)
-        //free the list, unref the devices in it
-        libusb_free_device_list(m_dev_list, 0);
-
 }
 
 bool USBWrapper_t::DevName(string& name, struct libusb_device_descriptor& desc)
@@ -131,6 +212,12 @@ bool USBWrapper_t::DevName(string& name, struct libusb_device_descriptor& desc)
 
 void USBWrapper_t::USBDevDesc(string& descstr)
 {
+    if (m_backend)
+    {
+        m_backend->USBDevDesc(descstr);
+        return;
+    }
+
     int ret;
     ostringstream msg;
 
@@ -200,63 +287,324 @@ void USBWrapper_t::USBDevDesc(string& descstr)
     libusb_free_config_descriptor(config);
 }
 
-bool USBWrapper_t::DeviceList(DeviceIDVec& devs)
+/*
+ * The HD-PVR2 serial number is also published by the kernel in sysfs,
+ * which avoids opening (and disturbing) devices that may belong to
+ * another recorder process.  Fall back to reading the string
+ * descriptor when that is not available and open_ok allows it.
+ */
+bool USBWrapper_t::read_serial(libusb_device *dev, uint8_t idx,
+                               string& serial, bool open_ok)
 {
-    int idx = 0;
+    uint8_t ports[8];
+    int     cnt = libusb_get_port_numbers(dev, ports, sizeof(ports));
 
-    if (m_ctx == NULL)
+    if (cnt > 0)
     {
-        m_errmsg << "libusb not initialized.\n";
+        ostringstream path;
+        path << "/sys/bus/usb/devices/"
+             << static_cast<int>(libusb_get_bus_number(dev)) << '-';
+        for (int p = 0; p < cnt; ++p)
+            path << (p ? "." : "") << static_cast<int>(ports[p]);
+        path << "/serial";
+
+        ifstream ifs(path.str().c_str());
+        if (ifs && getline(ifs, serial) && !serial.empty())
+            return true;
+    }
+
+    if (!open_ok)
+        return false;
+
+    libusb_device_handle *handle;
+    char strDesc[257];
+
+    if (libusb_open(dev, &handle) < 0)
+    {
+        m_errmsg << "Failed to open dev.\n";
+        return false;
+    }
+    int r = libusb_get_string_descriptor_ascii(handle, idx,
+                       reinterpret_cast<unsigned char *>(strDesc), 256);
+    libusb_close(handle);
+
+    if (r < 0)
         return false;
+    serial.assign(strDesc, r);
+    return true;
+}
+
+/*
+ * Add dev to the index if it is a Hauppauge device.  Must be called
+ * with m_index_mutex held.
+ */
+bool USBWrapper_t::index_add(libusb_device *dev, bool open_ok)
+{
+    libusb_device_descriptor desc = {0};
+    USBDevEntry_t entry;
+
+    if (libusb_get_device_descriptor(dev, &desc) != 0 ||
+        !DevName(entry.name, desc) || desc.iSerialNumber == 0)
+        return false;
+
+    entry.dev     = libusb_ref_device(dev);
+    entry.vendor  = desc.idVendor;
+    entry.product = desc.idProduct;
+    entry.bus     = libusb_get_bus_number(dev);
+    entry.port    = libusb_get_port_number(dev);
+    read_serial(dev, desc.iSerialNumber, entry.serial, open_ok);
+
+    m_index.push_back(entry);
+    return true;
+}
+
+/*
+ * Retry sysfs for the serial numbers hotplug could not get.  Devices
+ * are not opened to ask them: one that arrived while we were running
+ * may already be another recorder's.  Must be called with
+ * m_index_mutex held.
+ */
+void USBWrapper_t::index_resolve(void)
+{
+    for (USBDevEntry_t & entry : m_index)
+    {
+        if (!entry.serial.empty() || entry.skipped)
+            continue;
+
+        libusb_device_descriptor desc = {0};
+        if (libusb_get_device_descriptor(entry.dev, &desc) == 0 &&
+            read_serial(entry.dev, desc.iSerialNumber, entry.serial, false))
+            continue;
+
+        WARNLOG << "USB device [Bus: " << static_cast<int>(entry.bus)
+                << " Port: " << static_cast<int>(entry.port)
+                << "]: serial number not in sysfs, skipping it.";
+        entry.skipped = true;
     }
+}
+
+int LIBUSB_CALL USBWrapper_t::hotplug_callback(libusb_context *ctx,
+                                               libusb_device *dev,
+                                               libusb_hotplug_event event,
+                                               void *user_data)
+{
+    USBWrapper_t *usb = reinterpret_cast<USBWrapper_t *>(user_data);
+    std::lock_guard<std::mutex> lock(usb->m_index_mutex);
 
-    if (m_dev_list == nullptr)
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+    {
+        // Opening the device is not allowed from here.
+        if (usb->index_add(dev, false))
+            INFOLOG << "USB device arrived: [Bus: "
+                    << static_cast<int>(usb->m_index.back().bus)
+                    << " Port: " << static_cast<int>(usb->m_index.back().port)
+                    << "] " << usb->m_index.back().serial;
+    }
+    else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
     {
-        if ((m_dev_cnt = libusb_get_device_list(m_ctx, &m_dev_list)) < 0)
+        auto Ientry = std::find_if(usb->m_index.begin(), usb->m_index.end(),
+                                   [dev](const USBDevEntry_t & entry)
+                                   { return entry.dev == dev; });
+        if (Ientry != usb->m_index.end())
         {
-            m_errmsg << "Failed to find any usb devices: " << m_dev_cnt << "\n";
-            return false;
+            INFOLOG << "USB device left: [Bus: "
+                    << static_cast<int>(Ientry->bus)
+                    << " Port: " << static_cast<int>(Ientry->port)
+                    << "] " << Ientry->serial;
+            libusb_unref_device(Ientry->dev);
+            usb->m_index.erase(Ientry);
         }
     }
 
-    if (m_dev_cnt == 0)
+    return 0; // Stay registered
+}
+
+/*
+ * Populate the device index.  Only the first call walks the bus,
+ * after that hotplug events keep it current.  Without hotplug support
+ * `rescan' walks it again; `force' does so even with hotplug, whose
+ * events may not have arrived yet.
+ */
+bool USBWrapper_t::index_build(bool rescan, bool force)
+{
+    if (m_ctx == NULL)
     {
-        m_errmsg << "No USB devices found.\n";
+        m_errmsg << "libusb not initialized.\n";
         return false;
     }
 
-    string name;
+    /*
+     * Register before taking m_index_mutex (see the lock order in
+     * USBif.h), and before the scan so nothing arriving during it is
+     * missed.  Anything the callback adds in between is cleared and
+     * found again by the scan.
+     */
+    if (!m_hotplug_active && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        int r = libusb_hotplug_register_callback(m_ctx,
+                    static_cast<libusb_hotplug_event>
+                    (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                    static_cast<libusb_hotplug_flag>(0), 0x2040,
+                    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                    hotplug_callback, this, &m_hotplug);
+        if (r == LIBUSB_SUCCESS)
+            m_hotplug_active = true;
+        else
+            WARNLOG << "USB hotplug not available: " << libusb_strerror(
+                    static_cast<libusb_error>(r));
+    }
+
+    std::lock_guard<std::mutex> lock(m_index_mutex);
 
-    for (idx = 0; idx < m_dev_cnt; ++idx)
+    if (m_index_ready && !(rescan && (force || !m_hotplug_active)))
     {
-        libusb_device *device = m_dev_list[idx];
-        libusb_device_descriptor desc = {0};
+        index_resolve();
+        return true;
+    }
 
-        if (libusb_get_device_descriptor(device, &desc) == 0 &&
-            DevName(name, desc) && desc.iSerialNumber > 0)
-        {
-            libusb_device_handle *handle;
-            char strDesc[257];
+    for (USBDevEntry_t & entry : m_index)
+        libusb_unref_device(entry.dev);
+    m_index.clear();
+
+    libusb_device **list;
+    ssize_t cnt = libusb_get_device_list(m_ctx, &list);
+    if (cnt < 0)
+    {
+        m_errmsg << "Failed to find any usb devices: " << cnt << "\n";
+        return false;
+    }
+
+    for (ssize_t idx = 0; idx < cnt; ++idx)
+    {
+        libusb_device *dev = list[idx];
+        if (std::none_of(m_index.begin(), m_index.end(),
+                         [dev](const USBDevEntry_t & entry)
+                         { return entry.dev == dev; }))
+            index_add(dev, true);
+    }
+    libusb_free_device_list(list, 1);
+
+    m_index_ready = true;
+    return true;
+}
+
+void USBWrapper_t::index_clear(void)
+{
+    if (m_hotplug_active)
+    {
+        libusb_hotplug_deregister_callback(m_ctx, m_hotplug);
+        m_hotplug_active = false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    for (USBDevEntry_t & entry : m_index)
+        libusb_unref_device(entry.dev);
+    m_index.clear();
+    m_index_ready = false;
+}
 
-            uint8_t bus  = libusb_get_bus_number(m_dev_list[idx]);
-            uint8_t port = libusb_get_port_number(m_dev_list[idx]);
+DeviceID USBWrapper_t::index_id(const USBDevEntry_t & entry)
+{
+    return make_tuple(entry.vendor, entry.product, entry.serial,
+                      entry.name, entry.bus, entry.port);
+}
+
+bool USBWrapper_t::DeviceList(DeviceIDVec& devs)
+{
+    if (m_backend)
+        return m_backend->DeviceList(devs);
+
+    if (!index_build())
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+
+    if (m_index.empty())
+    {
+        m_errmsg << "No USB devices found.\n";
+        return false;
+    }
+
+    for (const USBDevEntry_t & entry : m_index)
+    {
+        if (!entry.serial.empty())
+            devs.push_back(index_id(entry));
+    }
 
-            if (libusb_open(m_dev_list[idx], &handle) < 0)
+    return !devs.empty();
+}
+
+bool USBWrapper_t::Lookup(const string& serial, DeviceID& id)
+{
+    if (m_backend)
+    {
+        DeviceIDVec devs;
+        if (!m_backend->DeviceList(devs))
+            return false;
+        for (const DeviceID & dev : devs)
+        {
+            if (get<2>(dev) == serial)
             {
-                m_errmsg << "Failed to open dev.\n";
-                continue;
+                id = dev;
+                return true;
             }
+        }
+        return false;
+    }
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        if (!index_build(pass > 0))
+            return false;
 
-            libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
-                              reinterpret_cast<unsigned char *>(strDesc), 256);
-            devs.push_back(make_tuple(desc.idVendor, desc.idProduct,
-                                      strDesc, name, bus, port));
+        std::lock_guard<std::mutex> lock(m_index_mutex);
+        for (const USBDevEntry_t & entry : m_index)
+        {
+            if (!entry.serial.empty() && entry.serial == serial)
+            {
+                id = index_id(entry);
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-            libusb_close(handle);
+bool USBWrapper_t::Lookup(uint8_t bus, uint8_t port, DeviceID& id)
+{
+    if (m_backend)
+    {
+        DeviceIDVec devs;
+        if (!m_backend->DeviceList(devs))
+            return false;
+        for (const DeviceID & dev : devs)
+        {
+            if (get<4>(dev) == bus && get<5>(dev) == port)
+            {
+                id = dev;
+                return true;
+            }
         }
+        return false;
     }
 
-    return !devs.empty();
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        if (!index_build(pass > 0))
+            return false;
+
+        std::lock_guard<std::mutex> lock(m_index_mutex);
+        for (const USBDevEntry_t & entry : m_index)
+        {
+            if (entry.bus == bus && entry.port == port)
+            {
+                id = index_id(entry);
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
 #if 0
@@ -278,76 +626,67 @@ bool USBWrapper_t::ResetBus(uint8_t bus)
 
 bool USBWrapper_t::Open(const string& serial, callback_t * error_cb)
 {
-    int idx = 0;
     int ret = 0;
 
     if (error_cb)
         this->setErrorCB(*error_cb);
 
-    if (m_ctx == NULL)
-    {
-        m_errmsg << "libusb not initialized.\n";
-        return false;
-    }
-
-    if (m_dev_list == nullptr)
+    if (m_backend)
     {
-        if ((m_dev_cnt = libusb_get_device_list(m_ctx, &m_dev_list)) < 0)
-        {
-            m_errmsg << "Failed to find any usb devices: " << m_dev_cnt << "\n";
+        if (!m_backend->Open(serial))
             return false;
-        }
+        m_serial = serial;
+        record_start();
+        return true;
     }
 
-    string name;
-    char   strDesc[257];
-    int    serial_sz = serial.size();
-    libusb_device_handle *handle;
+    int serial_sz = serial.size();
 
-    for (int idx = 0; idx < m_dev_cnt; ++idx)
+    /*
+     * Only the matching device is opened.  If it is not in the index,
+     * rescan once in case the index predates it.
+     */
+    for (int pass = 0; pass < 2 && m_handle == nullptr; ++pass)
     {
-        struct libusb_device_descriptor desc;
-        if ((ret = libusb_get_device_descriptor(m_dev_list[idx], &desc)) < 0)
-        {
-            m_errmsg << "Failed to get USB description for dev.\n";
-            continue;
-        }
-
-        if (!DevName(name, desc))
-            continue;
+        if (!index_build(pass > 0))
+            return false;
 
-        if ((ret = libusb_open(m_dev_list[idx], &handle)) != 0)
+        std::lock_guard<std::mutex> lock(m_index_mutex);
+        for (const USBDevEntry_t & entry : m_index)
         {
-            m_errmsg << "Failed to open dev.";
-            continue;
-        }
+            if (entry.serial.compare(0, serial_sz, serial) != 0)
+                continue; // Wrong serial #
 
-        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
-                           reinterpret_cast<unsigned char *>(strDesc), 256);
+            libusb_device_handle *handle;
+            if ((ret = libusb_open(entry.dev, &handle)) != 0)
+            {
+                m_errmsg << "Failed to open dev.";
+                continue;
+            }
 
-        if (serial.compare(0, serial_sz, strDesc, serial_sz) != 0)
-        {
-            // Wrong serial #
-            libusb_close(handle);
-            continue;
-        }
+            if ((ret = libusb_get_device_descriptor(entry.dev, &m_desc)) < 0)
+            {
+                m_errmsg << "Failed to get USB description for dev.\n";
+                libusb_close(handle);
+                continue;
+            }
 
-        m_handle = handle;
-        m_device = m_dev_list[idx];
-        m_desc = desc;
-        m_name = name;
-        break;
+            m_handle = handle;
+            m_device = entry.dev;
+            m_name = entry.name;
+            m_serial = entry.serial;
+            m_msg << "Matched " << hex << m_desc.idVendor
+                  << ":0x" << m_desc.idProduct << " " << entry.serial << endl;
+            break;
+        }
     }
 
-    if (idx == m_dev_cnt)
+    if (m_handle == nullptr)
     {
         m_errmsg << "Unable to find serial " << serial << " in USB dev list.\n";
         return false;
     }
 
-    m_msg << "Matched " << hex << m_desc.idVendor
-          << ":0x" << m_desc.idProduct << " " << strDesc << endl;
-
     if ((ret = libusb_reset_device(m_handle)) != 0)
     {
         if (ret == LIBUSB_ERROR_NOT_FOUND)
@@ -375,11 +714,54 @@ bool USBWrapper_t::Open(const string& serial, callback_t * error_cb)
         m_errmsg << "Failed to claim interface.\n";
     }
 
+    record_start();
     return true;
 }
 
+/*
+ * The recorder lives as long as the wrapper, so a re-open during
+ * error recovery carries on in the same trace.
+ */
+void USBWrapper_t::record_start(void)
+{
+    if (record_file.empty() || m_recorder)
+        return;
+
+    USBTraceHeader_t header = {};
+    memcpy(header.magic, USBTRACE_MAGIC, sizeof(header.magic));
+    header.version = USBTRACE_VERSION;
+
+    DeviceID id;
+    if (m_backend)
+    {
+        DeviceIDVec devs;
+        if (m_backend->DeviceList(devs) && !devs.empty())
+            id = devs.front();
+    }
+    else
+        id = make_tuple(m_desc.idVendor, m_desc.idProduct, m_serial,
+                        m_name, 0, 0);
+    header.vendor  = get<0>(id);
+    header.product = get<1>(id);
+    strncpy(header.serial, get<2>(id).c_str(), sizeof(header.serial) - 1);
+    strncpy(header.name, get<3>(id).c_str(), sizeof(header.name) - 1);
+
+    m_recorder.reset(new USBRecorder_t(record_file, record_payload));
+    if (!m_recorder->Start(header))
+        m_recorder.reset();
+}
+
 void USBWrapper_t::Close(void)
 {
+    if (m_backend)
+    {
+        stopStreaming();
+        m_backend->Close();
+        return;
+    }
+
+    stopStreaming();
+
     if (m_handle)
     {
         libusb_release_interface(m_handle, 0);
@@ -397,6 +779,9 @@ string USBWrapper_t::MsgString(void)
 
 string USBWrapper_t::ErrorString(void)
 {
+    if (m_backend)
+        m_errmsg << m_backend->ErrorString();
+
     string msg = m_errmsg.str();
     m_errmsg.str("");
     return msg;
@@ -459,6 +844,17 @@ static const char *strTrSt(int st)
 
 #define ASSERT_OBJ(V, M) ASSERT_OBJ_CMD(, V, M)
 
+static void async_atomic_callback (libusb_transfer *t)
+{
+    USBWrapperAtomicCtx_t *ctx = (USBWrapperAtomicCtx_t*)t->user_data;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED)
+        ERRORLOG << "cannot finish async bulk read from endpoint --: ("
+                 << t->status << ") " << strTrSt(t->status);
+    if (ctx)
+        ctx->set(retTrSt(t->status), t->actual_length);
+}
+
 static void async_callback (libusb_transfer *t)
 {
     USBWrapperAsyncCtx_t *ctx = (USBWrapperAsyncCtx_t*)t->user_data;
@@ -474,12 +870,34 @@ static void async_callback (libusb_transfer *t)
 int USBWrapper_t::controlMessage(USBWrapperControlMessage_t &msg,
                           uint8_t *buf, uint32_t timeout)
 {
+    if (!m_recorder)
+        return control_message(msg, buf, timeout);
+
+    uint64_t start = m_recorder->Now();
+    int r = control_message(msg, buf, timeout);
+    m_recorder->Control(start, msg, r, buf);
+    return r;
+}
+
+int USBWrapper_t::control_message(USBWrapperControlMessage_t &msg,
+                                  uint8_t *buf, uint32_t timeout)
+{
+    int r;
+
+    if (m_backend)
+    {
+        if ((r = m_backend->controlMessage(msg, buf, timeout)) < 0 &&
+            m_use_error_cb)
+            m_error_cb();
+        return r;
+    }
+
     ASSERT_OBJ(m_handle, "cannot send control message: device is not opened");
     usleep(1);
 
-    int r = libusb_control_transfer(m_handle, msg.bmRequestType,
-                                    msg.bRequest, msg.wValue, msg.wIndex,
-                                    buf, msg.wLength, timeout);
+    r = libusb_control_transfer(m_handle, msg.bmRequestType,
+                                msg.bRequest, msg.wValue, msg.wIndex,
+                                buf, msg.wLength, timeout);
     if (r < 0)
     {
         ERRORLOG << "cannot send control message: " << strMsg(r);
@@ -494,6 +912,32 @@ int USBWrapper_t::controlMessage(USBWrapperControlMessage_t &msg,
 int USBWrapper_t::bulkRead(uint8_t num, uint8_t *buf, uint32_t len,
                            uint32_t timeout)
 {
+    if (m_ra_ep == (num & 0x7F))
+    {
+        USBWrapperAtomicCtx_t ctx;
+        ctx.init();
+        ra_read(nullptr, &ctx, buf, len, timeout);
+        ctx.wait();
+        int r = ctx.getState();
+        return (r < 0) ? r : static_cast<int>(ctx.size);
+    }
+
+    if (!m_recorder)
+        return bulk_read(num, buf, len, timeout);
+
+    uint64_t start = m_recorder->Now();
+    int r = bulk_read(num, buf, len, timeout);
+    m_recorder->Transfer(start, USBTRACE_BULK_READ, 0, num | 0x80, r, len,
+                         (r > 0) ? r : 0, buf);
+    return r;
+}
+
+int USBWrapper_t::bulk_read(uint8_t num, uint8_t *buf, uint32_t len,
+                            uint32_t timeout)
+{
+    if (m_backend)
+        return m_backend->bulkRead(num, buf, len, timeout);
+
     ASSERT_OBJ(m_handle, "cannot bulk read: device is not opened");
 
     int l = len;
@@ -521,23 +965,90 @@ int USBWrapper_t::bulkRead(uint8_t num, uint8_t *buf, uint32_t len,
     return l;
 }
 
-int USBWrapper_t::bulkReadAsync(USBWrapperAsyncCtx_t &ctx, uint8_t num,
-                                uint8_t *buf, uint32_t len, uint32_t timeout)
+void LIBUSB_CALL USBWrapper_t::pool_callback(libusb_transfer *t)
 {
-    ctx.init();
-    ASSERT_OBJ_CMD(ctx.set(ret, 0), m_handle,
-                   "cannot async bulk read: device is not opened");
-    libusb_transfer *t = libusb_alloc_transfer(0);
+    AsyncSlot_t           *slot = reinterpret_cast<AsyncSlot_t *>(t->user_data);
+    USBWrapperAsyncCtx_t  *ctx  = slot->ctx;
+    USBWrapperAtomicCtx_t *actx = slot->actx;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED)
+        ERRORLOG << "cannot finish async bulk read from endpoint --: ("
+                 << t->status << ") " << strTrSt(t->status);
+
+    // Give the transfer back before waking the waiter, so a read issued
+    // straight from the wakeup can reuse it.
+    int      status = t->status;
+    uint32_t length = t->actual_length;
+    USBRecorder_t *rec = slot->usb->m_recorder.get();
+    if (rec)
+        rec->Transfer(slot->submitted, USBTRACE_BULK_READ, 0, t->endpoint,
+                      retTrSt(status), t->length, length, t->buffer);
+    slot->usb->pool_put(slot);
+
+    if (ctx)
+        ctx->set(retTrSt(status), length);
+    else if (actx)
+        actx->set(retTrSt(status), length);
+}
+
+USBWrapper_t::AsyncSlot_t *USBWrapper_t::pool_get(void)
+{
+    std::lock_guard<std::mutex> lock(m_xfer_mutex);
+    if (m_xfer_free.empty())
+        return nullptr;
+    AsyncSlot_t *slot = m_xfer_free.back();
+    m_xfer_free.pop_back();
+    return slot;
+}
+
+void USBWrapper_t::pool_put(AsyncSlot_t *slot)
+{
+    std::lock_guard<std::mutex> lock(m_xfer_mutex);
+    slot->ctx  = nullptr;
+    slot->actx = nullptr;
+    m_xfer_free.push_back(slot);
+}
+
+int USBWrapper_t::submit_async(USBWrapperAsyncCtx_t *ctx,
+                               USBWrapperAtomicCtx_t *actx, uint8_t num,
+                               uint8_t *buf, uint32_t len, uint32_t timeout)
+{
+    libusb_transfer *t;
+    AsyncSlot_t     *slot = pool_get();
 
-    if (t == NULL)
+    if (slot)
     {
-        ERRORLOG << "cannot async bulk read: no memory";
-        return USBWRAP_ERROR_NO_MEM;
+        ++m_xfer_reused;
+        slot->ctx  = ctx;
+        slot->actx = actx;
+        slot->submitted = m_recorder ? m_recorder->Now() : 0;
+        t = slot->xfer;
+        libusb_fill_bulk_transfer(t, m_handle, num | 0x80, buf, len,
+                                  pool_callback, slot, timeout);
+    }
+    else
+    {
+        // Pool exhausted (or disabled), fall back to a one-shot
+        // transfer.  These are not seen by the recorder.
+        if (!m_xfer_slots.empty() && m_xfer_exhausted++ % 100 == 0)
+            WARNLOG << "Async transfer pool exhausted ("
+                    << m_xfer_exhausted << " times).";
+
+        t = libusb_alloc_transfer(0);
+        if (t == NULL)
+        {
+            ERRORLOG << "cannot async bulk read: no memory";
+            return USBWRAP_ERROR_NO_MEM;
+        }
+        if (ctx)
+            libusb_fill_bulk_transfer(t, m_handle, num | 0x80, buf, len,
+                                      async_callback, ctx, timeout);
+        else
+            libusb_fill_bulk_transfer(t, m_handle, num | 0x80, buf, len,
+                                      async_atomic_callback, actx, timeout);
+        t->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
     }
 
-    libusb_fill_bulk_transfer(t, m_handle, num | 0x80, buf, len,
-                              async_callback, &ctx, timeout);
-    t->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
     int r = libusb_submit_transfer(t);
 
     if (r)
@@ -545,18 +1056,82 @@ int USBWrapper_t::bulkReadAsync(USBWrapperAsyncCtx_t &ctx, uint8_t num,
         ERRORLOG << "cannot async bulk read from endpoint " << showbase
                  << setfill('0') << setw(2) << right << hex << num
                  << ": " << strMsg(r);
-        int _r = retMsg(r);
-        ctx.set(_r, 0);
-        return _r;
+        if (slot)
+            pool_put(slot);
+        else
+            libusb_free_transfer(t);
+        return retMsg(r);
     }
 
     return USBWRAP_SUCCESS;
 }
 
-int USBWrapper_t::bulkWrite(uint8_t num, const uint8_t *buf,
-                            uint32_t len, uint32_t timeout)
+int USBWrapper_t::bulkReadAsync(USBWrapperAsyncCtx_t &ctx, uint8_t num,
+                                uint8_t *buf, uint32_t len, uint32_t timeout)
 {
-    ASSERT_OBJ(m_handle, "cannot bulk write: device is not opened");
+    ctx.init();
+    if (m_ra_arm)
+        ra_start(num, len, timeout);
+    if (m_ra_ep == (num & 0x7F))
+    {
+        ra_read(&ctx, nullptr, buf, len, timeout);
+        return USBWRAP_SUCCESS;
+    }
+    if (m_backend)
+        return m_backend->bulkReadAsync(&ctx, nullptr, num, buf, len,
+                                        timeout);
+    ASSERT_OBJ_CMD(ctx.set(ret, 0), m_handle,
+                   "cannot async bulk read: device is not opened");
+
+    int r = submit_async(&ctx, nullptr, num, buf, len, timeout);
+    if (r != USBWRAP_SUCCESS)
+        ctx.set(r, 0);
+    return r;
+}
+
+int USBWrapper_t::bulkReadAsync(USBWrapperAtomicCtx_t &ctx, uint8_t num,
+                                uint8_t *buf, uint32_t len, uint32_t timeout)
+{
+    ctx.init();
+    if (m_ra_arm)
+        ra_start(num, len, timeout);
+    if (m_ra_ep == (num & 0x7F))
+    {
+        ra_read(nullptr, &ctx, buf, len, timeout);
+        return USBWRAP_SUCCESS;
+    }
+    if (m_backend)
+        return m_backend->bulkReadAsync(nullptr, &ctx, num, buf, len,
+                                        timeout);
+    ASSERT_OBJ_CMD(ctx.set(ret, 0), m_handle,
+                   "cannot async bulk read: device is not opened");
+
+    int r = submit_async(nullptr, &ctx, num, buf, len, timeout);
+    if (r != USBWRAP_SUCCESS)
+        ctx.set(r, 0);
+    return r;
+}
+
+int USBWrapper_t::bulkWrite(uint8_t num, const uint8_t *buf,
+                            uint32_t len, uint32_t timeout)
+{
+    if (!m_recorder)
+        return bulk_write(num, buf, len, timeout);
+
+    uint64_t start = m_recorder->Now();
+    int r = bulk_write(num, buf, len, timeout);
+    m_recorder->Transfer(start, USBTRACE_BULK_WRITE, 0, num & ~0x80, r, len,
+                         (r > 0) ? r : 0, buf);
+    return r;
+}
+
+int USBWrapper_t::bulk_write(uint8_t num, const uint8_t *buf,
+                             uint32_t len, uint32_t timeout)
+{
+    if (m_backend)
+        return m_backend->bulkWrite(num, buf, len, timeout);
+
+    ASSERT_OBJ(m_handle, "cannot bulk write: device is not opened");
 
     int l = len;
     int r = libusb_bulk_transfer(m_handle, num & ~0x80, (uint8_t*)buf,
@@ -571,8 +1146,99 @@ int USBWrapper_t::bulkWrite(uint8_t num, const uint8_t *buf,
     return len;
 }
 
+/*
+ * Try to get a misbehaving device back without giving it up: clear any
+ * stalled endpoint and reset it.  If the reset made the device
+ * re-enumerate the handle is stale, so it is opened again by serial.
+ */
+bool USBWrapper_t::Reset(void)
+{
+    if (m_recorder)
+        m_recorder->Event(USBTRACE_RESET, 0, 0);
+
+    if (m_backend)
+    {
+        stopStreaming();
+        return m_backend->Reset();
+    }
+
+    if (!m_handle)
+    {
+        // An earlier re-open gave up; the device may be back by now.
+        if (m_serial.empty())
+        {
+            m_errmsg << "Reset: device is not opened.\n";
+            return false;
+        }
+        return reopen();
+    }
+
+    stopStreaming();
+
+    libusb_config_descriptor *config;
+    if (libusb_get_active_config_descriptor(m_device, &config) == 0)
+    {
+        for (int i = 0; i < config->bNumInterfaces; ++i)
+        {
+            for (int a = 0; a < config->interface[i].num_altsetting; ++a)
+            {
+                const libusb_interface_descriptor & alt =
+                    config->interface[i].altsetting[a];
+                for (int e = 0; e < alt.bNumEndpoints; ++e)
+                    libusb_clear_halt(m_handle,
+                                      alt.endpoint[e].bEndpointAddress);
+            }
+        }
+        libusb_free_config_descriptor(config);
+    }
+
+    int r = libusb_reset_device(m_handle);
+    if (r == LIBUSB_SUCCESS)
+        return true;
+
+    if (r != LIBUSB_ERROR_NOT_FOUND)
+    {
+        m_errmsg << "Reset failed: " << strMsg(r) << "\n";
+        return false;
+    }
+
+    INFOLOG << "USB device " << m_serial << " re-enumerated, re-opening.";
+    Close();
+    return reopen();
+}
+
+/*
+ * Open m_serial again after it went away.  Re-enumeration takes a
+ * while, and hotplug may not have caught up, so walk the bus each
+ * time and keep trying for up to REOPEN_MS.
+ */
+bool USBWrapper_t::reopen(void)
+{
+    auto give_up = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(REOPEN_MS);
+    for (;;)
+    {
+        m_errmsg.str("");
+        if (index_build(true, true) && Open(m_serial))
+            return true;
+        if (std::chrono::steady_clock::now() >= give_up)
+            break;
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(REOPEN_POLL_MS));
+    }
+    m_errmsg << "Reset: " << m_serial << " did not come back within "
+             << REOPEN_MS << "ms.\n";
+    return false;
+}
+
 int USBWrapper_t::clearStall(uint8_t num)
 {
+    if (m_recorder)
+        m_recorder->Event(USBTRACE_CLEAR_STALL, num, 0);
+
+    if (m_backend)
+        return m_backend->clearStall(num);
+
     ASSERT_OBJ(m_handle, "cannot clear stall: device is not opened");
 
     int r = libusb_clear_halt(m_handle, num);
@@ -597,3 +1263,637 @@ int USBWrapper_t::abortControl()
     // stub yet
     return USBWRAP_SUCCESS;
 }
+
+/**
+ * USBWrapperAtomicCtx_t
+ **/
+
+static int futex_wait(std::atomic<int> *word, int expected,
+                      const struct timespec *timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<int *>(word),
+                   FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<int> *word)
+{
+    syscall(SYS_futex, reinterpret_cast<int *>(word),
+            FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/*
+ * Turn an absolute deadline into the relative timeout futex wants.
+ * Returns false once the deadline has passed.
+ */
+static bool time_left(const std::chrono::steady_clock::time_point & deadline,
+                      struct timespec & ts)
+{
+    auto left = deadline - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero())
+        return false;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left);
+    ts.tv_sec  = ns.count() / 1000000000;
+    ts.tv_nsec = ns.count() % 1000000000;
+    return true;
+}
+
+void USBWrapperAtomicCtx_t::wake(bool waiter)
+{
+    if (waiter)
+        futex_wake(&m_state);
+    if (m_group)
+    {
+        ++m_group->seq;
+        futex_wake(&m_group->seq);
+    }
+}
+
+bool USBWrapperAtomicCtx_t::wait(int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+    struct timespec ts;
+
+    for (;;)
+    {
+        int st = m_state.load(std::memory_order_acquire);
+        if (st == ST_FINISHED)
+            return true;
+
+        // Tell set() that it has to issue a wakeup.
+        if (st == ST_PENDING &&
+            !m_state.compare_exchange_weak(st, ST_WAITING,
+                                           std::memory_order_acq_rel))
+            continue;
+
+        if (timeout_ms < 0)
+            futex_wait(&m_state, ST_WAITING, nullptr);
+        else if (!time_left(deadline, ts))
+            return finished();
+        else
+            futex_wait(&m_state, ST_WAITING, &ts);
+    }
+}
+
+bool USBWrapperAtomicCtx_t::waitAll(USBWrapperAtomicCtx_t **ctxs, size_t cnt,
+                                    int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+
+    for (size_t idx = 0; idx < cnt; ++idx)
+    {
+        if (ctxs[idx]->finished())
+            continue;
+        if (timeout_ms < 0)
+        {
+            ctxs[idx]->wait(-1);
+            continue;
+        }
+
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+                    (deadline - std::chrono::steady_clock::now()).count();
+        if (!ctxs[idx]->wait(left > 0 ? left : 0))
+            return false;
+    }
+    return true;
+}
+
+int USBWrapperAtomicCtx_t::waitAny(USBWrapperAsyncGroup_t &group,
+                                   USBWrapperAtomicCtx_t **ctxs, size_t cnt,
+                                   int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+    struct timespec ts;
+
+    for (;;)
+    {
+        // Sample the sequence first so a completion after the scan is
+        // caught by futex_wait() returning immediately.
+        int seq = group.seq.load(std::memory_order_acquire);
+
+        for (size_t idx = 0; idx < cnt; ++idx)
+            if (ctxs[idx]->finished())
+                return idx;
+
+        if (timeout_ms < 0)
+            futex_wait(&group.seq, seq, nullptr);
+        else if (!time_left(deadline, ts))
+            return -1;
+        else
+            futex_wait(&group.seq, seq, &ts);
+    }
+}
+
+/**
+ * Streaming
+ **/
+
+void LIBUSB_CALL USBWrapper_t::stream_callback(libusb_transfer *t)
+{
+    USBWrapper_t *usb = reinterpret_cast<USBWrapper_t *>(t->user_data);
+
+    switch (t->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+        case LIBUSB_TRANSFER_TIMED_OUT:
+          // A timed out transfer may still carry a partial buffer.
+          if (t->actual_length > 0)
+          {
+              usb->m_stream_bytes += t->actual_length;
+              usb->m_stream_cb(t->buffer, t->actual_length);
+          }
+          if (t->status == LIBUSB_TRANSFER_TIMED_OUT)
+              usb->m_stream_cb(nullptr, 0);
+          break;
+        case LIBUSB_TRANSFER_CANCELLED:
+          break;
+        default:
+          ++usb->m_stream_errors;
+          ERRORLOG << "streaming from endpoint " << showbase << hex
+                   << static_cast<int>(usb->m_stream_ep) << dec
+                   << " failed: (" << t->status << ") "
+                   << strTrSt(t->status);
+          if (usb->m_streaming)
+          {
+              usb->m_streaming = false;
+              usb->m_stream_cb(nullptr, retTrSt(t->status));
+              if (usb->m_use_error_cb)
+                  usb->m_error_cb();
+          }
+          break;
+    }
+
+    if (usb->m_streaming && t->status != LIBUSB_TRANSFER_CANCELLED)
+    {
+        int r = libusb_submit_transfer(t);
+        if (r == LIBUSB_SUCCESS)
+            return;
+        ERRORLOG << "cannot resubmit streaming transfer: " << strMsg(r);
+    }
+
+    std::lock_guard<std::mutex> lock(usb->m_stream_mutex);
+    if (--usb->m_stream_inflight == 0)
+        usb->m_stream_cond.notify_all();
+}
+
+void USBWrapper_t::stream_free(void)
+{
+    for (libusb_transfer *t : m_stream_xfers)
+    {
+#if LIBUSB_API_VERSION >= 0x01000105
+        if (m_stream_dma)
+            libusb_dev_mem_free(m_handle, t->buffer, t->length);
+        else
+#endif
+            delete[] t->buffer;
+        libusb_free_transfer(t);
+    }
+    m_stream_xfers.clear();
+}
+
+int USBWrapper_t::startStreaming(uint8_t num, uint32_t xfer_size,
+                                 int xfer_cnt, stream_cb_t cb,
+                                 uint32_t timeout)
+{
+    if (m_recorder)
+    {
+        USBRecorder_t *rec = m_recorder.get();
+        stream_cb_t    deliver = cb;
+        cb = [rec, deliver, num, xfer_size](uint8_t *buf, int len)
+             {
+                 if (len > 0)
+                     rec->Transfer(rec->Now(), USBTRACE_BULK_READ,
+                                   USBTRACE_STREAM, num | 0x80, len,
+                                   xfer_size, len, buf);
+                 deliver(buf, len);
+             };
+    }
+
+    if (m_backend)
+    {
+        int r = m_backend->startStreaming(num, xfer_size, xfer_cnt,
+                                          cb, timeout);
+        m_streaming = (r == USBWRAP_SUCCESS);
+        return r;
+    }
+
+    ASSERT_OBJ(m_handle, "cannot start streaming: device is not opened");
+
+    if (m_streaming || !m_stream_xfers.empty())
+    {
+        ERRORLOG << "cannot start streaming: already streaming";
+        return USBWRAP_ERROR_BUSY;
+    }
+
+    // Completions are delivered by the event thread.
+    if (!startEventThread())
+        return USBWRAP_ERROR_OTHER;
+
+    m_stream_cb = cb;
+    m_stream_ep = num | 0x80;
+    m_stream_bytes = m_stream_errors = 0;
+
+    /*
+     * Use DMA-able memory straight from the kernel when libusb and
+     * the host controller driver support it.  It is all or nothing so
+     * stream_free() knows how to give the buffers back.
+     */
+    std::vector<uint8_t *> bufs;
+#if LIBUSB_API_VERSION >= 0x01000105
+    for (int idx = 0; idx < xfer_cnt; ++idx)
+    {
+        uint8_t *buf = libusb_dev_mem_alloc(m_handle, xfer_size);
+        if (buf == nullptr)
+            break;
+        bufs.push_back(buf);
+    }
+    if (static_cast<int>(bufs.size()) != xfer_cnt)
+    {
+        for (uint8_t *buf : bufs)
+            libusb_dev_mem_free(m_handle, buf, xfer_size);
+        bufs.clear();
+    }
+#endif
+    m_stream_dma = !bufs.empty();
+    while (static_cast<int>(bufs.size()) < xfer_cnt)
+        bufs.push_back(new uint8_t[xfer_size]);
+
+    for (int idx = 0; idx < xfer_cnt; ++idx)
+    {
+        libusb_transfer *t = libusb_alloc_transfer(0);
+        if (t == nullptr)
+        {
+            ERRORLOG << "cannot start streaming: no memory";
+            for (int jdx = idx; jdx < xfer_cnt; ++jdx)
+            {
+#if LIBUSB_API_VERSION >= 0x01000105
+                if (m_stream_dma)
+                    libusb_dev_mem_free(m_handle, bufs[jdx], xfer_size);
+                else
+#endif
+                    delete[] bufs[jdx];
+            }
+            stream_free();
+            return USBWRAP_ERROR_NO_MEM;
+        }
+        libusb_fill_bulk_transfer(t, m_handle, m_stream_ep,
+                                  bufs[idx], xfer_size,
+                                  stream_callback, this, timeout);
+        m_stream_xfers.push_back(t);
+    }
+
+    m_streaming = true;
+    for (libusb_transfer *t : m_stream_xfers)
+    {
+        // Count it first; the completion may run before submit returns.
+        ++m_stream_inflight;
+        int r = libusb_submit_transfer(t);
+        if (r != LIBUSB_SUCCESS)
+        {
+            --m_stream_inflight;
+            ERRORLOG << "cannot submit streaming transfer to endpoint "
+                     << showbase << hex << static_cast<int>(m_stream_ep)
+                     << dec << ": " << strMsg(r);
+            if (m_stream_inflight == 0)
+            {
+                m_streaming = false;
+                stream_free();
+                return retMsg(r);
+            }
+            break;
+        }
+    }
+
+    DEBUGLOG << "Streaming " << m_stream_inflight << " x " << xfer_size
+             << " byte " << (m_stream_dma ? "DMA " : "")
+             << "transfers from endpoint " << showbase << hex
+             << static_cast<int>(m_stream_ep);
+    return USBWRAP_SUCCESS;
+}
+
+int USBWrapper_t::stopStreaming(void)
+{
+    if (m_backend)
+    {
+        m_streaming = false;
+        int r = m_backend->stopStreaming();
+        ra_stop();
+        return r;
+    }
+
+    if (m_stream_xfers.empty())
+    {
+        ra_stop();
+        return USBWRAP_SUCCESS;
+    }
+
+    m_streaming = false;
+    for (libusb_transfer *t : m_stream_xfers)
+        libusb_cancel_transfer(t);
+
+    // Wait for the event thread to hand every transfer back.
+    {
+        std::unique_lock<std::mutex> lock(m_stream_mutex);
+        m_stream_cond.wait(lock, [this] { return m_stream_inflight == 0; });
+    }
+    stream_free();
+
+    DEBUGLOG << "Streaming stopped after " << m_stream_bytes << " bytes, "
+             << m_stream_errors << " errors.";
+    ra_stop();
+    return USBWRAP_SUCCESS;
+}
+
+/**
+ * Read-ahead
+ *
+ * ReadAheadWait_t completions are set() with m_ra_mutex held; set()
+ * takes no locks, so a reader woken by one may issue its next read
+ * straight away.
+ **/
+
+static void ra_complete(USBWrapperAsyncCtx_t *ctx,
+                        USBWrapperAtomicCtx_t *actx, int r, uint32_t size)
+{
+    if (ctx)
+        ctx->set(r, size);
+    else
+        actx->set(r, size);
+}
+
+void USBWrapper_t::ra_start(uint8_t num, uint32_t len, uint32_t timeout)
+{
+    int cnt = m_ra_arm.exchange(0);
+    if (cnt <= 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_ra_mutex);
+        m_ra_ring.clear();
+        m_ra_waits.clear();
+        m_ra_offset = 0;
+        m_ra_depth  = static_cast<size_t>(READ_AHEAD_DEPTH) * cnt;
+        m_ra_error  = USBWRAP_SUCCESS;
+        m_ra_queued = m_ra_direct = m_ra_dropped = 0;
+    }
+
+    int r = startStreaming(num, len, cnt,
+                           [this](uint8_t *buf, int n) { ra_deliver(buf, n); },
+                           timeout);
+    if (r != USBWRAP_SUCCESS)
+    {
+        WARNLOG << "Unable to read ahead on endpoint " << showbase << hex
+                << static_cast<int>(num | 0x80) << dec << " (" << r
+                << "), reading on demand.";
+        return;
+    }
+
+    m_ra_ep = num & 0x7F;
+    INFOLOG << "Reading ahead " << cnt << " x " << len
+            << " bytes from endpoint " << showbase << hex
+            << static_cast<int>(num | 0x80);
+}
+
+void USBWrapper_t::ra_read(USBWrapperAsyncCtx_t *ctx,
+                           USBWrapperAtomicCtx_t *actx,
+                           uint8_t *buf, uint32_t len, uint32_t timeout)
+{
+    std::lock_guard<std::mutex> lock(m_ra_mutex);
+
+    if (m_ra_ep < 0)
+    {
+        // Raced with stopStreaming().
+        ra_complete(ctx, actx, USBWRAP_ERROR_INTERRUPTED, 0);
+        return;
+    }
+
+    if (!m_ra_ring.empty())
+    {
+        // Like a bulk read, this ends with the transfer it lands in.
+        std::vector<uint8_t> & chunk = m_ra_ring.front();
+        uint32_t n = std::min<size_t>(len, chunk.size() - m_ra_offset);
+        memcpy(buf, chunk.data() + m_ra_offset, n);
+        m_ra_offset += n;
+        if (m_ra_offset == chunk.size())
+        {
+            m_ra_free.push_back(std::move(chunk));
+            m_ra_ring.pop_front();
+            m_ra_offset = 0;
+        }
+        ++m_ra_queued;
+        ra_complete(ctx, actx, USBWRAP_SUCCESS, n);
+        return;
+    }
+
+    if (m_ra_error != USBWRAP_SUCCESS)
+    {
+        ra_complete(ctx, actx, m_ra_error, 0);
+        return;
+    }
+
+    ReadAheadWait_t wait = { ctx, actx, buf, len,
+                             std::chrono::steady_clock::time_point::max() };
+    if (timeout)
+        wait.deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(timeout);
+    m_ra_waits.push_back(wait);
+}
+
+/*
+ * Stream callback.  Timeouts are only noticed when a streaming
+ * transfer times out too, so a waiting read may take up to twice its
+ * timeout to fail.
+ */
+void USBWrapper_t::ra_deliver(uint8_t *buf, int len)
+{
+    std::lock_guard<std::mutex> lock(m_ra_mutex);
+
+    if (len < 0)
+    {
+        m_ra_error = len;
+        for (ReadAheadWait_t & wait : m_ra_waits)
+            ra_complete(wait.ctx, wait.actx, len, 0);
+        m_ra_waits.clear();
+        return;
+    }
+
+    if (len == 0)
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!m_ra_waits.empty() && m_ra_waits.front().deadline <= now)
+        {
+            ReadAheadWait_t & wait = m_ra_waits.front();
+            ra_complete(wait.ctx, wait.actx, USBWRAP_ERROR_TIMEOUT, 0);
+            m_ra_waits.pop_front();
+        }
+        return;
+    }
+
+    int pos = 0;
+    while (pos < len && !m_ra_waits.empty())
+    {
+        ReadAheadWait_t & wait = m_ra_waits.front();
+        uint32_t n = std::min<uint32_t>(wait.len, len - pos);
+        memcpy(wait.buf, buf + pos, n);
+        ra_complete(wait.ctx, wait.actx, USBWRAP_SUCCESS, n);
+        m_ra_waits.pop_front();
+        ++m_ra_direct;
+        pos += n;
+    }
+    if (pos == len)
+        return;
+
+    if (m_ra_ring.size() >= m_ra_depth)
+    {
+        // The reader has fallen behind; lose the oldest data.
+        m_ra_free.push_back(std::move(m_ra_ring.front()));
+        m_ra_ring.pop_front();
+        m_ra_offset = 0;
+        if (m_ra_dropped++ % 100 == 0)
+            WARNLOG << "Read-ahead: reader is behind, " << m_ra_dropped
+                    << " buffers dropped.";
+    }
+
+    std::vector<uint8_t> chunk;
+    if (!m_ra_free.empty())
+    {
+        chunk = std::move(m_ra_free.back());
+        m_ra_free.pop_back();
+    }
+    chunk.assign(buf + pos, buf + len);
+    m_ra_ring.push_back(std::move(chunk));
+}
+
+void USBWrapper_t::ra_stop(void)
+{
+    m_ra_arm = 0;
+
+    std::lock_guard<std::mutex> lock(m_ra_mutex);
+    if (m_ra_ep < 0)
+        return;
+    m_ra_ep = -1;
+
+    for (ReadAheadWait_t & wait : m_ra_waits)
+        ra_complete(wait.ctx, wait.actx, USBWRAP_ERROR_INTERRUPTED, 0);
+    m_ra_waits.clear();
+    m_ra_ring.clear();
+    m_ra_free.clear();
+    m_ra_offset = 0;
+
+    INFOLOG << "Read-ahead: " << m_ra_queued << " reads answered from "
+            << "the queue, " << m_ra_direct << " waited for the stream, "
+            << m_ra_dropped << " buffers dropped.";
+}
+
+/**
+ * Event handling
+ **/
+
+void USBWrapper_t::event_loop(int rt_priority, int cpu)
+{
+    setThreadName("USB-events");
+
+    if (rt_priority > 0)
+    {
+        struct sched_param param;
+        param.sched_priority = rt_priority;
+        int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (r != 0)
+            WARNLOG << "Unable to set SCHED_FIFO priority " << rt_priority
+                    << " for USB event thread: " << strerror(r);
+        else
+            INFOLOG << "USB event thread: SCHED_FIFO priority "
+                    << rt_priority;
+    }
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (r != 0)
+            WARNLOG << "Unable to pin USB event thread to CPU " << cpu
+                    << ": " << strerror(r);
+        else
+            INFOLOG << "USB event thread: pinned to CPU " << cpu;
+    }
+
+    const auto timeout = std::chrono::milliseconds(EVENT_TIMEOUT_MS);
+    struct timeval tv = { 0, EVENT_TIMEOUT_MS * 1000 };
+
+    while (m_event_run)
+    {
+        auto start = std::chrono::steady_clock::now();
+        libusb_handle_events_timeout_completed(m_ctx, &tv, nullptr);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // Only this thread updates the statistics.
+        m_ev_iterations.store(m_ev_iterations + 1,
+                              std::memory_order_relaxed);
+        if (elapsed >= timeout)
+        {
+            uint64_t late = std::chrono::duration_cast
+                            <std::chrono::microseconds>
+                            (elapsed - timeout).count();
+            m_ev_late_total.store(m_ev_late_total + late,
+                                  std::memory_order_relaxed);
+            m_ev_late_cnt.store(m_ev_late_cnt + 1,
+                                std::memory_order_relaxed);
+            if (late > m_ev_late_max)
+                m_ev_late_max.store(late, std::memory_order_relaxed);
+        }
+        else
+        {
+            uint64_t busy = std::chrono::duration_cast
+                            <std::chrono::microseconds>(elapsed).count();
+            if (busy > m_ev_busy_max)
+                m_ev_busy_max.store(busy, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool USBWrapper_t::startEventThread(int rt_priority, int cpu)
+{
+    if (m_backend || m_event_thread.joinable())
+        return true;
+
+    if (m_ctx == NULL)
+    {
+        m_errmsg << "libusb not initialized.\n";
+        return false;
+    }
+
+    m_event_run = true;
+    m_event_thread = std::thread(&USBWrapper_t::event_loop, this,
+                                 rt_priority, cpu);
+    return true;
+}
+
+void USBWrapper_t::stopEventThread(void)
+{
+    if (!m_event_thread.joinable())
+        return;
+
+    m_event_run = false;
+#if LIBUSB_API_VERSION >= 0x01000105
+    libusb_interrupt_event_handler(m_ctx);
+#endif
+    m_event_thread.join();
+
+    EventStats_t st = eventStats();
+    DEBUGLOG << "USB event thread: " << st.iterations << " iterations, "
+             << "wakeup late max " << st.late_max << "us avg "
+             << st.late_avg << "us, busy max " << st.busy_max << "us.";
+}
+
+USBWrapper_t::EventStats_t USBWrapper_t::eventStats(void) const
+{
+    EventStats_t st;
+    st.iterations = m_ev_iterations;
+    st.late_max   = m_ev_late_max;
+    st.late_avg   = m_ev_late_cnt ? m_ev_late_total / m_ev_late_cnt : 0;
+    st.busy_max   = m_ev_busy_max;
+    return st;
+}
@@ -7,6 +7,13 @@
 #include <vector>
 #include <tuple>
 #include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <deque>
+#include <chrono>
 
 //#include "common.h"
 #include "log.h"
@@ -16,6 +23,22 @@ using DeviceID = std::tuple<int, int, std::string, std::string,
                             uint8_t, uint8_t>;
 using DeviceIDVec = std::vector<DeviceID>;
 
+// One known Hauppauge device.  dev holds a libusb reference.
+struct USBDevEntry_t
+{
+    libusb_device *dev;
+    int            vendor;
+    int            product;
+    std::string    serial;   // Empty until it could be read
+    bool           skipped = false;  // Unreadable serial was logged
+    std::string    name;
+    uint8_t        bus;
+    uint8_t        port;
+};
+
+class USBBackend_t;
+class USBRecorder_t;
+
 //struct USBWrapperControlMessage_t;
 //class USBWrapperAsyncCtx_t;
 
@@ -55,68 +78,143 @@ typedef struct {
         uint16_t wLength;
 } USBWrapperControlMessage_t;
 
-class USBWrapperAsyncCtx_t
+/*
+ * Completion object for bulkReadAsync built on a single atomic state
+ * word, for callers that poll a lot.  getState() and finished() never
+ * lock; wait() sleeps on the state word with futex(2), which measures
+ * timeouts against CLOCK_MONOTONIC.  set() only makes a syscall when
+ * somebody is actually waiting.
+ *
+ * Contexts that are waited on as a batch with waitAny() must share an
+ * USBWrapperAsyncGroup_t.
+ */
+class USBWrapperAsyncGroup_t
+{
+  public:
+    USBWrapperAsyncGroup_t(void) : seq(0) {}
+    std::atomic<int> seq;
+};
+
+class USBWrapperAtomicCtx_t
 {
   protected:
-    pthread_mutex_t m_mutex;
-    pthread_cond_t m_cond;
-    bool finished;
+    enum { ST_PENDING = 0, ST_WAITING = 1, ST_FINISHED = 2 };
+    std::atomic<int>        m_state;
+    USBWrapperAsyncGroup_t *m_group;
+
+    void wake(bool waiter);
+
   public:
-    int result;
+    std::atomic<int> result;
     uint32_t size;
-    USBWrapperAsyncCtx_t(): finished(true), result(USBWRAP_PENDING)
+
+    USBWrapperAtomicCtx_t(USBWrapperAsyncGroup_t *group = nullptr)
+        : m_state(ST_FINISHED), m_group(group)
+        , result(USBWRAP_PENDING), size(0) {}
+    ~USBWrapperAtomicCtx_t() { wait(); }
+
+    inline void init()
     {
-        pthread_mutex_init(&m_mutex, NULL);
-        pthread_cond_init(&m_cond, NULL);
+        result.store(USBWRAP_PENDING, std::memory_order_relaxed);
+        m_state.store(ST_PENDING, std::memory_order_release);
     }
-    ~USBWrapperAsyncCtx_t()
+    inline void set(int r, uint32_t s)
     {
-        wait();
-        pthread_cond_destroy(&m_cond);
-        pthread_mutex_destroy(&m_mutex);
+        // size is published by the release on result (for getState())
+        // and on m_state (for finished()).
+        size = s;
+        result.store(r, std::memory_order_release);
+        bool waiter = (m_state.exchange(ST_FINISHED,
+                                        std::memory_order_acq_rel)
+                       == ST_WAITING);
+        if (waiter || m_group)
+            wake(waiter);
     }
+    inline int getState() const
+    { return result.load(std::memory_order_acquire); }
+    inline bool finished() const
+    { return m_state.load(std::memory_order_acquire) == ST_FINISHED; }
+
+    inline void wait() { wait(-1); }
+    // Returns false if timeout_ms (-1 = forever) expired first.
+    bool wait(int timeout_ms);
+
+    // Wait for every context; false on timeout.
+    static bool waitAll(USBWrapperAtomicCtx_t **ctxs, size_t cnt,
+                        int timeout_ms = -1);
+    // Index of a finished context, or -1 on timeout.
+    static int waitAny(USBWrapperAsyncGroup_t &group,
+                       USBWrapperAtomicCtx_t **ctxs, size_t cnt,
+                       int timeout_ms = -1);
+};
+
+/*
+ * The completion object the SDK waits on.  It keeps its original
+ * interface but is now a thin shell around USBWrapperAtomicCtx_t, so
+ * completing a read, polling getState() and waiting no longer take a
+ * mutex.  result and size are written before the state word is
+ * released, and are valid once wait() returns or getState() is no
+ * longer USBWRAP_PENDING.
+ */
+class USBWrapperAsyncCtx_t
+{
+  protected:
+    USBWrapperAtomicCtx_t m_done;
+  public:
+    int result;
+    uint32_t size;
+    USBWrapperAsyncCtx_t(): result(USBWRAP_PENDING), size(0) {}
 
     inline void init()
     {
-        finished = false;
         result = USBWRAP_PENDING;
+        m_done.init();
     }
     inline void set(int r, uint32_t s)
     {
-        pthread_mutex_lock(&m_mutex);
-        finished = true;
         result = r;
         size = s;
-        pthread_cond_signal(&m_cond);
-        pthread_mutex_unlock(&m_mutex);
-    }
-    inline int getState()
-    {
-        pthread_mutex_lock(&m_mutex);
-        int r = result;
-        pthread_mutex_unlock(&m_mutex);
-        return r;
-    }
-    inline void wait()
-    {
-        pthread_mutex_lock(&m_mutex);
-        while(!finished) pthread_cond_wait(&m_cond, &m_mutex);
-        pthread_mutex_unlock(&m_mutex);
+        m_done.set(r, s);
     }
+    inline int getState() { return m_done.getState(); }
+    inline void wait() { m_done.wait(); }
 };
 
 class USBWrapper_t
 {
   public:
     using callback_t = std::function<void()>;
+    // Receives each completed bulk-IN buffer while streaming.  len > 0
+    // is data, 0 means a transfer timed out empty, and < 0 is the
+    // USBWrapperError_t that stopped the stream.
+    using stream_cb_t = std::function<void(uint8_t *buf, int len)>;
+    using backend_factory_t = std::function<USBBackend_t *(void)>;
+
+    enum constants { XFER_POOL = 32, EVENT_TIMEOUT_MS = 100,
+                     REOPEN_MS = 5000, REOPEN_POLL_MS = 250,
+                     READ_AHEAD_DEPTH = 4 };
+
+    // Event loop health, in microseconds.  "late" is how far past its
+    // timeout the event thread woke up when no USB event was pending,
+    // i.e. how long it waited for a CPU.
+    struct EventStats_t
+    {
+        uint64_t iterations;
+        uint64_t late_max;
+        uint64_t late_avg;
+        uint64_t busy_max;  // Longest pass through libusb with events
+    };
 
     USBWrapper_t(void);
     ~USBWrapper_t(void);
 
     bool Open(const std::string& serial, callback_t * error_cb = nullptr);
     void Close(void);
+    bool Reset(void);
 
     bool DeviceList(DeviceIDVec& devs);
+    bool Lookup(const std::string& serial, DeviceID& id);
+    bool Lookup(uint8_t bus, uint8_t port, DeviceID& id);
     void USBDevDesc(std::string& desc);
 
     std::string MsgString(void);
@@ -128,31 +226,183 @@ class USBWrapper_t
     int bulkRead(uint8_t num, uint8_t *buf, uint32_t len, uint32_t timeout);
     int bulkReadAsync(USBWrapperAsyncCtx_t &ctx, uint8_t num,
                       uint8_t *buf, uint32_t len, uint32_t timeout);
+    int bulkReadAsync(USBWrapperAtomicCtx_t &ctx, uint8_t num,
+                      uint8_t *buf, uint32_t len, uint32_t timeout);
     int bulkWrite(uint8_t num, const uint8_t *buf, uint32_t len,
                   uint32_t timeout);
     int clearStall(uint8_t num);
     int abort(uint8_t num);
     int abortControl();
 
+    /* Continuous bulk-IN streaming.  Keeps xfer_cnt transfers of
+     * xfer_size bytes in flight on endpoint num, resubmitting each one
+     * from its completion, and hands the data to cb. */
+    int startStreaming(uint8_t num, uint32_t xfer_size, int xfer_cnt,
+                       stream_cb_t cb, uint32_t timeout = 0);
+    int stopStreaming(void);
+    bool isStreaming(void) const { return m_streaming; }
+
+    /* Read-ahead for a reader that issues one bulk read at a time,
+     * like the encoder's data thread.  The next bulkReadAsync() starts
+     * streaming xfer_cnt transfers of its size from its endpoint; it
+     * and every later read of that endpoint are then answered from
+     * the stream, so the device never waits for a read to be issued.
+     * Up to READ_AHEAD_DEPTH * xfer_cnt buffers are held for a slow
+     * reader before the oldest is dropped.  stopStreaming() ends it,
+     * failing reads still waiting with USBWRAP_ERROR_INTERRUPTED. */
+    void readAhead(int xfer_cnt) { m_ra_arm = xfer_cnt; }
+
+    /* libusb event handling thread.  rt_priority > 0 selects
+     * SCHED_FIFO at that priority, cpu >= 0 pins the thread. */
+    bool startEventThread(int rt_priority = 0, int cpu = -1);
+    void stopEventThread(void);
+    EventStats_t eventStats(void) const;
+
+    /* bulkReadAsync transfer pool statistics */
+    uint64_t poolReused(void) const { return m_xfer_reused; }
+    uint64_t poolExhausted(void) const { return m_xfer_exhausted; }
+
     void setErrorCB(callback_t & cb) { m_error_cb = cb; m_use_error_cb = true; }
 
+    /* Route every USBWrapper_t created afterwards to a backend other
+     * than libusb, e.g. USBReplay_t.  An empty factory restores libusb. */
+    static void setBackend(backend_factory_t factory);
+
+    /* Capture all traffic of devices opened afterwards to a USBTrace
+     * file, optionally including the data transferred. */
+    static void setRecord(const std::string & file, bool payload);
+
+    /* Size of the bulkReadAsync transfer pool of every USBWrapper_t
+     * created afterwards; 0 allocates a transfer for each read. */
+    static void setTransferPool(int size);
+
   protected:
     callback_t  m_error_cb;
     bool        m_use_error_cb;
 
   private:
+    struct AsyncSlot_t
+    {
+        USBWrapper_t          *usb;
+        USBWrapperAsyncCtx_t  *ctx;
+        USBWrapperAtomicCtx_t *actx;
+        libusb_transfer       *xfer;
+        uint64_t               submitted;  // Recorder time
+    };
+
+    // A read waiting for the stream.
+    struct ReadAheadWait_t
+    {
+        USBWrapperAsyncCtx_t  *ctx;
+        USBWrapperAtomicCtx_t *actx;
+        uint8_t               *buf;
+        uint32_t               len;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
     bool DevName(std::string& name, struct libusb_device_descriptor& desc);
 
+    int control_message(USBWrapperControlMessage_t &msg, uint8_t *buf,
+                        uint32_t timeout);
+    int bulk_read(uint8_t num, uint8_t *buf, uint32_t len, uint32_t timeout);
+    int bulk_write(uint8_t num, const uint8_t *buf, uint32_t len,
+                   uint32_t timeout);
+
+    bool index_build(bool rescan = false, bool force = false);
+    void index_clear(void);
+    bool index_add(libusb_device *dev, bool open_ok);
+    void index_resolve(void);
+    bool read_serial(libusb_device *dev, uint8_t idx, std::string& serial,
+                     bool open_ok);
+    static DeviceID index_id(const USBDevEntry_t & entry);
+    static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
+                                            libusb_device *dev,
+                                            libusb_hotplug_event event,
+                                            void *user_data);
+
+    static void LIBUSB_CALL pool_callback(libusb_transfer *t);
+    AsyncSlot_t *pool_get(void);
+    void pool_put(AsyncSlot_t *slot);
+    int submit_async(USBWrapperAsyncCtx_t *ctx, USBWrapperAtomicCtx_t *actx,
+                     uint8_t num, uint8_t *buf, uint32_t len,
+                     uint32_t timeout);
+
+    static void LIBUSB_CALL stream_callback(libusb_transfer *t);
+    void stream_free(void);
+    void ra_start(uint8_t num, uint32_t len, uint32_t timeout);
+    void ra_read(USBWrapperAsyncCtx_t *ctx, USBWrapperAtomicCtx_t *actx,
+                 uint8_t *buf, uint32_t len, uint32_t timeout);
+    void ra_deliver(uint8_t *buf, int len);
+    void ra_stop(void);
+    void event_loop(int rt_priority, int cpu);
+    void record_start(void);
+    bool reopen(void);
+
+    std::unique_ptr<USBBackend_t> m_backend;
+    std::unique_ptr<USBRecorder_t> m_recorder;
     libusb_context       *m_ctx;
-    libusb_device       **m_dev_list;
-    int                   m_dev_cnt;
     libusb_device        *m_device;
     struct libusb_device_descriptor m_desc;
     std::string           m_name;
+    std::string           m_serial;   // Of the last device opened;
+                                      // kept over Close() for Reset()
     libusb_device_handle *m_handle;
 
     std::ostringstream    m_errmsg;
     std::ostringstream    m_msg;
+
+    /* Hauppauge devices on the bus.  Built once and then kept up to
+     * date by hotplug events, which arrive on the event thread.
+     * Lock order: libusb's hotplug lock, then m_index_mutex -- libusb
+     * calls hotplug_callback() with its lock held -- so nothing may
+     * call into libusb hotplug while holding m_index_mutex. */
+    std::vector<USBDevEntry_t>  m_index;
+    std::mutex            m_index_mutex;
+    bool                  m_index_ready;
+    bool                  m_hotplug_active;
+    libusb_hotplug_callback_handle m_hotplug;
+
+    std::vector<AsyncSlot_t>    m_xfer_slots;
+    std::vector<AsyncSlot_t *>  m_xfer_free;
+    std::mutex            m_xfer_mutex;
+    std::atomic<uint64_t> m_xfer_reused;
+    std::atomic<uint64_t> m_xfer_exhausted;
+
+    std::vector<libusb_transfer *> m_stream_xfers;
+    bool                  m_stream_dma;
+    stream_cb_t           m_stream_cb;
+    std::atomic<bool>     m_streaming;
+    std::atomic<int>      m_stream_inflight;
+    std::mutex            m_stream_mutex;
+    std::condition_variable m_stream_cond;
+    uint8_t               m_stream_ep;
+    uint64_t              m_stream_bytes;
+    uint64_t              m_stream_errors;
+
+    /* Read-ahead.  m_ra_ep is the endpoint being read ahead, -1 when
+     * off.  Data the reader has not asked for yet waits in m_ra_ring,
+     * readers the stream has not caught up with in m_ra_waits; only
+     * one of them is ever non-empty. */
+    std::atomic<int>      m_ra_arm;
+    std::atomic<int>      m_ra_ep;
+    std::mutex            m_ra_mutex;
+    std::deque<std::vector<uint8_t> >  m_ra_ring;
+    std::vector<std::vector<uint8_t> > m_ra_free;
+    size_t                m_ra_offset;  // Already read of m_ra_ring.front()
+    size_t                m_ra_depth;
+    std::deque<ReadAheadWait_t> m_ra_waits;
+    int                   m_ra_error;   // Why the stream stopped
+    uint64_t              m_ra_queued;  // Reads answered from m_ra_ring
+    uint64_t              m_ra_direct;  // Reads that waited for the stream
+    uint64_t              m_ra_dropped;
+
+    std::thread           m_event_thread;
+    std::atomic<bool>     m_event_run;
+    std::atomic<uint64_t> m_ev_iterations;
+    std::atomic<uint64_t> m_ev_late_max;
+    std::atomic<uint64_t> m_ev_late_total;
+    std::atomic<uint64_t> m_ev_late_cnt;
+    std::atomic<uint64_t> m_ev_busy_max;
 };
 
 #endif
@@ -1 +1 @@
-OBJS_WRAPPERS = log.o baseif.o registryif.o USBif.o I2Cif.o
+OBJS_WRAPPERS = log.o baseif.o registryif.o USBif.o USBReplay.o USBRecord.o I2Cif.o
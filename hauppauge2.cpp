@@ -27,6 +27,9 @@
 #include "Common.h"
 #include "HauppaugeDev.h"
 #include "MythTV.h"
+#include "FanOut.h"
+#include "PIDFilter.h"
+#include "USBReplay.h"
 
 #include <chrono>
 #include <iostream>
@@ -108,25 +111,17 @@ bool ListDevs(void)
 bool FindDev(const string & serial, int & bus, int & port)
 {
     USBWrapper_t usbio;
-    DeviceIDVec  devs;
-    DeviceIDVec::iterator Idev;
+    DeviceID     dev;
 
-    if (!usbio.DeviceList(devs))
+    if (!usbio.Lookup(serial, dev))
     {
         cerr << usbio.ErrorString();
         return false;
     }
 
-    for (Idev = devs.begin(); Idev != devs.end(); ++Idev)
-    {
-        if (get<2>(*Idev) == serial)
-        {
-            bus  = static_cast<int>(get<4>(*Idev));
-            port = static_cast<int>(get<5>(*Idev));
-            return true;
-        }
-    }
-    return false;
+    bus  = static_cast<int>(get<4>(dev));
+    port = static_cast<int>(get<5>(dev));
+    return true;
 }
 
 void PrintPosition(const chrono::seconds & elapsed,
@@ -239,6 +234,100 @@ int main(int argc, char *argv[])
          "Input Id (informational, set by MythTV)")
         ("duration", po::value<int>()->default_value(0),
          "Stop recording after duration")
+        ("usb-event-priority", po::value<int>()->default_value(0),
+         "SCHED_FIFO priority (1-99) of the USB event thread. "
+         "0 leaves it at normal priority.")
+        ("usb-event-cpu", po::value<int>()->default_value(-1),
+         "Pin the USB event thread to this CPU. -1 lets it float.")
+        ("usb-read-ahead", po::value<int>()->default_value(0),
+         "Keep this many transport stream transfers queued on the device "
+         "while encoding, instead of one read at a time. 0 (the "
+         "default) reads on demand.")
+        ("output-write-size", po::value<int>()->default_value(0),
+         "When --output is a file, write it in aligned chunks of this "
+         "many KB from a separate thread. Data is dropped, not waited "
+         "for, if the disk falls behind. 0 (the default) lets the "
+         "encoder write directly.")
+        ("output-prealloc", po::value<int>()->default_value(256),
+         "With --output-write-size, reserve space for the output file "
+         "this many MB at a time. 0 disables.")
+        ("output-sync", po::value<int>()->default_value(16),
+         "With --output-write-size, push the output file to disk every "
+         "this many MB, so dirty pages do not pile up. 0 disables.")
+        ("output-direct", po::value<bool>()->implicit_value(true)
+         ->default_value(false),
+         "With --output-write-size, write the output file with O_DIRECT, "
+         "bypassing the page cache.")
+        ("io-uring", po::value<bool>()->implicit_value(true)
+         ->default_value(false),
+         "Write the output (MythTV pipe or --output file) through "
+         "io_uring, so the writing thread never blocks in write(). Falls "
+         "back to plain writes if the kernel does not allow it.")
+        ("buffer-seconds", po::value<int>()->default_value(10),
+         "In MythTV mode, how many seconds of transport stream (at "
+         "tsbitrate) to queue while MythTV is not reading.")
+        ("reframe", po::value<bool>()->default_value(false),
+         "In MythTV mode, re-align the stream so only whole 188 byte TS "
+         "packets are passed on, skipping anything out of sync.")
+        ("ts-monitor", po::value<bool>()->default_value(false),
+         "In MythTV mode, track continuity errors, PCR interval and "
+         "jitter and bitrate per PID. Logged with the statistics and "
+         "returned by the TSHealth? command, which otherwise only "
+         "reports the buffer counters.")
+        ("strip-null", po::value<bool>()->default_value(false),
+         "In MythTV mode, drop null (padding) packets, PID 0x1FFF.")
+        ("pid-allow", po::value<string>(),
+         "In MythTV mode, only pass these PIDs (comma separated, decimal "
+         "or 0x hex). PAT, PMT and PCR are always passed.")
+        ("gop-drop", po::value<bool>()->default_value(false),
+         "In MythTV mode, when the buffer is overloaded drop video up to "
+         "the next IDR, keeping PAT/PMT and audio, instead of dropping "
+         "arbitrary chunks.")
+        ("spill-dir", po::value<string>(),
+         "In MythTV mode, move queued transport stream to a file in "
+         "this directory when the buffer runs short, e.g. during a "
+         "long XOFF.")
+        ("spill-max", po::value<int>()->default_value(2048),
+         "Size of the spill file in MB. It is reserved up front.")
+        ("pipe-size", po::value<int>()->default_value(0),
+         "In MythTV mode, resize the stdout pipe to this many KB. Limited "
+         "by /proc/sys/fs/pipe-max-size. 0 (the default) leaves it "
+         "alone.")
+        ("splice", po::value<bool>()->implicit_value(true)
+         ->default_value(false),
+         "In MythTV mode, hand the stream to the stdout pipe with "
+         "vmsplice instead of copying it with write(). Takes precedence "
+         "over --io-uring.")
+        ("pipe-tee", po::value<string>(),
+         "In MythTV mode, mirror the stream into this FIFO as well, "
+         "using tee(2). Best effort: a reader that falls behind misses "
+         "data. Implies --splice.")
+        ("fanout", po::value<vector<string> >()->composing(),
+         "In MythTV mode, also send the stream to this sink, without "
+         "another copy: file:PATH, fifo:PATH, udp:HOST:PORT or "
+         "rtp:HOST:PORT, then optionally ,drop (default) or ,close for "
+         "when it falls behind and ,queue=MB (default 16). udp and rtp "
+         "are paced by PCR and take ,smooth=MS (default 100, 0 sends as "
+         "received) and, for multicast, ,ttl=N and ,iface=NAME. May be "
+         "given more than once.")
+        ("output-stall", po::value<int>()->default_value(0),
+         "In MythTV mode, never block writing stdout, and shut down once "
+         "MythTV has read nothing for this many seconds or has closed "
+         "the pipe. 0 (the default) keeps stdout blocking.")
+        ("usb-recover-attempts", po::value<int>()->default_value(3),
+         "In MythTV mode, how many times to reset and re-open the "
+         "device after a USB error before giving up. 0 disables.")
+        ("usb-replay", po::value<string>(),
+         "Replay a captured USB trace instead of talking to a device.")
+        ("usb-replay-rate", po::value<int>()->default_value(0),
+         "Bits/sec to deliver the replayed transport stream at. "
+         "0 uses tsbitrate.")
+        ("record-usb", po::value<string>(),
+         "Capture all USB transactions to this file, for --usb-replay "
+         "or offline analysis.")
+        ("record-usb-payload", po::value<bool>()->implicit_value(true)
+         ->default_value(false),
+         "Include the transferred data in the --record-usb capture.")
 
         // Logging
         ("logpath", po::value<string>(),
@@ -323,6 +412,20 @@ int main(int argc, char *argv[])
 
     params.verbose = vm.count("verbose");
 
+    if (vm.count("usb-replay"))
+    {
+        string   trace = vm["usb-replay"].as<string>();
+        uint64_t rate  = vm["usb-replay-rate"].as<int>();
+        if (rate == 0)
+            rate = vm["tsbitrate"].as<int>();
+
+        USBWrapper_t::setBackend([trace, rate]()
+                                 { return new USBReplay_t(trace, rate); });
+    }
+    if (vm.count("record-usb"))
+        USBWrapper_t::setRecord(vm["record-usb"].as<string>(),
+                                vm["record-usb-payload"].as<bool>());
+
     if (vm.count("list"))
     {
         ListDevs();
@@ -414,6 +517,54 @@ int main(int argc, char *argv[])
 
     params.mythtv = (vm.count("mythtv")) ? vm["mythtv"].as<bool>() : false;
 
+    params.usbEventPriority = vm["usb-event-priority"].as<int>();
+    params.usbEventCPU      = vm["usb-event-cpu"].as<int>();
+    params.usbReadAhead     = vm["usb-read-ahead"].as<int>();
+    params.usbRecoverAttempts = vm["usb-recover-attempts"].as<int>();
+    params.bufferSeconds    = vm["buffer-seconds"].as<int>();
+    params.reframe          = vm["reframe"].as<bool>();
+    params.tsMonitor        = vm["ts-monitor"].as<bool>();
+    params.stripNull        = vm["strip-null"].as<bool>();
+    if (vm.count("pid-allow"))
+    {
+        string errmsg;
+        if (!PIDFilter::Parse(vm["pid-allow"].as<string>(),
+                              params.pidAllow, errmsg))
+        {
+            CRITLOG << errmsg;
+            return -1;
+        }
+    }
+    params.gopDrop          = vm["gop-drop"].as<bool>();
+    if (vm.count("spill-dir"))
+        params.spillDir = vm["spill-dir"].as<string>();
+    params.spillMax         = vm["spill-max"].as<int>();
+    params.pipeSize         = vm["pipe-size"].as<int>();
+    params.splice           = vm["splice"].as<bool>();
+    if (vm.count("pipe-tee"))
+        params.pipeTee = vm["pipe-tee"].as<string>();
+    params.outputStall      = vm["output-stall"].as<int>();
+    if (vm.count("fanout"))
+    {
+        params.fanout = vm["fanout"].as<vector<string> >();
+        for (const string & sink : params.fanout)
+        {
+            string       errmsg;
+            FanOut::Spec spec;
+            if (!FanOut::Parse(sink, spec, errmsg))
+            {
+                CRITLOG << errmsg;
+                return -1;
+            }
+        }
+    }
+
+    params.outputWriteSize  = vm["output-write-size"].as<int>();
+    params.outputPrealloc   = vm["output-prealloc"].as<int>();
+    params.outputSync       = vm["output-sync"].as<int>();
+    params.outputDirect     = vm["output-direct"].as<bool>();
+    params.ioUring          = vm["io-uring"].as<bool>();
+
     if (vm.count("output"))
         params.output = vm["output"].as<string>();
     else if (!params.mythtv)
@@ -435,6 +586,7 @@ int main(int argc, char *argv[])
         USBWrapper_t usbio;
         if (!usbio.Open(params.serial))
             return -3;
+        usbio.startEventThread(params.usbEventPriority, params.usbEventCPU);
 
         if (!dev.Open(usbio, (params.audioCodec == HAPI_AUDIO_CODEC_AC3)))
         {